@@ -5,7 +5,6 @@
 #include <cstddef>
 #include <algorithm>
 #include <limits>
-#include <unordered_set>
 #include <vector>
 #include <cmath>
 
@@ -14,7 +13,7 @@ namespace eris {
 BundleSigned::BundleSigned() {}
 BundleSigned::BundleSigned(MemberID g, double q) { set(g, q); }
 BundleSigned::BundleSigned(const BundleSigned &b) {
-    for (auto &g : b) set(g.first, g.second);
+    q_stack_.front() = b.q_stack_.front();
 }
 BundleSigned::BundleSigned(const std::initializer_list<std::pair<id_t, double>> &init) {
     for (auto &g : init) set(g.first, g.second);
@@ -22,10 +21,12 @@ BundleSigned::BundleSigned(const std::initializer_list<std::pair<id_t, double>>
 
 Bundle::Bundle() : BundleSigned() {}
 Bundle::Bundle(MemberID g, double q) : BundleSigned() { set(g, q); }
-Bundle::Bundle(const BundleSigned &b) : BundleSigned() {
-    for (auto &g : b) set(g.first, g.second);
+Bundle::Bundle(const BundleSigned &b) : BundleSigned(b) {
+    for (auto &g : *this) {
+        if (g.second < 0) throw negativity_error(g.first, g.second);
+    }
 }
-Bundle::Bundle(const Bundle &b) : Bundle((BundleSigned&) b) {}
+Bundle::Bundle(const Bundle &b) : BundleSigned(b) {}
 Bundle::Bundle(const std::initializer_list<std::pair<id_t, double>> &init) {
     for (auto &g : init) set(g.first, g.second);
 }
@@ -45,6 +46,7 @@ BundleSigned::valueproxy BundleSigned::operator[] (MemberID gid) {
 
 void BundleSigned::set(MemberID gid, double quantity) {
     q_stack_.front()[gid] = quantity;
+    changed();
 }
 
 void Bundle::set(MemberID gid, double quantity) {
@@ -76,13 +78,16 @@ void BundleSigned::clearZeros() {
         else
             ++it;
     }
+    changed();
 }
 
 void BundleSigned::clear() {
     q_stack_.front().clear();
+    changed();
 }
 
 int BundleSigned::erase(MemberID gid) {
+    changed();
     return q_stack_.front().erase(gid);
 }
 
@@ -144,7 +149,7 @@ Bundle Bundle::common(const BundleSigned &a, const BundleSigned &b) noexcept {
     for (auto &ag : a) {
         if (ag.second >= 0 and b.count(ag.first)) {
             double bq = b[ag.first];
-            if (bq >= 0) result.set(ag.first, std::min<double>(ag.second, bq));
+            if (bq >= 0) result.setUnchecked(ag.first, std::min<double>(ag.second, bq));
         }
     }
     return result;
@@ -171,19 +176,19 @@ Bundle Bundle::reduce(BundleSigned &a, BundleSigned &b) {
 
 Bundle BundleSigned::positive() const noexcept {
     Bundle b;
-    for (auto &g : *this) { if (g.second > 0) b.set(g.first, g.second); }
+    for (auto &g : *this) { if (g.second > 0) b.setUnchecked(g.first, g.second); }
     return b;
 }
 
 Bundle BundleSigned::negative() const noexcept {
     Bundle b;
-    for (auto &g : *this) { if (g.second < 0) b.set(g.first, -g.second); }
+    for (auto &g : *this) { if (g.second < 0) b.setUnchecked(g.first, -g.second); }
     return b;
 }
 
 Bundle BundleSigned::zeros() const noexcept {
     Bundle b;
-    for (auto &g : *this) { if (g.second == 0) b.set(g.first, 0); }
+    for (auto &g : *this) { if (g.second == 0) b.setUnchecked(g.first, 0); }
     return b;
 }
 
@@ -221,15 +226,16 @@ Bundle Bundle::operator / (double d) const {
 
 // All of the overloaded ==/</<=/>/>= methods are exactly the same, aside from the algebraic
 // operator; this macro handles that.  REVOP is the reverse order version of the operator, needed
-// for the static (e.g. 3 >= b) operator, as it just translate this into (b <= 3)
+// for the static (e.g. 3 >= b) operator, as it just translate this into (b <= 3).  Bundle-Bundle
+// comparisons first compare all of our goods, then the goods of `b` that we don't have (which are
+// compared against 0).
 #define _ERIS_BUNDLE_CPP_COMPARE(OP, REVOP) \
 bool BundleSigned::operator OP (const BundleSigned &b) const noexcept {\
-    std::unordered_set<id_t> goods;\
-    for (auto &g : *this) goods.insert(g.first);\
-    for (auto &g : b) goods.insert(g.first);\
-\
-    for (auto &g : goods)\
-        if (!(operator[](g) OP b[g])) return false;\
+    for (auto &g : *this)\
+        if (!(g.second OP b[g.first])) return false;\
+    auto &mine = q_stack_.front();\
+    for (auto &g : b)\
+        if (!(zero_ OP g.second) and mine.count(g.first) == 0) return false;\
     return true;\
 }\
 bool BundleSigned::operator OP (double q) const noexcept {\
@@ -262,13 +268,12 @@ bool operator != (double q, const BundleSigned &b) noexcept {
 
 BundleSigned& BundleSigned::operator = (const BundleSigned &b) {
     if (this == &b) return *this; // Assigning something to itself is a no-op.
-    beginTransaction();
-    try {
-        clear();
-        for (auto &g : b) set(g.first, g.second);
+    if (nonNegative()) {
+        for (auto &g : b)
+            if (g.second < 0) throw Bundle::negativity_error(g.first, g.second);
     }
-    catch (...) { abortTransaction(); throw; }
-    commitTransaction();
+    q_stack_.front() = b.q_stack_.front();
+    changed();
     return *this;
 }
 
@@ -277,12 +282,20 @@ Bundle& Bundle::operator = (const Bundle &b) {
     return *this;
 }
 
+// The +=/-= operators check all of the new values (if required) before changing anything, which
+// makes them atomic without needing a transaction.
 #define _ERIS_BUNDLE_CPP_ADDSUB(OP, OPEQ)\
 BundleSigned& BundleSigned::operator OPEQ (const BundleSigned &b) {\
-    beginTransaction();\
-    try { for (auto &g : b) set(g.first, operator[](g.first) OP g.second); }\
-    catch (...) { abortTransaction(); throw; }\
-    commitTransaction();\
+    auto &goods = q_stack_.front();\
+    if (nonNegative()) {\
+        for (auto &g : b) {\
+            auto found = goods.find(g.first);\
+            double q = (found == goods.end() ? zero_ : found->second) OP g.second;\
+            if (q < 0) throw Bundle::negativity_error(g.first, q);\
+        }\
+    }\
+    for (auto &g : b) goods[g.first] OPEQ g.second;\
+    changed();\
     return *this;\
 }\
 Bundle& Bundle::operator OPEQ (const BundleSigned &b) {\
@@ -318,10 +331,13 @@ Bundle Bundle::operator - (const Bundle &b) const {
 }
 
 BundleSigned& BundleSigned::operator *= (double m) {
-    beginTransaction();
-    try { for (auto &g : *this) set(g.first, g.second * m); }
-    catch (...) { abortTransaction(); throw; }
-    commitTransaction();
+    auto &goods = q_stack_.front();
+    if (m < 0 and nonNegative()) {
+        for (auto &g : goods)
+            if (g.second * m < 0) throw Bundle::negativity_error(g.first, g.second * m);
+    }
+    for (auto &g : goods) g.second *= m;
+    changed();
     return *this;
 }
 
@@ -386,6 +402,7 @@ void BundleSigned::abortTransaction() {
 
     // Remove the first element from the stack: it's been aborted.
     q_stack_.pop_front();
+    changed();
 }
 
 void BundleSigned::beginEncompassing() noexcept {
@@ -404,96 +421,163 @@ void BundleSigned::endEncompassing() {
 
 
 BundleSigned BundleSigned::transfer(const BundleSigned &amount, BundleSigned &to, double epsilon) {
-    beginTransaction(true);
-    to.beginTransaction(true);
+    // Calculate all the new values first and validate them before changing anything, so that we
+    // don't need transactions to make the transfer atomic.
+    std::vector<std::pair<id_t, double>> updated, updated_to;
+    updated.reserve(amount.size());
+    updated_to.reserve(amount.size());
     BundleSigned actual;
-    try {
-        for (auto &g : amount) {
-            double abs_transfer = std::abs(g.second);
-            if (abs_transfer == 0) continue;
-            bool transfer_to = g.second > 0;
+    const BundleSigned &from_c = *this, &to_c = to;
+    for (auto &g : amount) {
+        double abs_transfer = std::abs(g.second);
+        if (abs_transfer == 0) continue;
+        bool transfer_to = g.second > 0;
 
-            auto &src  = transfer_to ? *this : to;
-            auto &dest = transfer_to ? to : *this;
-            double q_src  = src[g.first];
-            double q_dest = dest[g.first];
+        double q_src  = transfer_to ? from_c[g.first] : to_c[g.first];
+        double q_dest = transfer_to ? to_c[g.first] : from_c[g.first];
 
-            if (std::abs(q_src - abs_transfer) < std::abs(epsilon*q_src))
-                abs_transfer = q_src;
-            else if (q_dest < 0 && std::abs(q_dest + abs_transfer) < std::abs(epsilon*q_dest))
-                abs_transfer = -q_dest;
+        if (std::abs(q_src - abs_transfer) < std::abs(epsilon*q_src))
+            abs_transfer = q_src;
+        else if (q_dest < 0 && std::abs(q_dest + abs_transfer) < std::abs(epsilon*q_dest))
+            abs_transfer = -q_dest;
 
-            if (transfer_to) {
-                set(g.first, q_src - abs_transfer);
-                to.set(g.first, q_dest + abs_transfer);
-                actual.set(g.first, abs_transfer);
-            }
-            else {
-                to.set(g.first, q_src - abs_transfer);
-                set(g.first, q_dest + abs_transfer);
-                actual.set(g.first, -abs_transfer);
-            }
+        if (transfer_to) {
+            updated.emplace_back(g.first, q_src - abs_transfer);
+            updated_to.emplace_back(g.first, q_dest + abs_transfer);
+            actual.setUnchecked(g.first, abs_transfer);
+        }
+        else {
+            updated_to.emplace_back(g.first, q_src - abs_transfer);
+            updated.emplace_back(g.first, q_dest + abs_transfer);
+            actual.setUnchecked(g.first, -abs_transfer);
         }
-        clearZeros();
-        to.clearZeros();
-        actual.clearZeros();
     }
-    catch (...) {
-        abortTransaction();
-        to.abortTransaction();
-        throw;
+
+    if (nonNegative()) {
+        for (auto &g : updated)
+            if (g.second < 0) throw Bundle::negativity_error(g.first, g.second);
     }
-    commitTransaction();
-    to.commitTransaction();
+    if (to.nonNegative()) {
+        for (auto &g : updated_to)
+            if (g.second < 0) throw Bundle::negativity_error(g.first, g.second);
+    }
+
+    for (auto &g : updated) setUnchecked(g.first, g.second);
+    for (auto &g : updated_to) to.setUnchecked(g.first, g.second);
+    clearZeros();
+    to.clearZeros();
     return actual;
 }
 
 BundleSigned BundleSigned::transfer(const BundleSigned &amount, double epsilon) {
-    beginTransaction(true);
+    // Calculate all the new values first, then assign them all at once: that way, if there's a
+    // negativity error, nothing gets changed.
+    std::vector<std::pair<id_t, double>> updated;
+    updated.reserve(amount.size());
     BundleSigned actual;
-    actual.beginEncompassing();
-    try {
-        for (auto &g : amount) {
-            double abs_transfer = std::abs(g.second);
-            if (abs_transfer == 0) continue;
-            bool transfer_to = g.second > 0;
+    const BundleSigned &current = *this;
+    for (auto &g : amount) {
+        double abs_transfer = std::abs(g.second);
+        if (abs_transfer == 0) continue;
+        bool transfer_to = g.second > 0;
 
-            double q = (*this)[g.first];
-            if (transfer_to and std::abs(q - abs_transfer) < std::abs(epsilon * q))
-                abs_transfer = q;
-            else if (not transfer_to and q < 0 and std::abs(q + abs_transfer) < std::abs(epsilon * q))
-                abs_transfer = -q;
-
-            if (transfer_to) {
-                set(g.first, q - abs_transfer);
-                actual.set(g.first, abs_transfer);
-            }
-            else {
-                set(g.first, q + abs_transfer);
-                actual.set(g.first, -abs_transfer);
-            }
+        double q = current[g.first];
+        if (transfer_to and std::abs(q - abs_transfer) < std::abs(epsilon * q))
+            abs_transfer = q;
+        else if (not transfer_to and q < 0 and std::abs(q + abs_transfer) < std::abs(epsilon * q))
+            abs_transfer = -q;
+
+        if (transfer_to) {
+            updated.emplace_back(g.first, q - abs_transfer);
+            actual.setUnchecked(g.first, abs_transfer);
+        }
+        else {
+            updated.emplace_back(g.first, q + abs_transfer);
+            actual.setUnchecked(g.first, -abs_transfer);
         }
-        clearZeros();
-    }
-    catch (...) {
-        abortTransaction();
-        throw;
     }
-    commitTransaction();
-    actual.endEncompassing();
+    assign(updated.begin(), updated.end());
+    clearZeros();
     return actual;
 }
 
 BundleSigned BundleSigned::transferTo(BundleSigned &to, double epsilon) {
-    beginTransaction(true);
-    to.beginTransaction(true);
     BundleSigned ret = transfer(*this, to, epsilon);
     clear();
-    commitTransaction();
-    to.commitTransaction();
     return ret;
 }
 
+std::vector<BundleSigned> BundleSigned::transferMany(const std::vector<transfer_spec> &transfers, double epsilon) {
+    // The new quantities of every bundle involved, calculated before anything is actually changed.
+    struct staged {
+        BundleSigned *bundle;
+        bool nonnegative;
+        std::unordered_map<id_t, double> q;
+    };
+    std::vector<staged> stage;
+    std::unordered_map<const BundleSigned*, size_t> stage_index;
+    // Returns the index of the given bundle in `stage`, adding it if necessary.
+    auto staging = [&](BundleSigned &b) -> size_t {
+        auto ins = stage_index.emplace(&b, stage.size());
+        if (ins.second) stage.push_back({&b, b.nonNegative(), {}});
+        return ins.first->second;
+    };
+    // Returns a reference to the (staged) quantity of good g in bundle s, initializing it from the
+    // bundle's current value if necessary.
+    auto quantity = [](staged &s, id_t g) -> double& {
+        auto found = s.q.find(g);
+        if (found != s.q.end()) return found->second;
+        return s.q.emplace(g, const_cast<const BundleSigned&>(*s.bundle)[g]).first->second;
+    };
+
+    std::vector<BundleSigned> actual;
+    actual.reserve(transfers.size());
+
+    for (auto &t : transfers) {
+        size_t from_i = staging(t.from), to_i = staging(t.to);
+
+        actual.emplace_back();
+        auto &done = actual.back();
+        for (auto &g : t.amount) {
+            double abs_transfer = std::abs(g.second);
+            if (abs_transfer == 0) continue;
+            bool transfer_to = g.second > 0;
+
+            double &q_src  = quantity(stage[transfer_to ? from_i : to_i], g.first);
+            double &q_dest = quantity(stage[transfer_to ? to_i : from_i], g.first);
+
+            if (std::abs(q_src - abs_transfer) < std::abs(epsilon*q_src))
+                abs_transfer = q_src;
+            else if (q_dest < 0 && std::abs(q_dest + abs_transfer) < std::abs(epsilon*q_dest))
+                abs_transfer = -q_dest;
+
+            q_src -= abs_transfer;
+            q_dest += abs_transfer;
+            done.BundleSigned::set(g.first, transfer_to ? abs_transfer : -abs_transfer);
+        }
+    }
+
+    // Validate everything before changing anything
+    for (auto &s : stage) {
+        if (not s.nonnegative) continue;
+        for (auto &g : s.q)
+            if (g.second < 0) throw Bundle::negativity_error(g.first, g.second);
+    }
+
+    // Everything is good, so write the new quantities.  We've already done the negativity checks,
+    // so we bypass the (virtual) Bundle::set() here.
+    for (auto &s : stage) {
+        auto &goods = s.bundle->q_stack_.front();
+        for (auto &g : s.q) {
+            if (g.second == 0) goods.erase(g.first);
+            else goods[g.first] = g.second;
+        }
+        s.bundle->changed();
+    }
+
+    return actual;
+}
+
 
 bool Bundle::hasApprox(const BundleSigned &amount, const Bundle &to, double epsilon) const {
     for (auto &g : amount) {
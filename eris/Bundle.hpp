@@ -1,5 +1,6 @@
 #pragma once
 #include <eris/types.hpp>
+#include <atomic>
 #include <stdexcept>
 #include <ostream>
 #include <unordered_map>
@@ -7,6 +8,7 @@
 #include <initializer_list>
 #include <string>
 #include <utility>
+#include <vector>
 
 namespace eris {
 
@@ -76,7 +78,9 @@ namespace eris {
 class Bundle;
 class BundleSigned {
     protected:
-        class valueproxy; // Predeclaration
+        template <class B> class valueproxy_t; // Predeclaration
+        /// The value proxy type returned by non-const BundleSigned::operator[]
+        using valueproxy = valueproxy_t<BundleSigned>;
     public:
         /// Constructs a new BundleSigned with no initial good/quantity values.
         BundleSigned();
@@ -99,7 +103,7 @@ class BundleSigned {
         BundleSigned(const BundleSigned &b);
 
         /** Move constructor.  Unlike the copy constructor, this preserves the transaction state. */
-        BundleSigned(BundleSigned &&b) = default;
+        BundleSigned(BundleSigned &&b) noexcept : q_stack_(std::move(b.q_stack_)), encompassed_(std::move(b.encompassed_)) {}
 
         /** Assigns the values of the given Bundle to the current Bundle.
          *
@@ -121,9 +125,30 @@ class BundleSigned {
          */
         valueproxy operator[] (MemberID gid);
 
-        /** Sets the quantity of the given good id to the given value. */
+        /** Sets the quantity of the given good id to the given value.
+         *
+         * Note that bulk operations (such as the `+=` operator, assignment, or assign()) do not
+         * call set() for each good; rather they validate all new values at once, then store them
+         * directly.
+         */
         virtual void set(MemberID gid, double quantity);
 
+        /** Sets the quantities of the goods in the given range of `std::pair<id_t, double>`-like
+         * (good, quantity) values, such as a `std::vector<std::pair<id_t, double>>` or
+         * `std::unordered_map<id_t, double>`.  Goods that are not in the range are not changed.
+         *
+         * This is equivalent to calling set() for each element, but considerably more efficient:
+         * the values are validated once, before any are changed, and then stored directly.
+         *
+         * \throws Bundle::negativity_error if this is a Bundle and any of the quantities are
+         * negative.  In this case the bundle is unchanged.
+         */
+        template <class ForwardIt> void assign(ForwardIt first, ForwardIt last);
+
+        /** Like assign(first, last), but takes a container (or any other object with begin() and
+         * end() methods), such as another BundleSigned. */
+        template <class Range> void assign(const Range &range) { assign(range.begin(), range.end()); }
+
         /** This method is is provided to be able to use a Bundle in a range for loop; it is, however, a
          * const_iterator, mapped internally to the underlying std::unordered_map's cbegin() method.
          */
@@ -169,6 +194,25 @@ class BundleSigned {
         /** Removes all goods/quantities from the Bundle. */
         void clear();
 
+        /** Returns the bundle's modification counter, which increases whenever any of the bundle's
+         * visible quantities may have changed.  This lets code that caches values derived from a
+         * bundle (for example, a market caching what its firms can supply) detect changes made
+         * through any path, including direct modification of an agent's `assets`.
+         *
+         * The counter is not copied along with the bundle's quantities: it is only meaningful for
+         * comparing the same bundle object over time.  It may be read without holding any lock on
+         * the bundle's owner.
+         */
+        unsigned long version() const noexcept { return version_.load(std::memory_order_relaxed); }
+
+        /** Sets an external counter that is incremented (atomically) along with version(), or
+         * clears it if given a null pointer.  This lets many bundles share a single counter that
+         * only stays the same if none of them has changed, such as the global Firm::supplyEpoch()
+         * shared by all firms' assets.  Like version(), the counter is not copied along with the
+         * bundle's quantities.
+         */
+        void versionEpoch(std::atomic<unsigned long> *epoch) noexcept { epoch_ = epoch; }
+
         /** Constructs a new Bundle consisting of all the strictly positive quantities of this
          * BundleSigned.  Note that goods with a quantity of 0 are not included. */
         Bundle positive() const noexcept;
@@ -310,6 +354,48 @@ class BundleSigned {
          */
         BundleSigned transferTo(BundleSigned &to, double epsilon = default_transfer_epsilon);
 
+        /** A single element of a batch transfer performed by transferMany().  Positive quantities
+         * in `amount` are transferred from `from` to `to`; negative quantities are transferred
+         * from `to` to `from`, exactly as in `from.transfer(amount, to)`.
+         */
+        struct transfer_spec {
+            /// The source bundle for positive quantities of `amount`
+            BundleSigned &from;
+            /// The destination bundle for positive quantities of `amount`
+            BundleSigned &to;
+            /// The amount to transfer
+            const BundleSigned &amount;
+        };
+
+        /** Performs a batch of transfers between any number of bundles as a single atomic
+         * operation.  The result is the same as calling `t.from.transfer(t.amount, t.to, epsilon)`
+         * for each element of `transfers`, in order, except that:
+         *
+         * - no transactions are started on any of the bundles involved: all of the resulting
+         *   quantities are calculated first, then validated in a single pass, and only then
+         *   written into the bundles.
+         * - only the final quantities of Bundle objects are required to be non-negative: a Bundle
+         *   may pass through a negative intermediate value (for example, when it receives goods
+         *   from a later element of `transfers` than the one that removes them).
+         * - only goods involved in the transfers that end up with quantities of exactly 0 are
+         *   removed from the bundles, rather than calling clearZeros() on every bundle involved.
+         *
+         * The same bundle may appear any number of times (as a source and/or destination) in
+         * `transfers`.  This is considerably cheaper than a sequence of transfer() calls when
+         * settling many transfers at once, such as when paying many suppliers at once.
+         *
+         * \param transfers the (from, to, amount) transfer specifications.
+         * \param epsilon the relative threshold, as in transfer(const BundleSigned&, BundleSigned&,
+         * double).
+         *
+         * \returns a vector of the exact amounts transferred, in the same order as `transfers`.
+         *
+         * \throws Bundle::negativity_error if any Bundle (as opposed to BundleSigned) involved
+         * would end up with a negative quantity.  In this case none of the bundles are modified.
+         */
+        static std::vector<BundleSigned> transferMany(const std::vector<transfer_spec> &transfers,
+                double epsilon = default_transfer_epsilon);
+
         /// Adds two BundleSigned objects together and returns the result.
         BundleSigned operator + (const BundleSigned &b) const;
         /// Subtracts one BundleSigned from another and returns the result.
@@ -482,15 +568,38 @@ class BundleSigned {
         /// Internal method used for bundle printing.
         void _print(std::ostream &os) const;
 
-        /// Value proxy class that maps individual good quantity manipulation into set() calls.
-        class valueproxy {
+        /** Returns true if this object requires non-negative quantities, i.e. if it is actually a
+         * Bundle.  Bulk operations call this once to determine whether the new quantities need to
+         * be checked, rather than checking each quantity via a virtual set() call.
+         */
+        virtual bool nonNegative() const noexcept { return false; }
+
+        /** Sets the quantity of the given good without any validation (and without a virtual
+         * call).  This is for internal use by operations that have already validated the new
+         * quantities.
+         */
+        void setUnchecked(MemberID gid, double quantity) { q_stack_.front()[gid] = quantity; changed(); }
+
+        /** Increments the version() counter.  Modifications are only made by the single thread
+         * holding the owner's lock, so this doesn't need an atomic read-modify-write (but the
+         * versionEpoch() counter, if any, is shared with other bundles, so does).
+         */
+        void changed() noexcept {
+            version_.store(version_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            if (epoch_) epoch_->fetch_add(1, std::memory_order_relaxed);
+        }
+
+        /** Value proxy class that maps individual good quantity manipulation into set() calls.
+         * The template parameter is the bundle type: for a Bundle, the set() call is non-virtual.
+         */
+        template <class B> class valueproxy_t {
             private:
-                BundleSigned &bundle_;
+                B &bundle_;
                 const id_t gid_;
             public:
-                valueproxy() = delete;
-                /// Constructs a valueproxy from a BundleSigned and good id of the proxied value
-                valueproxy(BundleSigned &bn, id_t gid) : bundle_(bn), gid_(gid) {}
+                valueproxy_t() = delete;
+                /// Constructs a value proxy from a bundle and good id of the proxied value
+                valueproxy_t(B &bn, id_t gid) : bundle_(bn), gid_(gid) {}
                 /// Assigns a new value to the proxied bundle quantity
                 void operator=(double q) { bundle_.set(gid_, q); }
                 /// Adds a value to the current proxied bundle quantity
@@ -502,7 +611,7 @@ class BundleSigned {
                 /// Scales the value of the current proxied bundle quantity
                 void operator/=(double q) { bundle_.set(gid_, *this / q); }
                 /// Const access to the double quantity underlying this proxy
-                operator const double&() const { return const_cast<const BundleSigned&>(bundle_)[gid_]; }
+                operator const double&() const { return const_cast<const B&>(bundle_)[gid_]; }
         };
 
     private:
@@ -516,6 +625,12 @@ class BundleSigned {
         // beginEncompassing()), if false.
         std::forward_list<bool> encompassed_;
 
+        // The modification counter returned by version()
+        std::atomic<unsigned long> version_{0};
+
+        // The shared counter set by versionEpoch(), if any
+        std::atomic<unsigned long> *epoch_ = nullptr;
+
         // Zero; returned as const double& when const-accessing a good that doesn't exist
         static constexpr double zero_ = 0.0;
 };
@@ -551,6 +666,16 @@ class Bundle final : public BundleSigned {
          */
         void set(MemberID gid, double quantity) override;
 
+        // Inherit the const version of operator[] (the non-const version below would otherwise
+        // hide it).
+        using BundleSigned::operator[];
+
+        /** Modifiable access to Bundle quantities given a good id.  This is identical to the
+         * BundleSigned version, except that the returned proxy object calls Bundle::set() directly
+         * rather than through a virtual call.
+         */
+        valueproxy_t<Bundle> operator[] (MemberID gid) { return valueproxy_t<Bundle>(*this, gid); }
+
         /** Assigns a bundle to this bundle.  The transaction state of the current bundle is
          * maintained, while only the currently-visible values of the given bundle are copied
          * into the current bundle (or bundle transaction, if one is in progress).
@@ -561,8 +686,9 @@ class Bundle final : public BundleSigned {
          * BundleSigned += operator, but returns the object cast as a Bundle& rather than
          * BundleSigned&.
          *
-         * The addition is carried out in a transaction: that is, if it fails because some
-         * quantities would become negative, no quantities will have been changed.
+         * The addition is atomic: all new quantities are checked before any are changed, so if it
+         * fails because some quantities would become negative, no quantities will have been
+         * changed.
          */
         Bundle& operator += (const BundleSigned &b);
 
@@ -570,8 +696,9 @@ class Bundle final : public BundleSigned {
          * BundleSigned += operator, but returns the object cast as a Bundle& instead of a
          * BundleSigned&.
          *
-         * The subtraction is carried out in a transaction: that is, if it fails because some
-         * quantities would become negative, no quantities will have been changed.
+         * The subtraction is atomic: all new quantities are checked before any are changed, so if
+         * it fails because some quantities would become negative, no quantities will have been
+         * changed.
          */
         Bundle& operator -= (const BundleSigned &b);
 
@@ -814,6 +941,20 @@ class Bundle final : public BundleSigned {
                 /// The illegal value that caused the error
                 const double value;
         };
+
+    protected:
+        /// Returns true: Bundle quantities may not be negative.
+        bool nonNegative() const noexcept override { return true; }
 };
 
+template <class ForwardIt> void BundleSigned::assign(ForwardIt first, ForwardIt last) {
+    if (nonNegative()) {
+        for (auto it = first; it != last; ++it)
+            if (it->second < 0) throw Bundle::negativity_error(it->first, it->second);
+    }
+    auto &goods = q_stack_.front();
+    for (; first != last; ++first) goods[first->first] = first->second;
+    changed();
+}
+
 }
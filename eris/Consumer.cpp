@@ -1,4 +1,6 @@
 #include <eris/Consumer.hpp>
+#include <stdexcept>
+#include <unordered_map>
 
 namespace eris {
 
@@ -6,6 +8,46 @@ double Consumer::currUtility() const {
     return utility(assets);
 }
 
+Eigen::VectorXd Consumer::utilityBatch(const BundleNegative &base, const std::vector<id_t> &goods,
+        const Eigen::MatrixXd &deltas) const {
+    if ((size_t) deltas.rows() != goods.size())
+        throw std::invalid_argument("Consumer::utilityBatch: deltas must have one row per good");
+
+    Eigen::VectorXd u(deltas.cols());
+    for (int j = 0; j < deltas.cols(); j++) {
+        BundleNegative b(base);
+        for (size_t i = 0; i < goods.size(); i++) {
+            if (deltas(i, j) != 0) b[goods[i]] += deltas(i, j);
+        }
+        u[j] = utility(b);
+    }
+
+    return u;
+}
+
+std::vector<id_t> Consumer::batchQuantities(const BundleNegative &base, const std::vector<id_t> &goods,
+        const Eigen::MatrixXd &deltas, Eigen::MatrixXd &quantities) {
+    if ((size_t) deltas.rows() != goods.size())
+        throw std::invalid_argument("Consumer::utilityBatch: deltas must have one row per good");
+
+    std::vector<id_t> all;
+    std::unordered_map<id_t, size_t> row;
+    for (auto &g : goods) {
+        if (row.emplace(g, all.size()).second) all.push_back(g);
+    }
+    for (auto &g : base) {
+        if (row.emplace(g.first, all.size()).second) all.push_back(g.first);
+    }
+
+    quantities.resize(all.size(), deltas.cols());
+    for (size_t i = 0; i < all.size(); i++)
+        quantities.row(i).setConstant(base[all[i]]);
+    for (size_t i = 0; i < goods.size(); i++)
+        quantities.row(row[goods[i]]) += deltas.row(i);
+
+    return all;
+}
+
 std::map<id_t, double> Consumer::Differentiable::gradient(const std::vector<id_t> &goods, const BundleNegative &b) const {
     std::map<id_t, double> grad;
     for (auto good : goods)
@@ -31,4 +73,23 @@ std::map<id_t, std::map<id_t, double>> Consumer::Differentiable::hessian(const s
     return hess;
 }
 
+Eigen::VectorXd Consumer::Differentiable::gradientVector(const std::vector<id_t> &goods, const BundleNegative &b) const {
+    Eigen::VectorXd grad(goods.size());
+    for (size_t i = 0; i < goods.size(); i++)
+        grad[i] = d(b, goods[i]);
+
+    return grad;
+}
+
+Eigen::MatrixXd Consumer::Differentiable::hessianMatrix(const std::vector<id_t> &goods, const BundleNegative &b) const {
+    Eigen::MatrixXd hess(goods.size(), goods.size());
+    for (size_t i = 0; i < goods.size(); i++) {
+        for (size_t j = 0; j < i; j++)
+            hess(i, j) = hess(j, i) = d2(b, goods[i], goods[j]);
+        hess(i, i) = d2(b, goods[i], goods[i]);
+    }
+
+    return hess;
+}
+
 }
@@ -1,5 +1,6 @@
 #pragma once
 #include <eris/Agent.hpp>
+#include <Eigen/Core>
 #include <map>
 #include <vector>
 #include <functional>
@@ -24,8 +25,38 @@ class Consumer : public Agent {
          */
         double currUtility() const;
 
+        /** Evaluates utility at many candidate bundles at once.  Each candidate is `base` plus one
+         * column of `deltas`, where row i of `deltas` is the change in the quantity of `goods[i]`.
+         * Returns a vector with one utility value per column of `deltas`.
+         *
+         * The default implementation simply builds each candidate bundle and calls utility() on
+         * it; subclasses with utility functions that can be evaluated on a whole matrix of
+         * quantities at once should override it.
+         *
+         * \param base the bundle the candidate changes are relative to
+         * \param goods the goods corresponding to the rows of `deltas`
+         * \param deltas a `goods.size()` by \f$k\f$ matrix of changes, one column per candidate
+         *
+         * \throws std::invalid_argument if the number of rows of `deltas` does not equal the
+         * number of goods.
+         */
+        virtual Eigen::VectorXd utilityBatch(const BundleNegative &base, const std::vector<id_t> &goods,
+                const Eigen::MatrixXd &deltas) const;
+
         class Differentiable;
         class Simple;
+        class AnalyticDemand;
+
+    protected:
+        /** Helper for utilityBatch() implementations that converts the candidate bundles into a
+         * dense matrix of quantities, with one column per candidate.  Each distinct good in either
+         * `goods` or `base` gets one row of `quantities`; the goods in row order are returned.
+         *
+         * \throws std::invalid_argument if the number of rows of `deltas` does not equal the
+         * number of goods.
+         */
+        static std::vector<id_t> batchQuantities(const BundleNegative &base, const std::vector<id_t> &goods,
+                const Eigen::MatrixXd &deltas, Eigen::MatrixXd &quantities);
 };
 
 /** Specialization of Consumer which is used for consumer instances that have analytical first and
@@ -61,10 +92,31 @@ class Consumer::Differentiable : public Consumer {
          * \param b the Bundle at which the hessian is to be evaluated
          */
         virtual std::map<id_t, std::map<id_t, double>> hessian(const std::vector<id_t> &g, const BundleNegative &b) const;
+        /** Like gradient(), but returns the gradient as a dense vector with elements in the same
+         * order as the goods in `g`.  The default implementation calls d() for each good;
+         * subclasses with a closed-form gradient should override it to compute the whole vector at
+         * once.
+         *
+         * \param g the goods for which the gradient is sought
+         * \param b the Bundle at which the gradient is to be evaluated
+         */
+        virtual Eigen::VectorXd gradientVector(const std::vector<id_t> &g, const BundleNegative &b) const;
+        /** Like hessian(), but returns the Hessian as a dense, symmetric matrix with rows and
+         * columns in the same order as the goods in `g`.  The default implementation calls d2()
+         * for each of the \f$ \frac{g(g+1)}{2} \f$ distinct elements; subclasses with a
+         * closed-form Hessian should override it to compute the whole matrix at once.
+         *
+         * \param g the goods for which the Hessian is sought
+         * \param b the Bundle at which the Hessian is to be evaluated
+         */
+        virtual Eigen::MatrixXd hessianMatrix(const std::vector<id_t> &g, const BundleNegative &b) const;
 };
 
 /** Very simple consumer class that takes a function (or lambda) that takes a const BundleNegative &
  * and returns a utility value.
+ *
+ * \sa consumer::AutoDiff for a differentiable equivalent, which computes derivatives of a
+ * (templated) utility function automatically.
  */
 class Consumer::Simple : public Consumer {
     public:
@@ -82,4 +134,31 @@ class Consumer::Simple : public Consumer {
         std::function<double(const BundleNegative &)> u;
 };
 
+/** Interface for consumers with a closed-form demand function.  Optimizers that find the consumer
+ * facing constant per-unit prices (such as intraopt::MUPD, when every market in play has a
+ * constant marginal price) can call demand() to get the exact optimal bundle in a single step
+ * instead of searching for it numerically.
+ *
+ * Implementing classes should inherit from this class as `public virtual`.
+ */
+class Consumer::AnalyticDemand {
+    public:
+        /** Calculates the consumer's demand when buying (non-negative) quantities of `goods` at
+         * the constant per-unit `prices` out of `income`, on top of the bundle `base`.  That is,
+         * this finds the `q` that maximizes \f$u(base + q)\f$ subject to \f$p \cdot q = income\f$
+         * and \f$q \geq 0\f$, where the elements of `q` and `prices` are in the same order as
+         * `goods`.  To allow income to be kept unspent, include money as one of the goods, at a
+         * price of 1.
+         *
+         * Returns true and sets `q` to the optimal quantities on success.  Returns false (leaving
+         * `q` unspecified) if the closed-form solution doesn't apply to the given parameters, in
+         * which case the caller should fall back to a numerical optimization.
+         */
+        virtual bool demand(const BundleNegative &base, const std::vector<id_t> &goods,
+                const Eigen::VectorXd &prices, double income, Eigen::VectorXd &q) const = 0;
+    protected:
+        /// Protected destructor: object destruction via the interface is not permitted.
+        ~AnalyticDemand() = default;
+};
+
 }
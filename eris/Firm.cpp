@@ -1,8 +1,21 @@
 #include <eris/Firm.hpp>
 #include <utility>
+#include <algorithm>
+#include <vector>
 
 namespace eris {
 
+std::atomic<unsigned long> Firm::supply_epoch_{0};
+
+Firm::Firm() {
+    assets.versionEpoch(&supply_epoch_);
+}
+
+void Firm::supplyChanged() noexcept {
+    ++supply_version_;
+    ++supply_epoch_;
+}
+
 bool Firm::canSupply(const Bundle &b) const {
     return canSupplyAny(b) >= 1.0;
 }
@@ -73,36 +86,72 @@ Firm::Reservation Firm::supply(const BundleNegative &b, Bundle &assets) {
 }
 
 Firm::Reservation Firm::reserve(const BundleNegative &reserve) {
-    Bundle res_pos = reserve.positive();
-    // First see if current assets can handle any of the requested Bundle
-    Bundle common = Bundle::common(assets, res_pos);
-    if (common != 0) res_pos -= common;
-
-    if (res_pos != 0) {
-        // Now see if excess production has any of what we need
-        Bundle excess = Bundle::common(excess_production_, res_pos);
-        if (excess != 0) res_pos -= excess;
-
-        if (res_pos != 0) {
-            // Couldn't reserve all of it with assets *or* excess production, so try to reserve new production
-            reserveProduction(res_pos);
+    // Work out, in a single pass over the requested goods, how much of each good comes from
+    // current assets, how much from excess production, and how much needs new production.
+    Bundle from_assets, from_excess, from_production;
+    const Bundle &have = assets, &excess = excess_production_;
+    for (const auto &g : reserve) {
+        double q = g.second;
+        if (q <= 0) continue;
+
+        double avail = have[g.first];
+        if (avail > 0) {
+            double take = std::min(avail, q);
+            from_assets.set(g.first, take);
+            q -= take;
+            if (q <= 0) continue;
         }
 
-        // We survived that, so we're good to go: transfer the excess production bundle
-        if (excess != 0) {
-            excess_production_ -= excess;
-            reserved_production_ += excess;
+        avail = excess[g.first];
+        if (avail > 0) {
+            double take = std::min(avail, q);
+            from_excess.set(g.first, take);
+            q -= take;
+            if (q <= 0) continue;
         }
+
+        from_production.set(g.first, q);
     }
 
-    // Transfer any assets we matched above into reserves
-    if (common != 0) {
-        assets.transfer(common, reserves_, epsilon);
+    // Couldn't reserve all of it with assets *or* excess production, so try to reserve new
+    // production.  This can throw, so needs to happen before we change anything.
+    if (not from_production.empty())
+        reserveProduction(from_production);
+
+    // We survived that, so we're good to go: transfer the excess production bundle
+    if (not from_excess.empty()) {
+        excess_production_ -= from_excess;
+        reserved_production_ += from_excess;
     }
 
+    // Transfer any assets we matched above into reserves
+    if (not from_assets.empty())
+        assets.transfer(from_assets, reserves_, epsilon);
+
+    supplyChanged();
+
     return createReservation(reserve);
 }
 
+std::vector<Firm::Reservation> Firm::reserveMany(
+        const std::vector<std::pair<SharedMember<Firm>, BundleNegative>> &requests) {
+    if (requests.empty()) return {};
+
+    std::vector<SharedMember<Member>> to_lock;
+    to_lock.reserve(requests.size());
+    for (auto &req : requests) to_lock.push_back(req.first);
+    auto lock = to_lock.front()->writeLock(to_lock);
+
+    // If any of these throws, the reservations already made are released when `reservations` is
+    // destroyed, which happens before `lock` is released.
+    std::vector<Reservation> reservations;
+    reservations.reserve(requests.size());
+    for (auto &req : requests)
+        reservations.push_back(req.first->reserve(req.second));
+
+    return reservations;
+}
+
 void Firm::produceReserved(const Bundle &b) {
     reserved_production_.beginTransaction();
 
@@ -141,39 +190,35 @@ void Firm::produceReserved(const Bundle &b) {
     reserved_production_.commitTransaction();
     excess_production_.commitTransaction();
     assets.commitTransaction();
-}
 
-void Firm::Reservation::transfer(Bundle &to) {
-    if (state != ReservationState::pending)
-        throw Reservation::non_pending_exception();
+    supplyChanged();
+}
 
-    Bundle &assets = firm->assets;
-    double &epsilon = firm->epsilon;
+void Firm::transferReserved(const BundleNegative &bundle, Bundle &to) {
     to.beginTransaction();
     assets.beginTransaction();
 
     try {
-        // Take payment:
-        Bundle in = bundle.negative();
-        to.transfer(bundle.negative(), assets, epsilon);
-
-        // Now transfer and/or produce output
+        // Take payment and transfer whatever output we can from reserves in a single batch:
         Bundle out = bundle.positive();
         out.beginEncompassing();
-        Bundle from_reserves = Bundle::common(firm->reserves_, out);
+        Bundle from_reserves = Bundle::common(reserves_, out);
 
-        Bundle done = firm->reserves_.transfer(from_reserves, to, epsilon);
-        out.transfer(done, epsilon);
+        auto done = BundleSigned::transferMany({
+                {to, assets, bundle.negative()},
+                {reserves_, to, from_reserves}},
+                epsilon);
+        out.transfer(done[1], epsilon);
 
-        if (out > 0) {
+        if (out != 0) {
             // Need to produce the rest
-            firm->produceReserved(out);
+            produceReserved(out);
             assets.transfer(out, to, epsilon);
         }
 
         // Call this in case any of the excess production and/or payment assets allow us to reduce
         // reserved production by transferring some assets to reserves.
-        firm->reduceProduction();
+        reduceProduction();
     }
     catch (...) {
         to.abortTransaction();
@@ -184,14 +229,40 @@ void Firm::Reservation::transfer(Bundle &to) {
     to.commitTransaction();
     assets.commitTransaction();
 
+    supplyChanged();
+}
+
+void Firm::Reservation::transfer(Bundle &to) {
+    if (state != ReservationState::pending)
+        throw Reservation::non_pending_exception();
+
+    firm->transferReserved(bundle, to);
     state = ReservationState::complete;
 }
 
+void Firm::Reservation::transferAll(std::vector<Reservation> &reservations, Bundle &to) {
+    if (reservations.empty()) return;
+
+    auto &firm = reservations.front().firm;
+    BundleNegative total;
+    for (auto &res : reservations) {
+        if (res.state != ReservationState::pending)
+            throw Reservation::non_pending_exception();
+        if (res.firm->id() != firm->id())
+            throw std::invalid_argument("Firm::Reservation::transferAll: reservations must all belong to the same firm");
+        total += res.bundle;
+    }
+
+    firm->transferReserved(total, to);
+    for (auto &res : reservations) res.state = ReservationState::complete;
+}
+
 void Firm::Reservation::release() {
     if (state != ReservationState::pending)
         throw Reservation::non_pending_exception();
 
     state = ReservationState::aborted;
+    firm->supplyChanged();
 
     Bundle res_pos = bundle.positive();
     if (res_pos == 0) // Nothing to do
@@ -211,6 +282,17 @@ void Firm::Reservation::release() {
         }
     }
 
+    // Reserved production is a running total over many reservations, so rounding error can leave
+    // it very slightly short of what this reservation added to it.  Drop any such tiny remainder
+    // (relative to the reserved quantity) that reserves can't cover, rather than failing below.
+    std::vector<id_t> residual;
+    const Bundle &reserves = firm->reserves_;
+    for (auto &g : res_pos) {
+        if (g.second <= firm->epsilon * bundle[g.first] and reserves[g.first] < g.second)
+            residual.push_back(g.first);
+    }
+    for (auto &g : residual) res_pos.erase(g);
+
     // Anything left should be transferrable from reserves to assets.  This could throw a negativity
     // exception if something got screwed up.
     firm->reserves_.transfer(res_pos, firm->assets, firm->epsilon);
@@ -246,8 +328,10 @@ double FirmNoProd::canSupplyAny(const Bundle &b) const {
 }
 
 void FirmNoProd::ensureNext(const Bundle &b) {
-    if (!(assets >= b))
+    if (!(assets >= b)) {
         produceNext(b - Bundle::common(assets, b));
+        supplyChanged();
+    }
 }
 
 void FirmNoProd::reserveProduction(const Bundle&) {
@@ -3,6 +3,9 @@
 #include <exception>
 #include <stdexcept>
 #include <string>
+#include <atomic>
+#include <vector>
+#include <utility>
 
 namespace eris {
 
@@ -100,6 +103,15 @@ public:
          * instead be supplied from the newly-gained assets.
          */
         void transfer(Bundle &to);
+        /** Completes all of the given reservations at once, which must all be pending
+         * reservations of the same firm.  This has the same effect as calling transfer(to) on each
+         * one, but the reservations' bundles are added together first so that the firm's assets,
+         * reserves, and production are only touched once.
+         *
+         * \throws std::invalid_argument if the reservations are not all for the same firm
+         * \throws Reservation::non_pending_exception if any reservation is not pending
+         */
+        static void transferAll(std::vector<Reservation> &reservations, Bundle &to);
         /** Cancels a reserved quantity previously reserved with reserve(), indicating that the
          * quantity will not be transferred via `res.transfer()`.
          *
@@ -230,6 +242,17 @@ public:
      */
     virtual Reservation reserve(const BundleNegative &reserve);
 
+    /** Reserves bundles from several firms at once, returning the reservations in the same order
+     * as the requests.  A write lock on all of the firms is obtained once for the whole batch, and
+     * each reservation is made by calling reserve() on its firm.  If any reservation fails, the
+     * reservations already made are released and the exception is rethrown, so either all of the
+     * requests are reserved or none of them are.
+     *
+     * \param requests the (firm, bundle) pairs to reserve, where each bundle is as for reserve()
+     */
+    static std::vector<Reservation> reserveMany(
+            const std::vector<std::pair<SharedMember<Firm>, BundleNegative>> &requests);
+
     /** Controls the relative tolerance for handling invalid requests such as being asked to produce
      * more than is available.  Requested amounts can be changed by up to this amount to avoid a
      * constraint or to use up all of a resource (rather than leaving a miniscule amount behind).
@@ -237,10 +260,40 @@ public:
      */
     double epsilon = 1e-10;
 
+    /** Returns the firm's supply version: a counter that increases whenever something that may
+     * affect the firm's ability to supply output (or the price at which it does so) changes.
+     * Markets use this to cache supply information across calls, only recalculating it when the
+     * version of a participating firm changes.
+     *
+     * \sa supplyChanged()
+     * \sa supplyEpoch()
+     */
+    unsigned long supplyVersion() const noexcept { return supply_version_; }
+
+    /** Returns a global counter that increases whenever the supply version of *any* firm changes,
+     * and whenever any firm's `assets` bundle is modified (by any means).  If this value is
+     * unchanged, no firm's supplyVersion() or assets have changed either, which lets a market
+     * validate cached information without checking each of its firms.
+     */
+    static unsigned long supplyEpoch() noexcept { return supply_epoch_; }
+
+    /** Signals that something affecting the firm's supply has changed by incrementing the firm's
+     * supplyVersion() (and the global supplyEpoch()).  This is called automatically by
+     * reservation, transfer, release, and production methods; subclasses must also call it when
+     * changing anything else that affects supply (such as a price or capacity).  External code
+     * that directly modifies a firm's `assets` should also call it afterwards: such changes always
+     * advance supplyEpoch(), and market::Bertrand detects them itself through the assets'
+     * Bundle::version(), but other caches of a single firm's supply may not.
+     */
+    void supplyChanged() noexcept;
+
     /// Converts to string `Firm[n]`.
     operator std::string() const override;
 
 protected:
+    /// Constructs the firm, linking its assets to the global supplyEpoch().
+    Firm();
+
     // The following are internal methods that subclasses should provide, but should only be called
     // externally indirectly through a call to the analogous supply...() function.
 
@@ -389,6 +442,15 @@ protected:
 
     friend class Reservation; // Reservation needs internal firm access to perform the transfer/release
 
+private:
+    // The version counter returned by supplyVersion()
+    std::atomic<unsigned long> supply_version_{0};
+    // The global counter returned by supplyEpoch()
+    static std::atomic<unsigned long> supply_epoch_;
+
+    // Performs the transfer of a (pending) reservation bundle for Reservation::transfer() and
+    // Reservation::transferAll().
+    void transferReserved(const BundleNegative &bundle, Bundle &to);
 };
 
 /** Abstract specialization of Firm intended for firms with no instantaneous production capacity.
@@ -1,4 +1,11 @@
 #include <eris/Market.hpp>
+#include <eris/Simulation.hpp>
+#include <eris/intraopt/Callback.hpp>
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 #include <sstream>
 
@@ -10,79 +17,361 @@ void Market::addFirm(SharedMember<Firm> f) {
     auto lock = writeLock();
     suppliers_.insert(f->id());
     dependsWeaklyOn(f);
+    quotesChanged();
 }
 
 void Market::removeFirm(id_t fid) {
     auto lock = writeLock();
     suppliers_.erase(fid);
+    quotesChanged();
+}
+
+constexpr size_t Market::quote_cache_max;
+
+void Market::checkQuoteCache() const {
+    unsigned long version = quote_version_, epoch = Firm::supplyEpoch();
+    if (version != quote_cache_version_ or epoch != quote_cache_epoch_) {
+        price_cache_.clear();
+        quantity_cache_.clear();
+        quote_cache_version_ = version;
+        quote_cache_epoch_ = epoch;
+    }
+}
+
+Market::price_info Market::cachedPrice(double q) const {
+    if (not cache_quotes) return price(q);
+
+    std::unique_lock<std::mutex> lock(quote_mutex_);
+    checkQuoteCache();
+    auto found = price_cache_.find(q);
+    if (found != price_cache_.end()) return found->second;
+    // Don't hold the mutex while calculating: price() may be slow, and may itself query other
+    // markets.  If anything changes in the meantime, the result is returned but not cached.
+    unsigned long version = quote_cache_version_, epoch = quote_cache_epoch_;
+    lock.unlock();
+
+    auto p = price(q);
+
+    lock.lock();
+    checkQuoteCache();
+    if (version == quote_cache_version_ and epoch == quote_cache_epoch_) {
+        if (price_cache_.size() >= quote_cache_max) price_cache_.clear();
+        price_cache_.emplace(q, p);
+    }
+    return p;
+}
+
+Market::quantity_info Market::cachedQuantity(double p) const {
+    if (not cache_quotes) return quantity(p);
+
+    std::unique_lock<std::mutex> lock(quote_mutex_);
+    checkQuoteCache();
+    auto found = quantity_cache_.find(p);
+    if (found != quantity_cache_.end()) return found->second;
+    unsigned long version = quote_cache_version_, epoch = quote_cache_epoch_;
+    lock.unlock();
+
+    auto q = quantity(p);
+
+    lock.lock();
+    checkQuoteCache();
+    if (version == quote_cache_version_ and epoch == quote_cache_epoch_) {
+        if (quantity_cache_.size() >= quote_cache_max) quantity_cache_.clear();
+        quantity_cache_.emplace(p, q);
+    }
+    return q;
+}
+
+std::shared_ptr<const Market::Snapshot> Market::snapshot() const {
+    return nullptr;
+}
+
+Market::Snapshot::Snapshot(const std::vector<std::pair<double, double>> &schedule) {
+    double q_before = 0, p_before = 0;
+    for (auto &level : schedule) {
+        if (not(level.second > 0)) continue;
+        segments_.push_back({level.first, level.second, q_before, p_before});
+        // Nothing beyond an infinite-quantity segment can ever be bought
+        if (std::isinf(level.second)) break;
+        q_before += level.second;
+        p_before += level.first * level.second;
+    }
+}
+
+Market::price_info Market::Snapshot::price(double q) const {
+    if (segments_.empty()) return {}; // Nothing available at all
+
+    double first = segments_.front().price;
+    if (q <= 0) return { 0, first, first };
+
+    // Find the first segment at which the cumulative quantity reaches q
+    auto seg = std::lower_bound(segments_.begin(), segments_.end(), q,
+            [](const segment &s, double q) { return s.q_before + s.q < q; });
+    if (seg == segments_.end()) return {}; // q exceeds the total quantity available
+
+    return { seg->p_before + seg->price * (q - seg->q_before), seg->price, first };
+}
+
+Market::quantity_info Market::Snapshot::quantity(double p) const {
+    // Find the first segment at which the cumulative cost reaches the given price.  (If a segment
+    // has zero price and infinite quantity, the cost is NaN, which also stops the search).
+    auto seg = std::lower_bound(segments_.begin(), segments_.end(), p,
+            [](const segment &s, double p) { return s.p_before + s.price * s.q < p; });
+
+    double quantity, unspent = 0;
+    if (seg == segments_.end()) {
+        // Buying everything available doesn't exhaust the given price (or there is nothing
+        // available at all)
+        if (segments_.empty()) {
+            quantity = 0;
+            unspent = p;
+        }
+        else {
+            auto &last = segments_.back();
+            quantity = last.q_before + last.q;
+            unspent = p - last.p_before - last.price * last.q;
+        }
+    }
+    else if (seg->price > 0) {
+        quantity = seg->q_before + (p - seg->p_before) / seg->price;
+    }
+    else {
+        // The segment is free, so everything in it can be had
+        quantity = seg->q_before + seg->q;
+    }
+
+    return { quantity, unspent > 0, p - unspent, unspent };
 }
 
 const std::unordered_set<id_t>& Market::firms() {
     return suppliers_;
 }
 
-void Market::weakDepRemoved(SharedMember<Member> firm) {
-    removeFirm(firm->id());
+void Market::weakDepRemoved(SharedMember<Member> member) {
+    bool settler;
+    {
+        auto lock = writeLock();
+        settler = settlement_ != 0 and member->id() == settlement_;
+        if (settler) settlement_ = 0;
+    }
+    if (settler)
+        // Nothing else is going to settle the queue, so do it now
+        settle();
+    else if (dynamic_cast<Firm*>(member.get()))
+        removeFirm(member->id());
+}
+
+void Market::removed() {
+    // Our settlement callback goes away with us, so settle anything it hasn't yet
+    {
+        auto lock = writeLock();
+        settlement_ = 0;
+    }
+    settle();
 }
 
 void Market::buy(Reservation &res) {
-    if (res.state != ReservationState::pending)
+    auto &slot = *res.slot_;
+    if (slot.state != ReservationState::pending)
         throw Reservation::non_pending_exception();
 
+    if (batchSettlement()) {
+        auto sim = simulation();
+        if (sim->runStage() == Simulation::RunStage::intra_Apply and sim->runStagePriority() < settlement_priority) {
+            // Queue it for settlement (moving the firm reservations out individually, so that the
+            // slot keeps its storage for reuse)
+            auto lock = writeLock();
+            settle_queue_.push_back({slot.agent, slot.payment, std::vector<Firm::Reservation>(
+                        std::make_move_iterator(slot.firm_reservations.begin()),
+                        std::make_move_iterator(slot.firm_reservations.end()))});
+            slot.firm_reservations.clear();
+            slot.payment.clear();
+            slot.state = ReservationState::complete;
+            quotesChanged();
+            return;
+        }
+    }
+
     // Lock this market, the agent, and all the firm's involved in the reservation:
     std::vector<SharedMember<Member>> to_lock;
-    to_lock.push_back(res.agent);
-    for (auto &firm_res: res.firm_reservations_) to_lock.push_back(firm_res.firm);
+    to_lock.push_back(slot.agent);
+    for (auto &firm_res: slot.firm_reservations) to_lock.push_back(firm_res.firm);
     auto lock = writeLock(to_lock);
 
-    res.state = ReservationState::complete;
+    slot.state = ReservationState::complete;
+    quotesChanged();
 
-    // Currently b_ contains the total payment; do firm transfers
-    for (auto &firm_res: res.firm_reservations_)
-        firm_res.transfer(res.b_);
+    // Currently the payment bundle contains the total payment; do firm transfers
+    for (auto &firm_res: slot.firm_reservations)
+        firm_res.transfer(slot.payment);
 
-    // Now b_ has had the payment removed, and the output added, so send it back to the agent
-    res.agent->assets += res.b_;
-    res.b_.clear();
+    // Now the payment has been removed, and the output added, so send it back to the agent
+    slot.agent->assets += slot.payment;
+    slot.payment.clear();
 }
 
 void Market::release(Reservation &res) {
-    if (res.state != ReservationState::pending)
+    auto &slot = *res.slot_;
+    if (slot.state != ReservationState::pending)
         throw Reservation::non_pending_exception();
 
     // Lock this market, the agent, and all the firm's involved in the reservation:
     std::vector<SharedMember<Member>> to_lock;
-    to_lock.push_back(res.agent);
-    for (auto &firm_res: res.firm_reservations_) to_lock.push_back(firm_res.firm);
+    to_lock.push_back(slot.agent);
+    for (auto &firm_res: slot.firm_reservations) to_lock.push_back(firm_res.firm);
     auto lock = writeLock(to_lock);
 
-    res.state = ReservationState::aborted;
+    slot.state = ReservationState::aborted;
+    quotesChanged();
 
-    for (auto &firm_res: res.firm_reservations_)
+    for (auto &firm_res: slot.firm_reservations)
         firm_res.release();
 
     // Refund that payment that was extracted when the reservation was made
-    res.agent->assets += res.b_;
-    res.b_.clear();
+    slot.agent->assets += slot.payment;
+    slot.payment.clear();
 }
 
-Market::Reservation::Reservation(SharedMember<Market> mkt, SharedMember<Agent> agt, double qty, double pr)
-    : state(ReservationState::pending), quantity(qty), price(pr), market(mkt), agent(agt) {
-    auto lock = agent->writeLock(market);
+constexpr double Market::settlement_priority;
+
+void Market::batchSettlement(bool enable) {
+    if (enable == batchSettlement()) return;
 
-    Bundle payment = price * market->price_unit;
-    agent->assets -= payment;
-    b_ += payment;
+    auto sim = simulation();
+    if (enable) {
+        SharedMember<Market> self = sim->market(id());
+        auto settler = sim->spawn<intraopt::ApplyCallback>([self] { self->settle(); }, settlement_priority);
+        // Removing the market also removes its settlement callback (after settling what it
+        // hasn't), and removing just the callback settles what it hasn't.
+        sim->registerDependency(settler, self);
+        dependsWeaklyOn(settler);
+        auto lock = writeLock();
+        settlement_ = settler->id();
+    }
+    else {
+        id_t settler;
+        {
+            auto lock = writeLock();
+            settler = settlement_;
+            settlement_ = 0;
+        }
+        settle();
+        sim->remove(settler);
+    }
 }
 
+void Market::settle() {
+    std::vector<queued_purchase> queue;
+    {
+        auto lock = writeLock();
+        queue.swap(settle_queue_);
+    }
+    if (queue.empty()) return;
+
+    // Gather the firm reservations by firm, and work out what each agent ends up with: the held
+    // payment, less what the firms take, plus what the firms supply.
+    std::vector<SharedMember<Member>> to_lock;
+    std::vector<std::vector<Firm::Reservation>> by_firm;
+    std::unordered_map<id_t, size_t> firm_index;
+    std::vector<std::pair<SharedMember<Agent>, BundleSigned>> net;
+    std::unordered_map<id_t, size_t> agent_index;
+    // All of the payments go into `pool`; firms take their payments from it and add their output
+    // to it, after which it gets paid out to the agents.
+    Bundle pool;
+    for (auto &p : queue) {
+        auto ai = agent_index.emplace(p.agent->id(), net.size());
+        if (ai.second) {
+            net.emplace_back(p.agent, BundleSigned());
+            to_lock.push_back(p.agent);
+        }
+        auto &agent_net = net[ai.first->second].second;
+        agent_net += p.payment;
+        pool += p.payment;
+
+        for (auto &fr : p.firm_reservations) {
+            agent_net += fr.bundle;
+            auto fi = firm_index.emplace(fr.firm->id(), by_firm.size());
+            if (fi.second) {
+                by_firm.emplace_back();
+                to_lock.push_back(fr.firm);
+            }
+            by_firm[fi.first->second].push_back(std::move(fr));
+        }
+    }
+
+    auto lock = writeLock(to_lock);
+
+    for (auto &firm_res : by_firm)
+        Firm::Reservation::transferAll(firm_res, pool);
+
+    std::vector<BundleSigned::transfer_spec> payout;
+    payout.reserve(net.size());
+    for (auto &n : net)
+        payout.push_back({pool, n.first->assets, n.second});
+    BundleSigned::transferMany(payout);
+}
+
+std::vector<SharedMember<Member>> Market::pendingMembers(const std::vector<Reservation> &reservations) {
+    std::vector<SharedMember<Member>> members;
+    for (auto &res : reservations) {
+        auto &slot = *res.slot_;
+        if (slot.state != ReservationState::pending) continue;
+        members.push_back(res.market);
+        members.push_back(slot.agent);
+        for (auto &firm_res : slot.firm_reservations) members.push_back(firm_res.firm);
+    }
+    return members;
+}
+
+void Market::buyAll(std::vector<Reservation> &reservations) {
+    auto to_lock = pendingMembers(reservations);
+    if (to_lock.empty()) return;
+    auto lock = to_lock.front()->writeLock(to_lock);
+
+    for (auto &res : reservations) {
+        if (res.state() == ReservationState::pending) res.market->buy(res);
+    }
+}
+
+void Market::releaseAll(std::vector<Reservation> &reservations) {
+    auto to_lock = pendingMembers(reservations);
+    if (to_lock.empty()) return;
+    auto lock = to_lock.front()->writeLock(to_lock);
+
+    for (auto &res : reservations) {
+        if (res.state() == ReservationState::pending) res.market->release(res);
+    }
+}
+
+Market::Reservation::Reservation(SharedMember<Market> mkt, reservation_slot &slot)
+    : slot_(&slot), market(std::move(mkt)) {}
+
 Market::Reservation::~Reservation() {
-    if (market and state == ReservationState::pending)
+    if (not slot_) return; // Moved from
+    if (slot_->state == ReservationState::pending)
         release();
+    market->freeSlot(*slot_);
 }
 
+ReservationState Market::Reservation::state() const { return slot_->state; }
+double Market::Reservation::quantity() const { return slot_->quantity; }
+double Market::Reservation::price() const { return slot_->price; }
+const SharedMember<Agent>& Market::Reservation::agent() const { return slot_->agent; }
+
 void Market::Reservation::firmReserve(id_t firm_id, BundleNegative transfer) {
     auto firm = market->simAgent<Firm>(firm_id);
-    firm_reservations_.push_front(firm->reserve(transfer));
+    slot_->firm_reservations.push_back(firm->reserve(transfer));
+}
+
+void Market::Reservation::firmReserve(const std::vector<std::pair<id_t, BundleNegative>> &transfers) {
+    std::vector<std::pair<SharedMember<Firm>, BundleNegative>> requests;
+    requests.reserve(transfers.size());
+    for (auto &t : transfers) requests.emplace_back(market->simAgent<Firm>(t.first), t.second);
+
+    auto reserved = Firm::reserveMany(requests);
+    auto &firm_reservations = slot_->firm_reservations;
+    firm_reservations.reserve(firm_reservations.size() + reserved.size());
+    for (auto &r : reserved) firm_reservations.push_back(std::move(r));
 }
 
 void Market::Reservation::buy() {
@@ -94,7 +383,48 @@ void Market::Reservation::release() {
 }
 
 Market::Reservation Market::createReservation(SharedMember<Agent> agent, double q, double p) {
-    return Reservation(sharedSelf(), agent, q, p);
+    quotesChanged();
+
+    reservation_slot *slot;
+    {
+        std::lock_guard<std::mutex> ledger_lock(ledger_mutex_);
+        if (free_slots_.empty()) {
+            ledger_.emplace_back();
+            slot = &ledger_.back();
+            slot->index = ledger_.size() - 1;
+        }
+        else {
+            slot = free_slots_.back();
+            free_slots_.pop_back();
+        }
+    }
+    slot->state = ReservationState::pending;
+    slot->quantity = q;
+    slot->price = p;
+    slot->agent = agent;
+
+    Reservation res(sharedSelf(), *slot);
+    auto lock = agent->writeLock(res.market);
+    Bundle payment = p * price_unit;
+    try {
+        agent->assets -= payment;
+    }
+    catch (...) {
+        // Nothing has been reserved, so there's nothing to release
+        slot->state = ReservationState::aborted;
+        throw;
+    }
+    slot->payment += payment;
+    return res;
+}
+
+void Market::freeSlot(reservation_slot &slot) {
+    slot.agent.reset();
+    slot.payment.clear();
+    slot.firm_reservations.clear();
+
+    std::lock_guard<std::mutex> ledger_lock(ledger_mutex_);
+    free_slots_.push_back(&slot);
 }
 
 const char* Market::Reservation::non_pending_exception::what() const noexcept {
@@ -103,7 +433,11 @@ const char* Market::Reservation::non_pending_exception::what() const noexcept {
 
 SharedMember<Member> Market::sharedSelf() const { return simMarket(id()); }
 
-Bundle& Market::reservationBundle_(Reservation &res) { return res.b_; }
+Bundle& Market::reservationBundle_(Reservation &res) { return res.slot_->payment; }
+
+ReservationState& Market::reservationState_(Reservation &res) { return res.slot_->state; }
+
+size_t Market::reservationSlot_(const Reservation &res) const { return res.slot_->index; }
 
 const char* Market::output_infeasible::what() const noexcept { return "Requested output not available"; }
 const char* Market::low_price::what() const noexcept { return "Requested output not available for given price"; }
@@ -1,10 +1,16 @@
 #pragma once
 #include <eris/Member.hpp>
 #include <eris/Firm.hpp>
+#include <eris/Optimize.hpp>
+#include <atomic>
+#include <deque>
 #include <exception>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <unordered_set>
-#include <forward_list>
+#include <vector>
 
 namespace eris {
 
@@ -27,8 +33,14 @@ namespace market {}
  *
  * Subclasses must, at a minimum, define the price(q), quantity(p), and (both) buy(...) methods:
  * this abstract class has no allocation implementation.
+ *
+ * Purchases made during the intra-period apply stage can optionally be settled in a single batch;
+ * see batchSettlement().
  */
 class Market : public Member {
+private:
+    struct reservation_slot;
+
 public:
     virtual ~Market() = default;
 
@@ -98,6 +110,45 @@ public:
         double unspent = std::numeric_limits<double>::quiet_NaN();
     };
 
+    /** An immutable snapshot of a market's supply schedule, as returned by snapshot().  The
+     * schedule is piecewise linear in the total price: each segment supplies a (possibly
+     * infinite) quantity at a constant per-unit price, with segments sorted by ascending price.
+     * price() and quantity() answer queries against the schedule exactly as the market would have
+     * at the time the snapshot was taken, without locking or querying the market or its firms.
+     */
+    class Snapshot final {
+        public:
+            /** Creates a snapshot from a list of (per-unit price, quantity) pairs, which must be
+             * sorted by ascending price.  Pairs with non-positive quantities are ignored, as are any
+             * pairs after the first with an infinite quantity.
+             */
+            explicit Snapshot(const std::vector<std::pair<double, double>> &schedule);
+
+            /// A segment of the schedule
+            struct segment {
+                /// The price per unit of output (as a multiple of price_unit)
+                double price;
+                /// The quantity (possibly infinite) available at this price
+                double q;
+                /// The cumulative quantity available in all earlier segments
+                double q_before;
+                /// The total cost of buying everything in all earlier segments
+                double p_before;
+            };
+
+            /// Returns the pricing information for purchasing q units, as in Market::price().
+            price_info price(double q) const;
+
+            /// Returns the quantity that p units of the price Bundle would buy, as in Market::quantity().
+            quantity_info quantity(double p) const;
+
+            /// The segments of the schedule, sorted by ascending price.
+            const std::vector<segment>& segments() const { return segments_; }
+
+        private:
+            std::vector<segment> segments_;
+    };
+
     /** Contains a reservation of market purchase.  The market will consider the reserved quantity
      * unavailable until a call of either buy() (which completes the transfer) or release() (which
      * cancels the transfer) is called.
@@ -105,6 +156,11 @@ public:
      * If the object is destroyed before being passed to buy() or release(), release() will be
      * called automatically.
      *
+     * The reservation's details (its agent, quantity, price, state, held payment, and firm
+     * reservations) are stored in a slot of a ledger owned by the market; a Reservation is just a
+     * handle to that slot.  The slot is returned to the ledger, to be reused (along with its
+     * already-allocated storage) by a later reservation, when the handle is destroyed.
+     *
      * This object is not intended to be used directly, but rather through the Reservation returned
      * by reserve().
      */
@@ -112,7 +168,7 @@ public:
     private:
         friend class Market;
 
-        Reservation(SharedMember<Market> market, SharedMember<Agent> agent, double quantity, double price);
+        Reservation(SharedMember<Market> market, reservation_slot &slot);
 
         // Default/copy construction not allowed
         Reservation() = delete;
@@ -122,41 +178,42 @@ public:
         Reservation& operator=(Reservation &&) = delete;
         Reservation& operator=(const Reservation &) = delete;
 
-        std::forward_list<Firm::Reservation> firm_reservations_;
-
-        // Temporary bundle that holds the payment when the reservation is constructed and either
-        // returns it to the agent (if cancelled) or gives it to firms (if completed).
-        Bundle b_;
+        // The market ledger slot holding this reservation's details; null once moved from
+        reservation_slot *slot_;
 
     public:
         /// Move constructor
-        Reservation(Reservation &&move) : firm_reservations_(std::move(move.firm_reservations_)),
-        b_(std::move(move.b_)), state{move.state}, quantity{move.quantity}, price{move.price},
+        Reservation(Reservation &&move) noexcept : slot_{move.slot_},
         // need to const_cast away the constness on the move source (otherwise copy constructors get
         // invoked, which leaves market set, which breaks destruction).
-        market(std::move(const_cast<SharedMember<Market>&>(move.market))),
-        agent(std::move(const_cast<SharedMember<Agent>&>(move.agent))) {}
+        market(std::move(const_cast<SharedMember<Market>&>(move.market))) { move.slot_ = nullptr; }
 
         /** Destructor.  If this Reservation is destroyed without having been completed or aborted
-         * (via buy() or release()), it will be aborted (by calling release() on its Market).
+         * (via buy() or release()), it will be aborted (by calling release() on its Market).  The
+         * reservation's ledger slot is then returned to the market.
          */
         ~Reservation();
         /// The state (pending, completed, or aborted) of this Reservation
-        ReservationState state = ReservationState::pending;
+        ReservationState state() const;
         /// The quantity (as a multiple of the Market's output Bundle) that this reservation is for.
-        const double quantity;
+        double quantity() const;
         /// The price (as a multiple of the Market's price Bundle) of this reservation.
-        const double price;
+        double price() const;
+        /// The agent for which this Reservation is being held.
+        const SharedMember<Agent>& agent() const;
         /// The market to which this Reservation applies.
         const SharedMember<Market> market;
-        /// The agent for which this Reservation is being held.
-        const SharedMember<Agent> agent;
         /** Reserves the given BundleNegative transfer from the given firm and stores the result, to
          * be transferred if buy() is called, and aborted if release() is called.  Positive amounts
          * are to be transferred from the firm, negative amounts are to be transferred to the firm.
          * This is intended to be called only by Market subclasses.
          */
         void firmReserve(id_t firm_id, BundleNegative transfer);
+        /** Reserves transfers from several firms at once, as if calling firmReserve(id, transfer)
+         * for each (id, transfer) pair, but using Firm::reserveMany() so that the firms are locked
+         * only once.  If any firm reservation fails, none of the given transfers are reserved.
+         */
+        void firmReserve(const std::vector<std::pair<id_t, BundleNegative>> &transfers);
         /** Calls buy() on the market.  Calling obj->buy() is a shortcut for calling
          * `obj->market->buy(obj)`.
          */
@@ -220,6 +277,52 @@ public:
      */
     virtual quantity_info quantity(double p) const = 0;
 
+    /** Returns price(q), memoized if `cache_quotes` is enabled.  Optimizers call this instead of
+     * price() while searching over allocations, where the same quantities tend to be queried
+     * repeatedly.
+     *
+     * \sa cache_quotes
+     */
+    price_info cachedPrice(double q) const;
+
+    /// Returns quantity(p), memoized if `cache_quotes` is enabled.
+    quantity_info cachedQuantity(double p) const;
+
+    /** If true, cachedPrice() and cachedQuantity() results are cached until quoteVersion() or
+     * Firm::supplyEpoch() changes, so that repeated queries only call price() or quantity() once.
+     * If false (the default), they simply call price() and quantity().
+     *
+     * The cache only knows about changes that bump one of those counters: reservations,
+     * purchases, and releases through this market, firms being added or removed, subclass pricing
+     * changes (see quotesChanged()), and supply changes reported by firms.  It should only be
+     * enabled when nothing modifies firm assets directly (without going through the Firm
+     * interface or calling Firm::supplyChanged() afterwards); otherwise optimizers would be
+     * given stale quotes.
+     */
+    bool cache_quotes = false;
+
+    /** Returns an immutable snapshot of the market's current supply schedule, or a null pointer
+     * if the market can't describe its supply as a piecewise-linear schedule (the default).
+     * Optimizers can search over a snapshot without any locking, and so without contending with
+     * other optimizers for the market; a plan found using a (by then stale) snapshot is checked
+     * against the market's actual supply when it is reserved.
+     */
+    virtual std::shared_ptr<const Snapshot> snapshot() const;
+
+    /** Returns the current quote version of this market, which increases whenever something
+     * happens in this market that could change the value of price() or quantity().
+     */
+    unsigned long quoteVersion() const noexcept { return quote_version_; }
+
+    /** Increments the quote version, invalidating any cached price and quantity quotes.  This is
+     * called automatically for reservations, purchases, releases, and firm changes; subclasses
+     * must also call it whenever they change their pricing in any other way.
+     */
+    void quotesChanged() noexcept { ++quote_version_; }
+
+    /// The maximum number of cached quotes (of each type) held before the cache is emptied.
+    static constexpr size_t quote_cache_max = 1024;
+
     /** Reserves q times the output Bundle for price at most p_max * price Bundle.  Removes the
      * purchase price (which could be less than p_max * price) from the assets bundle of the
      * provided Agent.  When the reservation is completed, the amount is transfered to the firm; if
@@ -266,18 +369,75 @@ public:
      */
     virtual void buy(Reservation &res);
 
-    /** Aborts a reservation made with reserve().
+    /** Aborts a reservation made with reserve().  Subclasses that track reservations internally
+     * may override this, but must call the base class version to perform the actual release.
+     */
+    virtual void release(Reservation &res);
+
+    /** Enables or disables batch settlement, which is disabled by default.  The market must
+     * already have been added to a simulation.
+     *
+     * When enabled, reservations bought (through the default buy() implementation) during the
+     * intra-period apply stage, before settlement, are not transferred immediately.  They are
+     * instead marked complete and queued, and the whole queue is settled by an
+     * intraopt::ApplyCallback that this method adds to the simulation with priority
+     * `settlement_priority`.  Settlement locks every agent and firm involved once, adds each
+     * firm's reservations together so that each firm makes a single net transfer, and then pays
+     * out the output to all agents in one batch transfer.
+     *
+     * This avoids repeatedly locking the same popular firms from many buyers' intraApply() calls,
+     * but it means that an agent's purchased output only appears in its assets once the market has
+     * settled.  Purchases made outside the apply stage, or after settlement, are always
+     * transferred immediately.
+     *
+     * Disabling batch settlement settles anything still queued and removes the settlement
+     * callback from the simulation.  Anything still queued is also settled if the market or its
+     * settlement callback is removed from the simulation before the callback runs.
+     */
+    void batchSettlement(bool enable);
+
+    /// Returns true if batch settlement is enabled.
+    bool batchSettlement() const { return settlement_ != 0; }
+
+    /** The intra-period apply priority of batch settlement: 1, so that settlement happens after
+     * apply optimizers with the default priority (typically those of the buyers) have made their
+     * purchases.
+     */
+    static constexpr double settlement_priority = 1.0;
+
+    /** Completes all of the given reservations, which may belong to different markets.  This is
+     * equivalent to calling buy() on each pending reservation, but establishes a single write lock
+     * on every market, agent, and firm involved up front, rather than locking and unlocking them
+     * for each reservation.  Reservations that are not pending are skipped.
      */
-    void release(Reservation &res);
+    static void buyAll(std::vector<Reservation> &reservations);
+
+    /** Aborts all of the given reservations, which may belong to different markets.  Like
+     * buyAll(), this locks everything involved once, then calls release() on each pending
+     * reservation.
+     */
+    static void releaseAll(std::vector<Reservation> &reservations);
 
 protected:
     /** Returns a SharedMember<Member> for the current object, via the simulation.
      */
     SharedMember<Member> sharedSelf() const override;
 
-    /** Exposes access to Reservation.b_ to subclasses. */
+    /** Exposes access to the payment held by a reservation to subclasses. */
     Bundle& reservationBundle_(Reservation &res);
 
+    /** Exposes access to a reservation's state to subclasses, for those that complete or abort
+     * reservations without calling the base class buy() or release().
+     */
+    ReservationState& reservationState_(Reservation &res);
+
+    /** Returns the index of the reservation's slot in the market's reservation ledger.  No two
+     * existing Reservation objects of a market share a slot (slots are only reused once their
+     * Reservation has been destroyed), so subclasses can use this to associate their own data with
+     * reservations.
+     */
+    size_t reservationSlot_(const Reservation &res) const;
+
 public:
     /** Adds f to the firms supplying in this market.  Subclasses that require a particular type of
      * firm should override this method, calling `requireInstanceOf<Base>(f, "...")` followed by
@@ -342,10 +502,69 @@ protected:
     Reservation createReservation(SharedMember<Agent> agent, double q, double p);
 
     /** Overridden to automatically remove a firm from the market when the firm is removed from the
-     * simulation.
+     * simulation, and to settle any queued purchases if the batch settlement callback is removed.
      */
-    virtual void weakDepRemoved(SharedMember<Member> firm) override;
+    virtual void weakDepRemoved(SharedMember<Member> member) override;
+
+    /// Overridden to settle any purchases still queued for batch settlement.
+    virtual void removed() override;
+
+private:
+    std::atomic<unsigned long> quote_version_{0};
+
+    // Cached price() and quantity() values, and the quote version and firm supply epoch they
+    // were calculated at.
+    mutable std::mutex quote_mutex_;
+    mutable unsigned long quote_cache_version_ = 0, quote_cache_epoch_ = 0;
+    mutable std::unordered_map<double, price_info> price_cache_;
+    mutable std::unordered_map<double, quantity_info> quantity_cache_;
+
+    // Empties the quote caches if they are out of date; quote_mutex_ must be held.
+    void checkQuoteCache() const;
+
+    // The id of the settlement callback added by batchSettlement(), or 0 if batch settlement is
+    // disabled.
+    id_t settlement_ = 0;
+
+    // A purchase queued for batch settlement: the reservation's agent, held payment, and firm
+    // reservations.
+    struct queued_purchase {
+        SharedMember<Agent> agent;
+        Bundle payment;
+        std::vector<Firm::Reservation> firm_reservations;
+    };
+    std::vector<queued_purchase> settle_queue_;
+
+    // Settles the purchases in settle_queue_.
+    void settle();
+
+    // Returns the markets, agents, and firms involved in the pending reservations, for buyAll() and
+    // releaseAll() to lock.
+    static std::vector<SharedMember<Member>> pendingMembers(const std::vector<Reservation> &reservations);
+
+    // A ledger slot holding the details of a reservation
+    struct reservation_slot {
+        // The position of this slot in the ledger
+        size_t index;
+        ReservationState state = ReservationState::pending;
+        double quantity = 0, price = 0;
+        SharedMember<Agent> agent;
+        // The payment held until the reservation is completed or cancelled
+        Bundle payment;
+        std::vector<Firm::Reservation> firm_reservations;
+    };
 
+    // The reservation ledger.  Slots are never removed (so that Reservation handles can point at
+    // them), but are reused once their Reservation is destroyed.
+    std::deque<reservation_slot> ledger_;
+    // Slots available for reuse
+    std::vector<reservation_slot*> free_slots_;
+    // Guards ledger_ and free_slots_, which are updated when reservations are created and
+    // destroyed, not just under the market's lock.
+    std::mutex ledger_mutex_;
+
+    // Returns the slot held by a Reservation to the ledger.
+    void freeSlot(reservation_slot &slot);
 };
 
 
@@ -37,14 +37,25 @@ Member::Lock::Lock(bool write, MemberSet &&members)
     : data{std::make_shared<Data>(std::move(members), write)} {
     lock();
 }
-Member::Lock::Lock(bool write, bool locked, MemberSet &&members)
-    : data{std::make_shared<Data>(std::move(members), write, locked)} {}
+Member::Lock::Lock(bool write, bool locked, MemberSet &&members, MemberSet &&borrowed)
+    : data{std::make_shared<Data>(std::move(members), write, locked, std::move(borrowed))} {}
 Member::Lock::Lock(const Lock &l) : data{l.data} {}
 
 Member::Lock::~Lock() {
     if (data.unique() && isLocked()) unlock();
 }
 
+thread_local std::unordered_map<const Member*, bool> Member::Lock::held_;
+
+bool Member::Lock::held_by_thread_(const Member *member, bool write) {
+    auto found = held_.find(member);
+    if (found == held_.end()) return false;
+    if (write and not found->second)
+        throw std::system_error(std::make_error_code(std::errc::resource_deadlock_would_occur),
+                "Member::Lock: cannot write lock a member read locked by the same thread");
+    return true;
+}
+
 bool Member::Lock::lock_all_(bool write, bool only_try) {
     // Not currently locked
     auto &members = data->members;
@@ -52,6 +63,14 @@ bool Member::Lock::lock_all_(bool write, bool only_try) {
     auto mem_end = members.end();
     auto holding_it = mem_end;
 
+    // Anything already locked by another lock in this thread is borrowed from that lock rather
+    // than being locked again.
+    auto &borrowed = data->borrowed;
+    borrowed.clear();
+    for (auto &m : members) {
+        if (held_by_thread_(m.get(), write)) borrowed.insert(m);
+    }
+
     // The loops below work like this:
     // - go through the list of members one-by-one, trying to obtain a lock as we go.
     //   - if we fail to obtain a lock:
@@ -68,6 +87,7 @@ bool Member::Lock::lock_all_(bool write, bool only_try) {
         auto unwind_it = mem_end;
         for (auto it = mem_begin; it != mem_end; ++it) {
             if (holding_it == it) continue; // We're already holding this mutex lock from the previous attempt
+            if (borrowed.count(*it)) continue;
 
             if (!((*it)->try_lock_(write))) {
                 // If we didn't get the lock, we need to release all the locks previously obtained in
@@ -87,6 +107,7 @@ bool Member::Lock::lock_all_(bool write, bool only_try) {
         // Otherwise unwind from the beginning up to the unwind iterator, unlocking all the
         // locks we acquired
         for (auto undoit = mem_begin; undoit != unwind_it; ++undoit) { // Undo [begin,unwind)
+            if (borrowed.count(*undoit)) continue;
             (*undoit)->unlock_(write);
             if (undoit == holding_it) undid_holding = true;
         }
@@ -100,7 +121,10 @@ bool Member::Lock::lock_all_(bool write, bool only_try) {
         }
 
         // If we're only trying, we failed, so return false.
-        if (only_try) return false;
+        if (only_try) {
+            borrowed.clear();
+            return false;
+        }
 
         // Now block waiting for unwind's lock, then repeat the whole procedure.
         (*unwind_it)->lock_(write);
@@ -110,6 +134,10 @@ bool Member::Lock::lock_all_(bool write, bool only_try) {
         holding_it = unwind_it;
     }
 
+    for (auto &m : members) {
+        if (not borrowed.count(m)) held_[m.get()] = write;
+    }
+
     return true;
 }
 
@@ -171,8 +199,12 @@ void Member::Lock::unlock() {
             "Member::Lock::unlock: not locked");
     if (!isFake()) {
         const bool write = isWrite();
-        for (auto &m : data->members)
+        for (auto &m : data->members) {
+            if (data->borrowed.count(m)) continue;
             m->unlock_(write);
+            held_.erase(m.get());
+        }
+        data->borrowed.clear();
     }
     data->locked = false;
 }
@@ -184,8 +216,10 @@ void Member::Lock::transfer(Member::Lock &from) {
 
     // Copy from's members
     data->members.insert(from.data->members.begin(), from.data->members.end());
+    data->borrowed.insert(from.data->borrowed.begin(), from.data->borrowed.end());
     // Delete from's members
     from.data->members.clear();
+    from.data->borrowed.clear();
 }
 
 bool Member::Lock::try_add(const SharedMember<Member> &member) {
@@ -193,7 +227,13 @@ bool Member::Lock::try_add(const SharedMember<Member> &member) {
         return true;
 
     if (isLocked()) {
-        // First try to see if we can obtain a (non-blocking) lock on the new member.  If we can, great,
+        // If this thread already holds the member (including through this lock), just include it.
+        if (held_by_thread_(member.get(), isWrite())) {
+            if (data->members.insert(member).second) data->borrowed.insert(member);
+            return true;
+        }
+
+        // Otherwise try to see if we can obtain a (non-blocking) lock on the new member.  If we can, great,
         // just hold that lock and add the new member to the set of locked members.  If not, we have to
         // release the existing lock, add the new one into the member list, then do a blocking lock on
         // the entire (old + new) set of members.
@@ -201,6 +241,7 @@ bool Member::Lock::try_add(const SharedMember<Member> &member) {
             // Couldn't get the required lock; we'll have to release all and do a full blocking lock
             return false;
         }
+        held_[member.get()] = isWrite();
     }
 
     // Either we successfully locked the new member, or the lock isn't active so we can add:
@@ -8,6 +8,7 @@
 #include <set>
 #include <condition_variable>
 #include <type_traits>
+#include <unordered_map>
 #include <algorithm>
 #include <string>
 #include <ostream>
@@ -152,6 +153,14 @@ public:
      * some members and a write lock on others), you should first unlock all locks, then call use
      * std::lock() to reobtain locks on all of them.
      *
+     * Locks are recursive within a thread: if a member is already locked by another Lock held by
+     * the current thread (for example, an optimizer holding a write lock on its consumer and a
+     * market calls a market method that locks the consumer again), the new lock simply includes it
+     * without locking (or, later, unlocking) it again.  A member that the thread holds a write
+     * lock on satisfies both read and write locks; one that it holds only a read lock on cannot
+     * be upgraded, and attempting to do so throws a std::system_error.  Such nested locks must be
+     * released before the enclosing locks they rely on, as happens naturally with scoped locks.
+     *
      * Implementation details:
      *
      * Every Member-derived object has a lock mutex that governs write access to the object.
@@ -393,23 +402,32 @@ public:
          * the original lock still has a lock on passed-in members if the given member was added
          * multiple times.
          *
+         * Removing members from a fake lock (such as the locks used when the simulation isn't
+         * threaded) is allowed, and returns a fake lock.
+         *
          * \throws std::out_of_range if the lock doesn't contain one or more of the given members.
          */
         template <class Container,
             std::enable_if_t<std::is_base_of<Member, typename Container::value_type::member_type>::value, int> = 0>
         Lock remove(const Container &members) {
-            if (members.empty()) return Lock(isWrite(), isLocked()); // Fake lock
+            // Fake lock (a fake lock also ignores add(), so has nothing to remove)
+            if (members.empty() or isFake()) return Lock(isWrite(), isLocked());
 
-            MemberSet new_lock_members;
+            MemberSet new_lock_members, new_lock_borrowed;
             for (auto &mem : members) {
                 auto found = data->members.find(mem);
                 if (found == data->members.end())
                     throw std::out_of_range("Member passed to Lock.remove() is not contained in the lock");
 
+                auto found_borrowed = data->borrowed.find(mem);
+                if (found_borrowed != data->borrowed.end()) {
+                    new_lock_borrowed.insert(*found_borrowed);
+                    data->borrowed.erase(found_borrowed);
+                }
                 new_lock_members.insert(*found);
                 data->members.erase(found);
             }
-            return Member::Lock(isWrite(), isLocked(), std::move(new_lock_members));
+            return Member::Lock(isWrite(), isLocked(), std::move(new_lock_members), std::move(new_lock_borrowed));
         }
 
     private:
@@ -431,7 +449,7 @@ public:
          * primarily intended for use by remove() to split a Lock into multiple Locks without
          * requiring an intermediate release and relocking.
          */
-        Lock(bool write, bool locked, MemberSet &&members);
+        Lock(bool write, bool locked, MemberSet &&members, MemberSet &&borrowed = {});
 
         /** Obtains a lock on all members.  If `write` is true, all locks will be exclusive;
          * otherwise all locks will be shared.  This method blocks until a mutex is held on all
@@ -454,15 +472,30 @@ public:
             public:
                 /** Default constructor explicitly deleted. */
                 Data() = delete;
-                Data(MemberSet &&mbrs, bool wrt, bool lckd = false)
-                    : members{std::move(mbrs)}, write{wrt}, locked{lckd}
+                Data(MemberSet &&mbrs, bool wrt, bool lckd = false, MemberSet &&brwd = {})
+                    : members{std::move(mbrs)}, borrowed{std::move(brwd)}, write{wrt}, locked{lckd}
                 {}
                 MemberSet members;
+                /// Members already locked by another Lock in this thread when this lock was
+                /// established; this lock doesn't lock or unlock them itself.
+                MemberSet borrowed;
                 bool write;
                 bool locked;
         };
 
         std::shared_ptr<Data> data;
+
+        /// The members locked by Lock objects in the current thread, and whether each is locked
+        /// for writing.  Members borrowed from an enclosing lock are not included.
+        static thread_local std::unordered_map<const Member*, bool> held_;
+
+        /** Returns true if the current thread already holds a lock on `member` that satisfies a
+         * lock of the given type.
+         *
+         * \throws std::system_error with an error code of std::errc::resource_deadlock_would_occur
+         * if a write lock is wanted, but the thread only holds a read lock on the member.
+         */
+        static bool held_by_thread_(const Member *member, bool write);
     };
 
     /** Obtains a read lock for the current object *plus* all the objects passed in; provided
@@ -474,8 +507,8 @@ public:
      * unable to obtain a lock on one of the objects, it will release any other held locks before
      * blocking on the unobtainable lock.
      *
-     * Because the fundamental mutex used for locking is recursive, it is safe to call this in such
-     * a way that objects are locked multiple times.
+     * Because locks are recursive within a thread (see Member::Lock), it is safe to call this in
+     * such a way that objects are locked multiple times.
      *
      * The lock will be released automatically when the returned object is destroyed, typically by
      * going out of scope.  It can also be explicitly controlled.
@@ -500,11 +533,11 @@ public:
      * obtained on all objects.
      *
      * Like readLock, this method is deadlock safe if used properly: it will not block waiting for a
-     * lock while holding any other locks, and, because of the use of a recursive mutex, will not
-     * deadlock when an object is included multiple times in the list of objects to lock.
+     * lock while holding any other locks, and, because locks are recursive within a thread, will
+     * not deadlock when an object is included multiple times in the list of objects to lock.
      *
      * Overlapping write locks on the same object within the same thread are allowed, but write
-     * locks on objects that are read-locked in the same thread will cause a deadlock.  You may
+     * locks on objects that are read-locked in the same thread throw a std::system_error.  You may
      * overlap the other way (i.e. obtaining a read lock on a write-locked object), so long as you
      * never try to obtain a write lock over top of the read lock.
      *
@@ -9,6 +9,8 @@
 
 namespace eris {
 
+constexpr size_t Simulation::reduce_min_per_thread;
+
 void Simulation::registerDependency(MemberID member, MemberID depends_on) {
     std::lock_guard<std::recursive_mutex> lock(member_mutex_);
     depends_on_[depends_on].insert(member);
@@ -280,10 +282,7 @@ void Simulation::thr_loop() {
             case RunStage::intra_Reoptimize:
                 // Slightly trickier than the others: we need to signal a redo on the intra-optimizers
                 // if any reoptimize returns false.
-                thr_work<intraopt::Reoptimize>([this](intraopt::Reoptimize &opt) {
-                    if (opt.intraReoptimize()) // Need a restart
-                        thr_redo_intra_ = true;
-                });
+                thr_work<intraopt::Reoptimize>([this](intraopt::Reoptimize &opt) { thr_reoptimize(opt); });
                 thr_stage_finished(curr_stage, curr_priority);
                 break;
         }
@@ -319,14 +318,28 @@ void Simulation::thr_work(const std::function<void(Opt&)> &work) {
     }
 }
 
+void Simulation::thr_reoptimize(intraopt::Reoptimize &opt) {
+    if (opt.intraReoptimize()) { // Need a restart
+        thr_redo_intra_ = true;
+        if (partitioned_clearing_) {
+            std::lock_guard<std::mutex> lock(thr_redo_mutex_);
+            thr_redo_members_.push_back(dynamic_cast<Member&>(opt).id());
+        }
+    }
+}
+
 void Simulation::thr_stage(const RunStage &stage) {
+    thr_stage(stage, optimizers_[(int) stage]);
+}
+
+void Simulation::thr_stage(const RunStage &stage, std::map<double, std::unordered_set<SharedMember<Member>>> &optimizers) {
     if (stage < RunStage_FIRST)
         throw std::runtime_error("thr_stage called with non-stage RunStage");
 
     if (maxThreads() == 0) {
         // Not using threads; call thr_work directly
         stage_ = stage;
-        for (auto &priority_optimizer : optimizers_[(int) stage]) {
+        for (auto &priority_optimizer : optimizers) {
             stage_priority_   = priority_optimizer.first;
             opt_iterator_     = priority_optimizer.second.begin();
             opt_iterator_end_ = priority_optimizer.second.end();
@@ -347,10 +360,7 @@ void Simulation::thr_stage(const RunStage &stage) {
                 ERIS_SIM_NOTHR_WORK(intra, Finish)
 #undef ERIS_SIM_NOTHR_WORK
                 case RunStage::intra_Reoptimize:
-                    thr_work<intraopt::Reoptimize>([this](intraopt::Reoptimize &opt) {
-                    if (opt.intraReoptimize()) // Need a restart
-                        thr_redo_intra_ = true;
-                    });
+                    thr_work<intraopt::Reoptimize>([this](intraopt::Reoptimize &opt) { thr_reoptimize(opt); });
                     break;
                 case RunStage::idle:
                 case RunStage::kill:
@@ -363,7 +373,7 @@ void Simulation::thr_stage(const RunStage &stage) {
         }
     }
     else {
-        for (auto &priority_optimizer : optimizers_[(int) stage]) {
+        for (auto &priority_optimizer : optimizers) {
             // Threads: lock, signal, then wait for threads to finish
             std::unique_lock<std::mutex> lock_s(stage_mutex_, std::defer_lock);
             std::unique_lock<std::mutex> lock_d(done_mutex_, std::defer_lock);
@@ -435,6 +445,122 @@ std::shared_lock<std::shared_timed_mutex> Simulation::runLockTry() {
     return std::shared_lock<std::shared_timed_mutex>(run_mutex_, std::try_to_lock);
 }
 
+void Simulation::partitionedClearing(bool enabled) {
+    if (auto lock = runLockTry())
+        partitioned_clearing_ = enabled;
+    else
+        throw std::runtime_error("Cannot change partitioned clearing during a Simulation run() call");
+}
+
+std::unordered_map<id_t, id_t> Simulation::clearingComponents() const {
+    // Union-find over member ids:
+    std::unordered_map<id_t, id_t> parent;
+    auto find = [&parent](id_t a) {
+        auto it = parent.emplace(a, a).first;
+        while (it->second != a) {
+            // Path halving:
+            auto &grandparent = parent[it->second];
+            it->second = grandparent;
+            a = grandparent;
+            it = parent.find(a);
+        }
+        return a;
+    };
+    auto unite = [&](id_t a, id_t b) {
+        a = find(a); b = find(b);
+        if (a != b) parent[b] = a;
+    };
+
+    std::lock_guard<std::recursive_mutex> lock(member_mutex_);
+
+    for (auto &m : markets_) {
+        auto &market = m.second;
+        for (auto &g : market->output_unit) unite(m.first, g.first);
+        for (auto &g : market->price_unit) unite(m.first, g.first);
+        for (auto &f : market->firms()) unite(m.first, f);
+    }
+    for (auto &a : agents_) {
+        for (auto &g : a.second->assets) unite(a.first, g.first);
+    }
+    for (auto *deps : {&depends_on_, &weak_dep_}) {
+        for (auto &d : *deps) {
+            for (auto &dep : d.second) unite(d.first, dep);
+        }
+    }
+
+    // If any intra-period optimizer isn't linked to anything, we have no idea what it interacts
+    // with, so everything has to be considered connected.
+    bool isolated = false;
+    for (auto stage : {RunStage::intra_Reset, RunStage::intra_Optimize, RunStage::intra_Reoptimize}) {
+        for (auto &priority_optimizer : optimizers_[(int) stage]) {
+            for (auto &opt : priority_optimizer.second) {
+                if (parent.count(opt->id()) == 0) { isolated = true; parent.emplace(opt->id(), opt->id()); }
+            }
+        }
+    }
+    if (isolated and not parent.empty()) {
+        id_t root = parent.begin()->first;
+        std::vector<id_t> ids;
+        ids.reserve(parent.size());
+        for (auto &p : parent) ids.push_back(p.first);
+        for (auto &id : ids) unite(root, id);
+    }
+
+    std::unordered_map<id_t, id_t> component;
+    component.reserve(parent.size());
+    for (auto &p : parent) component.emplace(p.first, 0);
+    for (auto &c : component) c.second = find(c.first);
+    return component;
+}
+
+void Simulation::thr_intra_partitioned() {
+    // The component representatives that need another round; empty means everything (i.e. the
+    // first round).
+    std::unordered_set<id_t> redo;
+    std::unordered_map<id_t, id_t> component;
+
+    // Returns the optimizers of `stage` that belong to a component in `redo`.
+    auto active = [&](RunStage stage) {
+        std::map<double, std::unordered_set<SharedMember<Member>>> opts;
+        for (auto &priority_optimizer : optimizers_[(int) stage]) {
+            for (auto &opt : priority_optimizer.second) {
+                auto c = component.find(opt->id());
+                // Anything not in a component must have been added this round; include it.
+                if (c == component.end() or redo.count(c->second))
+                    opts[priority_optimizer.first].insert(opt);
+            }
+        }
+        return opts;
+    };
+
+    while (true) {
+        intraopt_count++;
+        thr_redo_members_.clear();
+        thr_redo_intra_ = false;
+        if (redo.empty()) {
+            thr_stage(RunStage::intra_Reset);
+            thr_stage(RunStage::intra_Optimize);
+            thr_stage(RunStage::intra_Reoptimize);
+        }
+        else {
+            for (auto stage : {RunStage::intra_Reset, RunStage::intra_Optimize, RunStage::intra_Reoptimize}) {
+                auto opts = active(stage);
+                thr_stage(stage, opts);
+            }
+        }
+
+        if (thr_redo_members_.empty()) break;
+
+        // Figure out which components need another round:
+        component = clearingComponents();
+        redo.clear();
+        for (auto &id : thr_redo_members_) {
+            auto c = component.find(id);
+            redo.insert(c == component.end() ? id : c->second);
+        }
+    }
+}
+
 void Simulation::run() {
     std::unique_lock<std::shared_timed_mutex> lock(run_mutex_);
 
@@ -459,13 +585,18 @@ void Simulation::run() {
 
     thr_stage(RunStage::intra_Initialize);
 
-    thr_redo_intra_ = true;
-    while (thr_redo_intra_) {
-        intraopt_count++;
-        thr_stage(RunStage::intra_Reset);
-        thr_stage(RunStage::intra_Optimize);
-        thr_redo_intra_ = false;
-        thr_stage(RunStage::intra_Reoptimize);
+    if (partitioned_clearing_) {
+        thr_intra_partitioned();
+    }
+    else {
+        thr_redo_intra_ = true;
+        while (thr_redo_intra_) {
+            intraopt_count++;
+            thr_stage(RunStage::intra_Reset);
+            thr_stage(RunStage::intra_Optimize);
+            thr_redo_intra_ = false;
+            thr_stage(RunStage::intra_Reoptimize);
+        }
     }
 
     thr_stage(RunStage::intra_Apply);
@@ -13,6 +13,7 @@
 #include <vector>
 #include <list>
 #include <memory>
+#include <exception>
 #include <typeinfo>
 #include <typeindex>
 #include <thread>
@@ -29,6 +30,7 @@ class Member;
 class Agent;
 class Good;
 class Market;
+namespace intraopt { class Reoptimize; }
 
 /** This class is at the centre of an Eris economy model; it keeps track of all of the agents
  * currently in the economy, all of the goods currently available in the economy, and the
@@ -310,6 +312,42 @@ class Simulation : public std::enable_shared_from_this<Simulation>, private nonc
          */
         unsigned long maxThreads() { return max_threads_; }
 
+        /** Enables or disables partitioned intra-period clearing for subsequent calls to run().
+         *
+         * When enabled, the intra-period reset/optimize/reoptimize rounds of run() treat the
+         * simulation as a set of independent components rather than one coupled economy.
+         * Components are the connected components of the graph linking:
+         * - each market to the goods in its `output_unit` and `price_unit`, and to its firms;
+         * - each agent to the goods in its assets;
+         * - each member to the members it depends (weakly or strongly) on.
+         *
+         * When an intraReoptimize() call requests a new round, only the optimizers in the same
+         * component as the requesting optimizer are reset and reoptimized in the next round;
+         * components that have already settled are left alone.  Components still being
+         * reoptimized run together in each round, so they share the available threads.  Other
+         * stages are unaffected.
+         *
+         * Because the components are inferred from the links above, an optimizer that interacts
+         * with markets or agents without any such link (for example, by buying in a market chosen
+         * at random) could end up in the wrong component.  As a precaution, if any intra-period
+         * optimizer has no links at all, everything is treated as a single component.
+         *
+         * This is disabled by default.
+         *
+         * \throws std::runtime_error if called during a run() call.
+         */
+        void partitionedClearing(bool enabled);
+
+        /// Returns true if partitioned intra-period clearing is enabled.
+        bool partitionedClearing() const { return partitioned_clearing_; }
+
+        /** Returns the clearing components used when partitionedClearing() is enabled, as a map from
+         * member id to a representative member id of its component: two members are in the same
+         * component if and only if they map to the same value.  Members without any links are not
+         * included.
+         */
+        std::unordered_map<id_t, id_t> clearingComponents() const;
+
         /** Runs one period of period of the simulation.  The following happens, in order:
          *
          * - Simulation time period (accessible by `t()`) is incremented.
@@ -416,6 +454,51 @@ class Simulation : public std::enable_shared_from_this<Simulation>, private nonc
          */
         std::shared_lock<std::shared_timed_mutex> runLockTry();
 
+        /// The default reduction used by reduceAgents(): adds `value` to `accum` using `+=`.
+        struct reduce_plus {
+            template <typename T, typename U>
+            void operator()(T &accum, U &&value) const { accum += std::forward<U>(value); }
+        };
+
+        /** Performs a parallel map-reduce over the simulation's agents, for example to compute the
+         * aggregate assets of every agent:
+         *
+         *     Bundle total = sim->reduceAgents([](const SharedMember<Agent> &a) -> const Bundle& {
+         *             return a->assets; }, Bundle());
+         *
+         * `map` is called once with each agent (of type `A`, filtered as in agents<A>()) and
+         * returns a value that is folded into an accumulator by calling `reduce(accum, value)`; the
+         * default reduction simply does `accum += value`.  When maxThreads() is greater than 0 and
+         * there are enough agents to make it worthwhile, the agents are split into up to
+         * maxThreads() contiguous blocks, each block is reduced into its own partial result in a
+         * separate thread, and the partial results are then merged pairwise (as a binary tree)
+         * into the final result.
+         *
+         * `init` is used to initialize *each* partial result, and so it must be an identity value
+         * for the reduction (e.g. an empty Bundle, or 0 for a sum).  It is returned as is if there
+         * are no agents.
+         *
+         * This obtains runLock() for the duration of the reduction, so it waits for any active
+         * run() call to finish (and, consequently, must not be called from within a run() stage).
+         * Because the simulation is idle, no member write locks are obtained: `map` must only read
+         * from the agents it is given, and must be safe to call simultaneously (for different
+         * agents) from multiple threads.  The reduction is not required to be commutative: partial
+         * results are always merged in agent order, though that order (like the order of agents())
+         * is unspecified.
+         *
+         * If `map` or `reduce` throws an exception, the exception is rethrown (after all threads
+         * have finished) from this method.
+         */
+        template <class A = Agent, typename T, typename Map, typename Reduce = reduce_plus>
+        typename enable_if_member<Agent, A, T>::type
+        reduceAgents(const Map &map, T init, const Reduce &reduce = Reduce());
+
+        /** The minimum number of agents each thread used by reduceAgents() is given: smaller
+         * reductions use fewer threads (or no threads at all), as the cost of starting threads
+         * would otherwise outweigh the benefits.
+         */
+        static constexpr size_t reduce_min_per_thread = 256;
+
         /** Contains the number of rounds of the intra-period optimizers in the previous run() call.
          * A round is defined by a intraReset() call, a set of intraOptimize() calls, and a set of
          * intraReoptimize() calls.  A multi-round optimization will only occur when there are
@@ -587,6 +670,26 @@ class Simulation : public std::enable_shared_from_this<Simulation>, private nonc
         // they are finished with the current stage.
         void thr_stage(const RunStage &stage);
 
+        // Like thr_stage(stage), but runs the given (priority-mapped) optimizers instead of all of
+        // the optimizers registered for the stage.
+        void thr_stage(const RunStage &stage, std::map<double, std::unordered_set<SharedMember<Member>>> &optimizers);
+
+        // Calls intraReoptimize() on the given optimizer, recording a redo request if it returns
+        // true.
+        void thr_reoptimize(intraopt::Reoptimize &opt);
+
+        // Performs the intra-period reset/optimize/reoptimize rounds with partitioned clearing.
+        void thr_intra_partitioned();
+
+        // Whether partitioned clearing is enabled
+        bool partitioned_clearing_ = false;
+
+        // The members whose intraReoptimize() requested a redo in the current round (only
+        // recorded with partitioned clearing).
+        std::vector<id_t> thr_redo_members_;
+        // Mutex protecting thr_redo_members_
+        std::mutex thr_redo_mutex_;
+
         // Called at the beginning of run() to start up needed threads or kill off excess threads.
         //
         // Excess threads are those which exceed maxThreads().
@@ -707,6 +810,49 @@ size_t Simulation::genericFilterCount(
     return count;
 }
 
+template <class A, typename T, typename Map, typename Reduce>
+typename Simulation::enable_if_member<Agent, A, T>::type
+Simulation::reduceAgents(const Map &map, T init, const Reduce &reduce) {
+    auto lock = runLock();
+    const auto members = agents<A>();
+
+    const size_t threads = std::min<size_t>(max_threads_, members.size() / reduce_min_per_thread);
+    if (threads <= 1) {
+        // Not enough agents (or threading is disabled), so just reduce them serially
+        for (auto &m : members) reduce(init, map(m));
+        return init;
+    }
+
+    // Each thread reduces a contiguous block of agents into its own partial result:
+    std::vector<T> partial(threads, init);
+    std::vector<std::exception_ptr> error(threads);
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    auto work = [&](size_t t) {
+        try {
+            const size_t end = (t+1) * members.size() / threads;
+            for (size_t i = t * members.size() / threads; i < end; i++)
+                reduce(partial[t], map(members[i]));
+        }
+        catch (...) {
+            error[t] = std::current_exception();
+        }
+    };
+    for (size_t t = 1; t < threads; t++) workers.emplace_back(work, t);
+    work(0); // Do the first block in this thread
+    for (auto &w : workers) w.join();
+
+    for (auto &e : error) { if (e) std::rethrow_exception(e); }
+
+    // Merge the partial results pairwise: 0+1, 2+3, ..., then 0+2, 4+6, ..., etc.
+    for (size_t step = 1; step < threads; step *= 2) {
+        for (size_t t = 0; t + step < threads; t += 2*step)
+            reduce(partial[t], std::move(partial[t + step]));
+    }
+
+    return std::move(partial[0]);
+}
+
 }
 
 
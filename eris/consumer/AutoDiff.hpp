@@ -0,0 +1,112 @@
+#pragma once
+#include <eris/Consumer.hpp>
+#include <eris/consumer/HyperDual.hpp>
+#include <Eigen/Core>
+#include <utility>
+#include <vector>
+
+namespace eris { namespace consumer {
+
+/** The bundle view passed to an AutoDiff utility function.  Indexing it with a good gives that
+ * good's quantity as a `T`, which is a double when evaluating utility, and a HyperDual (with the
+ * goods being differentiated seeded) when evaluating derivatives.
+ */
+template <typename T> class AutoDiffBundle;
+
+/// Bundle view that gives plain double quantities.
+template <> class AutoDiffBundle<double> {
+    public:
+        /// Wraps the given bundle
+        explicit AutoDiffBundle(const BundleNegative &b) : b_(b) {}
+        /// Returns the quantity of good `g`
+        double operator[](MemberID g) const { return b_[g]; }
+    private:
+        const BundleNegative &b_;
+};
+
+/// Bundle view that gives HyperDual quantities, with derivative parts seeded for up to two goods.
+template <> class AutoDiffBundle<HyperDual> {
+    public:
+        /** Wraps the given bundle, seeding the \f$\epsilon_1\f$ part of good `g1` and the
+         * \f$\epsilon_2\f$ part of good `g2`.  A good id of 0 seeds nothing.
+         */
+        AutoDiffBundle(const BundleNegative &b, id_t g1, id_t g2) : b_(b), g1_(g1), g2_(g2) {}
+        /// Returns the quantity of good `g`
+        HyperDual operator[](MemberID g) const {
+            return {b_[g], g == g1_ ? 1.0 : 0.0, g == g2_ ? 1.0 : 0.0, 0.0};
+        }
+    private:
+        const BundleNegative &b_;
+        const id_t g1_, g2_;
+};
+
+/** Consumer::Differentiable that computes exact derivatives of a utility function by automatic
+ * (forward-mode) differentiation, using hyper-dual numbers.  This allows any sufficiently smooth
+ * utility function to be used with the gradient-based optimizers (such as intraopt::MUPD) without
+ * writing out its derivatives or resorting to finite differences.
+ *
+ * The utility function must be a callable (typically a generic lambda) that can be called with an
+ * `AutoDiffBundle<T>` for both `T = double` and `T = HyperDual`: indexing the bundle with a good
+ * gives that good's quantity as a `T`, and the function should return utility as a `T`.  Math
+ * functions should be called unqualified so that the HyperDual versions are found, for example:
+ *
+ *     auto u = [x, y](const auto &q) {
+ *         using std::log; using std::pow;
+ *         return log(1 + q[x]) + 2 * pow(q[y], 0.5);
+ *     };
+ *     auto con = sim->spawn<consumer::AutoDiff<decltype(u)>>(u);
+ *
+ * utility() evaluates the function with doubles, at no extra cost; d() and d2() each evaluate it
+ * once with hyper-dual numbers, which costs a small constant factor more than utility().
+ * gradientVector() and hessianMatrix() need one hyper-dual evaluation per good and per distinct
+ * pair of goods, respectively.
+ */
+template <typename F>
+class AutoDiff : public Consumer::Differentiable {
+    public:
+        /// Constructs the consumer from a utility function
+        explicit AutoDiff(F f) : f_(std::move(f)) {}
+
+        /// Returns the utility at the given bundle
+        double utility(const BundleNegative &b) const override {
+            return f_(AutoDiffBundle<double>(b));
+        }
+
+        /// Returns the derivative with respect to good `g` at the given bundle
+        double d(const BundleNegative &b, MemberID g) const override {
+            return eval(b, g, 0).e1;
+        }
+
+        /// Returns the second derivative with respect to goods `g1` and `g2` at the given bundle
+        double d2(const BundleNegative &b, MemberID g1, MemberID g2) const override {
+            return eval(b, g1, g2).e12;
+        }
+
+        /// Returns the gradient with respect to the given goods
+        Eigen::VectorXd gradientVector(const std::vector<id_t> &g, const BundleNegative &b) const override {
+            Eigen::VectorXd grad(g.size());
+            for (size_t i = 0; i < g.size(); i++)
+                grad[i] = eval(b, g[i], 0).e1;
+            return grad;
+        }
+
+        /// Returns the Hessian with respect to the given goods
+        Eigen::MatrixXd hessianMatrix(const std::vector<id_t> &g, const BundleNegative &b) const override {
+            Eigen::MatrixXd hess(g.size(), g.size());
+            for (size_t i = 0; i < g.size(); i++) {
+                for (size_t j = i; j < g.size(); j++)
+                    hess(i, j) = hess(j, i) = eval(b, g[i], g[j]).e12;
+            }
+            return hess;
+        }
+
+    private:
+        F f_;
+
+        // Evaluates the utility function with hyper-dual quantities seeded for g1 and g2
+        HyperDual eval(const BundleNegative &b, id_t g1, id_t g2) const {
+            return f_(AutoDiffBundle<HyperDual>(b, g1, g2));
+        }
+};
+
+} }
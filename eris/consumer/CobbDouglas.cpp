@@ -1,7 +1,10 @@
 #include <eris/consumer/CobbDouglas.hpp>
+#include <algorithm>
 #include <limits>
+#include <stdexcept>
 #include <utility>
 #include <cmath>
+#include <unordered_map>
 
 namespace eris { namespace consumer {
 
@@ -64,6 +67,39 @@ double CobbDouglas::utility(const BundleNegative &b) const {
     return u;
 }
 
+Eigen::VectorXd CobbDouglas::utilityBatch(const BundleNegative &base, const std::vector<id_t> &goods,
+        const Eigen::MatrixXd &deltas) const {
+    Eigen::MatrixXd X;
+    auto all = batchQuantities(base, goods, deltas, X);
+    std::unordered_map<id_t, size_t> row;
+    for (size_t i = 0; i < all.size(); i++) row.emplace(all[i], i);
+
+    const double inf = std::numeric_limits<double>::infinity();
+    Eigen::ArrayXd u = Eigen::ArrayXd::Constant(X.cols(), constant);
+    for (auto &e : exponents) {
+        if (e.second == 0) continue;
+
+        // As in utility(), a candidate's utility stops changing once it is 0 or infinite (so that
+        // whichever of a zero factor or an infinite factor comes first wins, just as it does there)
+        Eigen::Array<bool, Eigen::Dynamic, 1> done = u == 0 or u == inf;
+
+        auto found = row.find(e.first);
+        if (found == row.end()) {
+            // The good is in none of the candidates, so has quantity 0 in all of them
+            u = done.select(u, u * power(0, e.second));
+            continue;
+        }
+
+        Eigen::ArrayXd q = X.row(found->second).transpose().array();
+        Eigen::ArrayXd f = e.second == 1 ? q : q.pow(e.second);
+        // A zero quantity gives 0 with a positive exponent, and infinity with a negative one
+        f = (q == 0).select(power(0, e.second), f);
+        u = done.select(u, u * f);
+    }
+
+    return u.matrix();
+}
+
 double CobbDouglas::d(const BundleNegative &b, MemberID g) const {
     // Short-circuit cases resulting in a 0 derivative
     if (!exponents.count(g) or exponents.at(g) == 0)
@@ -112,4 +148,98 @@ double CobbDouglas::d2(const BundleNegative &b, MemberID g1, MemberID g2) const
     return h;
 }
 
+bool CobbDouglas::interior(const BundleNegative &b) const {
+    for (auto &e : exponents) {
+        if (e.second != 0 and not(b[e.first] > 0)) return false;
+    }
+    return true;
+}
+
+Eigen::VectorXd CobbDouglas::gradientVector(const std::vector<id_t> &goods, const BundleNegative &b) const {
+    if (not interior(b)) return Consumer::Differentiable::gradientVector(goods, b);
+
+    double u = utility(b);
+    Eigen::VectorXd grad(goods.size());
+    for (size_t i = 0; i < goods.size(); i++) {
+        double alpha = exp(goods[i]);
+        grad[i] = alpha == 0 ? 0.0 : alpha * u / b[goods[i]];
+    }
+
+    return grad;
+}
+
+Eigen::MatrixXd CobbDouglas::hessianMatrix(const std::vector<id_t> &goods, const BundleNegative &b) const {
+    if (not interior(b)) return Consumer::Differentiable::hessianMatrix(goods, b);
+
+    const size_t n = goods.size();
+    double u = utility(b);
+    // a[i] = alpha_i / x_i, so that H = u (a a' - diag(alpha_i / x_i^2))
+    Eigen::VectorXd a(n), own(n);
+    for (size_t i = 0; i < n; i++) {
+        double alpha = exp(goods[i]);
+        double x = alpha == 0 ? 1.0 : b[goods[i]];
+        a[i] = alpha / x;
+        own[i] = alpha / (x*x);
+    }
+
+    Eigen::MatrixXd H = u * (a * a.transpose());
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < i; j++) {
+            // A repeated good is also a diagonal element
+            if (goods[i] == goods[j]) H(i, j) = H(j, i) = H(i, i) - u * own[i];
+        }
+        H(i, i) -= u * own[i];
+    }
+
+    return H;
+}
+
+bool CobbDouglas::demand(const BundleNegative &base, const std::vector<id_t> &goods,
+        const Eigen::VectorXd &prices, double income, Eigen::VectorXd &q) const {
+    if ((size_t) prices.size() != goods.size())
+        throw std::invalid_argument("CobbDouglas::demand: prices must have one element per good");
+    if (not(constant > 0) or not(income >= 0)) return false;
+
+    std::unordered_map<id_t, size_t> index;
+    for (size_t i = 0; i < goods.size(); i++) {
+        if (not index.emplace(goods[i], i).second or not(prices[i] > 0)) return false;
+    }
+    for (auto &e : exponents) {
+        if (e.second < 0) return false;
+        if (e.second > 0 and not index.count(e.first) and base[e.first] <= 0) return false;
+    }
+
+    // The goods with positive exponents, sorted by p*b/alpha, which is the inverse of the marginal
+    // utility per dollar (up to a common factor) of each good at its base quantity.
+    struct candidate { size_t i; double alpha, b, ratio; };
+    std::vector<candidate> buy;
+    for (size_t i = 0; i < goods.size(); i++) {
+        double alpha = exp(goods[i]);
+        if (alpha == 0) continue;
+        double b = base[goods[i]];
+        if (b < 0) return false;
+        buy.push_back({i, alpha, b, prices[i] * b / alpha});
+    }
+    if (buy.empty()) return false;
+    std::sort(buy.begin(), buy.end(), [](const candidate &x, const candidate &y) { return x.ratio < y.ratio; });
+
+    // Add goods in order for as long as the next good is worth buying at the current marginal
+    // utility of income (which is proportional to A/M); adding a good lowers A/M, but never below
+    // that of the goods already added, so the goods bought are always a prefix of the sorted list.
+    double A = 0, M = income;
+    size_t k = 0;
+    for (; k < buy.size(); k++) {
+        if (k > 0 and buy[k].ratio * A >= M) break;
+        A += buy[k].alpha;
+        M += prices[buy[k].i] * buy[k].b;
+    }
+
+    q = Eigen::VectorXd::Zero(goods.size());
+    for (size_t j = 0; j < k; j++) {
+        auto &c = buy[j];
+        q[c.i] = std::max(0.0, c.alpha * M / (A * prices[c.i]) - c.b);
+    }
+    return true;
+}
+
 } }
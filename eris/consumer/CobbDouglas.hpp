@@ -14,7 +14,7 @@ namespace eris { namespace consumer {
  * Negative exponents are permitted, but not particularly useful as utility will be infinite
  * whenever the good with the negative exponent is 0.
  */
-class CobbDouglas : public Consumer::Differentiable {
+class CobbDouglas : public Consumer::Differentiable, public virtual Consumer::AnalyticDemand {
     public:
         /** Initialize with no coefficients with an optional constant coefficient (defaulting to 1).
          * Additional coefficients can be accessed via the coef() and exp() methods.
@@ -59,11 +59,50 @@ class CobbDouglas : public Consumer::Differentiable {
         /// Evaluates the utility given the current coefficients at bundle \f$b\f$.
         double utility(const BundleNegative &b) const override;
 
+        /** Evaluates utility at a batch of candidate bundles, raising each good's row of candidate
+         * quantities to its exponent at once.  Candidates with a zero quantity of any good with a
+         * non-zero exponent have utility 0, as in utility().
+         */
+        Eigen::VectorXd utilityBatch(const BundleNegative &base, const std::vector<id_t> &goods,
+                const Eigen::MatrixXd &deltas) const override;
+
         /// Returns the first derivative w.r.t. good g, evaluated at bundle b.
         double d(const BundleNegative &b, MemberID g) const override;
 
         /// Returns the second derivative w.r.t. goods g1, g2, evaluated at bundle b.
         virtual double d2(const BundleNegative &b, MemberID g1, MemberID g2) const override;
+
+        /** Returns the gradient as a dense vector.  When all goods with non-zero exponents have
+         * positive quantities, this uses \f$ \frac{\partial u}{\partial x_i} = \frac{\alpha_i
+         * u}{x_i} \f$, so utility only needs to be calculated once; otherwise it falls back to
+         * calling d() for each good.
+         */
+        virtual Eigen::VectorXd gradientVector(const std::vector<id_t> &g, const BundleNegative &b) const override;
+
+        /** Returns the Hessian as a dense matrix.  When all goods with non-zero exponents have
+         * positive quantities, this uses \f$ \frac{\partial^2 u}{\partial x_i \partial x_j} =
+         * \frac{\alpha_i (\alpha_j - \delta_{ij}) u}{x_i x_j} \f$, so utility only needs to be
+         * calculated once; otherwise it falls back to calling d2() for each element.
+         */
+        virtual Eigen::MatrixXd hessianMatrix(const std::vector<id_t> &g, const BundleNegative &b) const override;
+
+        /** Calculates Cobb-Douglas demand: each purchased good \f$i\f$ ends up with quantity
+         * \f$\frac{\alpha_i M}{A p_i}\f$, where \f$A\f$ is the sum of the exponents of the
+         * purchased goods and \f$M\f$ is income plus the value of the base quantities of the
+         * purchased goods.  A good already held in a large enough quantity is not purchased at
+         * all; such goods are found by sorting the goods by \f$\frac{p_i b_i}{\alpha_i}\f$, so
+         * this takes \f$O(n \log n)\f$ time in the number of goods.
+         *
+         * Returns false if the constant coefficient isn't positive, any exponent is negative, any
+         * price isn't positive, a good appears more than once in `goods`, a good with a positive
+         * exponent has a negative base quantity, no good in `goods` has a positive exponent, or
+         * some good with a positive exponent is in neither `goods` nor `base` (so that utility is 0
+         * whatever is bought).
+         *
+         * \throws std::invalid_argument if `prices` and `goods` have different sizes.
+         */
+        bool demand(const BundleNegative &base, const std::vector<id_t> &goods,
+                const Eigen::VectorXd &prices, double income, Eigen::VectorXd &q) const override;
     protected:
         /// The constant offset.  \sa coef()
         double constant = 0.0;
@@ -72,6 +111,9 @@ class CobbDouglas : public Consumer::Differentiable {
     private:
         // Wrapper around pow() that redefines some special 0/infinity cases.
         double power(double val, double exponent) const;
+        // Returns true if every good with a non-zero exponent has a positive quantity in b, in
+        // which case the closed-form gradient and Hessian expressions can be used.
+        bool interior(const BundleNegative &b) const;
 };
 
 } }
@@ -1,5 +1,6 @@
 #pragma once
 #include <eris/Consumer.hpp>
+#include <eris/consumer/CompoundPlan.hpp>
 
 namespace eris { namespace consumer {
 
@@ -16,6 +17,11 @@ namespace eris { namespace consumer {
  * would use a CompoundSum(CompoundSum(c1, c2), c3).  Only the final (outermost) consumer object
  * should be added to the simulation.
  *
+ * The first time a compound consumer is evaluated, the tree of compound consumers below it is
+ * compiled into a flattened CompoundPlan, so that each component consumer is evaluated only once
+ * per bundle no matter how deeply the tree is nested or how many times a component appears in it.
+ * The plan is recompiled automatically if any `first` or `second` pointer in the tree is changed.
+ *
  * Note that a CompoundSum is *not* differentiable: if your indidividual consumer utilities are
  * differentiable, you should use CompoundSum::Differentiable instead.
  *
@@ -41,15 +47,21 @@ class CompoundSum : public Consumer {
 
         /// Returns the sum of utilities of the two consumers
         double utility(const BundleNegative &bundle) const override {
-            return first->utility(bundle) + second->utility(bundle);
+            return plan()->utility(bundle);
         }
 
+        /// Returns the compiled plan of this consumer's compound tree.
+        std::shared_ptr<const CompoundPlan> plan() const { return plan_.get(*this); }
+
         class Differentiable;
 
         /// Shared pointer to the first Consumer object given in the constructor.
         std::shared_ptr<Consumer> first,
         /// Shared pointer to the second Consumer object given in the constructor.
             second;
+
+    private:
+        CompoundPlan::Cache plan_;
 };
 
 /** This is just like Compound, but restricts the summation to a pair of Consumer::Differentiable
@@ -75,23 +87,39 @@ class CompoundSum::Differentiable : public Consumer::Differentiable {
 
         /// Returns the sum of utilities of the two consumers
         double utility(const BundleNegative &bundle) const override {
-            return first->utility(bundle) + second->utility(bundle);
+            return plan()->utility(bundle);
         }
 
         /// Returns the derivative, which is the sum of consumer derivatives.
         double d(const BundleNegative &bundle, MemberID g) const override {
-            return first->d(bundle, g) + second->d(bundle, g);
+            return plan()->d(bundle, g);
         }
 
         /// Returns the second derivative, which is the sum of consumer second derivatives.
         double d2(const BundleNegative &bundle, MemberID g1, MemberID g2) const override {
-            return first->d2(bundle, g1, g2) + second->d2(bundle, g1, g2);
+            return plan()->d2(bundle, g1, g2);
+        }
+
+        /// Returns the gradient, evaluating each component consumer once.
+        Eigen::VectorXd gradientVector(const std::vector<id_t> &g, const BundleNegative &b) const override {
+            return plan()->gradientVector(g, b);
         }
 
+        /// Returns the Hessian, evaluating each component consumer once.
+        Eigen::MatrixXd hessianMatrix(const std::vector<id_t> &g, const BundleNegative &b) const override {
+            return plan()->hessianMatrix(g, b);
+        }
+
+        /// Returns the compiled plan of this consumer's compound tree.
+        std::shared_ptr<const CompoundPlan> plan() const { return plan_.get(*this); }
+
         /// Shared pointer to the first consumer instance given in the constructor.
         std::shared_ptr<Consumer::Differentiable> first,
         /// Shared pointer to the second consumer instance given in the constructor.
             second;
+
+    private:
+        CompoundPlan::Cache plan_;
 };
 
 /** Uses two consumer classes together as a product.  You could, for example, represent \f$ u(x,y) =
@@ -118,17 +146,21 @@ class CompoundProduct : public Consumer {
 
         /// Returns the product of utilities
         double utility(const BundleNegative &bundle) const override {
-            double ua = first->utility(bundle);
-            if (ua == 0) return ua; // Short-circuit
-            return ua * second->utility(bundle);
+            return plan()->utility(bundle);
         }
 
+        /// Returns the compiled plan of this consumer's compound tree.
+        std::shared_ptr<const CompoundPlan> plan() const { return plan_.get(*this); }
+
         class Differentiable;
 
         /// The first consumer instance given in the constructor.
         std::shared_ptr<Consumer> first,
         /// The second consumer instance given in the constructor.
             second;
+
+    private:
+        CompoundPlan::Cache plan_;
 };
 
 /** Multiples together a pair of Consumer::Differentiable consumer utilities, retaining the
@@ -154,23 +186,14 @@ class CompoundProduct::Differentiable : public Consumer::Differentiable {
 
         /// Returns the product of utilities of the two consumers
         double utility(const BundleNegative &bundle) const override {
-            double ua = first->utility(bundle);
-            if (ua == 0) return ua; // Short-circuit
-            return ua * second->utility(bundle);
+            return plan()->utility(bundle);
         }
 
         /** Returns the derivative of \f$ u_1(\hdots) u_2(\hdots) \f$, which is, by the product rule,
          * \f$ \frac{\partial u_1}{\partial g} u_2 + u_1 \frac{\partial u_2}{\partial g} \f$.
          */
         double d(const BundleNegative &bundle, MemberID g) const override {
-            double grad = 0.0;
-            double aprime = first->d(bundle, g);
-            if (aprime != 0) grad += aprime * second->utility(bundle);
-
-            double bprime = second->d(bundle, g);
-            if (bprime != 0) grad += bprime * first->utility(bundle);
-
-            return grad;
+            return plan()->d(bundle, g);
         }
 
         /** Returns a second derivative of \f$ u_1(\hdots) u_2(\hdots) \f$, which is, by the chain
@@ -182,33 +205,29 @@ class CompoundProduct::Differentiable : public Consumer::Differentiable {
          * \f$.
          */
         double d2(const BundleNegative &bundle, MemberID g1, MemberID g2) const override {
-            double h = 0.0;
-            double a12 = first->d2(bundle, g1, g2);
-            if (a12 != 0) h += a12 * second->utility(bundle);
-
-            double a1 = first->d(bundle, g1);
-            if (a1 != 0) {
-                double b2 = second->d(bundle, g2);
-                h += a1 * b2;
-                if (g1 == g2)
-                    h += b2 * a1;
-            }
-            if (g1 != g2) {
-                double a2 = first->d(bundle, g2);
-                if (a2 != 0)
-                    h += a2 * second->d(bundle, g1);
-            }
-
-            double b12 = second->d2(bundle, g1, g2);
-            if (b12 != 0) h += b12 * first->utility(bundle);
-
-            return h;
+            return plan()->d2(bundle, g1, g2);
+        }
+
+        /// Returns the gradient, evaluating each component consumer once.
+        Eigen::VectorXd gradientVector(const std::vector<id_t> &g, const BundleNegative &b) const override {
+            return plan()->gradientVector(g, b);
         }
 
+        /// Returns the Hessian, evaluating each component consumer once.
+        Eigen::MatrixXd hessianMatrix(const std::vector<id_t> &g, const BundleNegative &b) const override {
+            return plan()->hessianMatrix(g, b);
+        }
+
+        /// Returns the compiled plan of this consumer's compound tree.
+        std::shared_ptr<const CompoundPlan> plan() const { return plan_.get(*this); }
+
         /// The first consumer instance given in the constructor.
         std::shared_ptr<Consumer::Differentiable> first,
         /// The second consumer instance given in the constructor.
             second;
+
+    private:
+        CompoundPlan::Cache plan_;
 };
 
 } }
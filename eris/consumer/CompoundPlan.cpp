@@ -0,0 +1,227 @@
+#include <eris/consumer/CompoundPlan.hpp>
+#include <eris/consumer/Compound.hpp>
+#include <stdexcept>
+
+using namespace Eigen;
+
+namespace eris { namespace consumer {
+
+CompoundPlan::CompoundPlan(const Consumer &root) {
+    std::unordered_map<const Consumer*, size_t> seen;
+    compile(&root, seen);
+}
+
+size_t CompoundPlan::compile(const Consumer *c, std::unordered_map<const Consumer*, size_t> &seen) {
+    auto found = seen.find(c);
+    if (found != seen.end()) return found->second;
+
+    node n{Op::leaf, Kind::none, c, nullptr, 0, 0, nullptr, nullptr, {}, {}};
+    if (dynamic_cast<const CompoundSum::Differentiable*>(c)) {
+        n.op = Op::sum; n.kind = Kind::sum_d;
+    }
+    else if (dynamic_cast<const CompoundSum*>(c)) {
+        n.op = Op::sum; n.kind = Kind::sum;
+    }
+    else if (dynamic_cast<const CompoundProduct::Differentiable*>(c)) {
+        n.op = Op::product; n.kind = Kind::product_d;
+    }
+    else if (dynamic_cast<const CompoundProduct*>(c)) {
+        n.op = Op::product; n.kind = Kind::product;
+    }
+
+    if (n.op == Op::leaf) {
+        n.differentiable = dynamic_cast<const Consumer::Differentiable*>(c);
+        if (not n.differentiable) differentiable_ = false;
+        leaves_++;
+    }
+    else {
+        auto kids = children(n);
+        if (not kids.first or not kids.second)
+            throw std::invalid_argument("CompoundPlan: compound consumer has a null component consumer");
+        n.first = kids.first.get();
+        n.second = kids.second.get();
+        n.first_ref = kids.first;
+        n.second_ref = kids.second;
+        n.a = compile(n.first, seen);
+        n.b = compile(n.second, seen);
+    }
+
+    nodes_.push_back(n);
+    return seen[c] = nodes_.size() - 1;
+}
+
+std::pair<std::shared_ptr<const Consumer>, std::shared_ptr<const Consumer>> CompoundPlan::children(const node &n) {
+    switch (n.kind) {
+        case Kind::sum: {
+            auto c = static_cast<const CompoundSum*>(n.consumer);
+            return {c->first, c->second};
+        }
+        case Kind::sum_d: {
+            auto c = static_cast<const CompoundSum::Differentiable*>(n.consumer);
+            return {c->first, c->second};
+        }
+        case Kind::product: {
+            auto c = static_cast<const CompoundProduct*>(n.consumer);
+            return {c->first, c->second};
+        }
+        case Kind::product_d: {
+            auto c = static_cast<const CompoundProduct::Differentiable*>(n.consumer);
+            return {c->first, c->second};
+        }
+        case Kind::none:
+            break;
+    }
+    return {};
+}
+
+// Returns true if `p` is the pointer that `ref` and `raw` were taken from.  Comparing ownership as
+// well as the address means a consumer allocated where a destroyed one used to be doesn't match.
+template <typename T>
+static bool same(const std::shared_ptr<T> &p, const Consumer *raw, const std::weak_ptr<const Consumer> &ref) {
+    return p.get() == raw and not p.owner_before(ref) and not ref.owner_before(p);
+}
+
+bool CompoundPlan::unchanged(const node &n) {
+    auto same_children = [&n](const auto *c) {
+        return same(c->first, n.first, n.first_ref) and same(c->second, n.second, n.second_ref);
+    };
+    switch (n.kind) {
+        case Kind::sum:
+            return same_children(static_cast<const CompoundSum*>(n.consumer));
+        case Kind::sum_d:
+            return same_children(static_cast<const CompoundSum::Differentiable*>(n.consumer));
+        case Kind::product:
+            return same_children(static_cast<const CompoundProduct*>(n.consumer));
+        case Kind::product_d:
+            return same_children(static_cast<const CompoundProduct::Differentiable*>(n.consumer));
+        case Kind::none:
+            break;
+    }
+    return true;
+}
+
+bool CompoundPlan::valid() const {
+    // Nodes are stored children-first, so walk them from the root down: a node is only looked at
+    // once every node referring to it has been found unchanged (and so is still keeping it alive).
+    // Walking the other way could look inside a subtree that was destroyed when it was replaced.
+    for (auto n = nodes_.rbegin(); n != nodes_.rend(); ++n) {
+        if (n->op != Op::leaf and not unchanged(*n))
+            return false;
+    }
+    return true;
+}
+
+double CompoundPlan::utility(const BundleNegative &b) const {
+    std::vector<double> u(nodes_.size());
+    for (size_t i = 0; i < nodes_.size(); i++) {
+        auto &n = nodes_[i];
+        switch (n.op) {
+            case Op::leaf:
+                u[i] = n.consumer->utility(b);
+                break;
+            case Op::sum:
+                u[i] = u[n.a] + u[n.b];
+                break;
+            case Op::product:
+                // As in CompoundProduct::utility, a zero first utility gives zero regardless of
+                // the second (which could be infinite).
+                u[i] = u[n.a] == 0 ? 0.0 : u[n.a] * u[n.b];
+                break;
+        }
+    }
+    return u.back();
+}
+
+// Returns s*m, except that elements of m that are exactly zero stay zero even if s is infinite.
+static MatrixXd scaled(const MatrixXd &m, double s) {
+    return (m.array() == 0).select(0.0, s * m.array());
+}
+
+void CompoundPlan::requireDifferentiable() const {
+    if (not differentiable_)
+        throw std::logic_error("CompoundPlan: cannot differentiate a compound consumer with non-differentiable components");
+}
+
+void CompoundPlan::propagate(const std::vector<id_t> &g, const BundleNegative &b, bool hessian,
+        VectorXd &grad, MatrixXd &hess) const {
+    requireDifferentiable();
+
+    const size_t count = nodes_.size();
+    std::vector<double> u(count);
+    std::vector<VectorXd> gr(count);
+    std::vector<MatrixXd> h(hessian ? count : 0);
+
+    for (size_t i = 0; i < count; i++) {
+        auto &n = nodes_[i];
+        switch (n.op) {
+            case Op::leaf:
+                u[i] = n.differentiable->utility(b);
+                gr[i] = n.differentiable->gradientVector(g, b);
+                if (hessian) h[i] = n.differentiable->hessianMatrix(g, b);
+                break;
+            case Op::sum:
+                u[i] = u[n.a] + u[n.b];
+                gr[i] = gr[n.a] + gr[n.b];
+                if (hessian) h[i] = h[n.a] + h[n.b];
+                break;
+            case Op::product:
+                // Product rule: (ab)' = a'b + ab', (ab)'' = a''b + ab'' + a'b'^T + b'a'^T.  As in
+                // utility() (and CompoundProduct), a zero factor makes its term zero even if the
+                // other factor isn't finite.
+                u[i] = u[n.a] == 0 ? 0.0 : u[n.a] * u[n.b];
+                gr[i] = scaled(gr[n.a], u[n.b]) + scaled(gr[n.b], u[n.a]);
+                if (hessian) {
+                    MatrixXd cross(g.size(), g.size());
+                    for (size_t k = 0; k < g.size(); k++) cross.col(k) = scaled(gr[n.a], gr[n.b][k]);
+                    h[i] = scaled(h[n.a], u[n.b]) + scaled(h[n.b], u[n.a]);
+                    h[i] += cross + cross.transpose();
+                }
+                break;
+        }
+    }
+
+    grad = std::move(gr.back());
+    if (hessian) hess = std::move(h.back());
+}
+
+double CompoundPlan::d(const BundleNegative &b, MemberID g) const {
+    VectorXd grad; MatrixXd hess;
+    propagate({g}, b, false, grad, hess);
+    return grad[0];
+}
+
+double CompoundPlan::d2(const BundleNegative &b, MemberID g1, MemberID g2) const {
+    VectorXd grad; MatrixXd hess;
+    if (g1 == g2) {
+        propagate({g1}, b, true, grad, hess);
+        return hess(0, 0);
+    }
+    propagate({g1, g2}, b, true, grad, hess);
+    return hess(0, 1);
+}
+
+VectorXd CompoundPlan::gradientVector(const std::vector<id_t> &g, const BundleNegative &b) const {
+    VectorXd grad; MatrixXd hess;
+    propagate(g, b, false, grad, hess);
+    return grad;
+}
+
+MatrixXd CompoundPlan::hessianMatrix(const std::vector<id_t> &g, const BundleNegative &b) const {
+    VectorXd grad; MatrixXd hess;
+    propagate(g, b, true, grad, hess);
+    return hess;
+}
+
+std::shared_ptr<const CompoundPlan> CompoundPlan::Cache::get(const Consumer &root) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (not plan_ or not plan_->valid())
+        plan_ = std::make_shared<const CompoundPlan>(root);
+    return plan_;
+}
+
+void CompoundPlan::Cache::reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    plan_.reset();
+}
+
+} }
@@ -0,0 +1,146 @@
+#pragma once
+#include <eris/Consumer.hpp>
+#include <Eigen/Core>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace eris { namespace consumer {
+
+/** A compiled, flattened form of a tree of CompoundSum and CompoundProduct consumers (and their
+ * Differentiable variants).  The tree is flattened into a list of nodes in evaluation order
+ * (children before parents), with each distinct consumer object appearing only once: a consumer
+ * (or compound subtree) shared by several parts of the tree is therefore evaluated only once per
+ * call.
+ *
+ * utility() evaluates every leaf's utility once, then combines them without any further virtual
+ * calls.  The derivative methods propagate values, gradients and (when needed) Hessians through
+ * the nodes in a single pass, using the leaves' gradientVector() and hessianMatrix() methods, so
+ * that, unlike the recursive CompoundProduct::Differentiable::d2(), no subtree is evaluated more
+ * than once.
+ *
+ * The compound consumer classes build and cache a plan for themselves automatically; there is
+ * normally no need to use this class directly.  A plan records the structure of the tree it was
+ * compiled from; valid() checks whether that structure has since been changed (by assigning to
+ * the `first` or `second` member of any compound consumer in the tree), in which case the plan
+ * must be recompiled.
+ */
+class CompoundPlan final {
+    public:
+        /** Compiles the tree rooted at the given consumer.  Any consumer in the tree that is not a
+         * compound consumer is treated as a leaf.
+         */
+        explicit CompoundPlan(const Consumer &root);
+
+        /** Returns true if the structure of the compound consumer tree is unchanged since the plan
+         * was compiled.
+         */
+        bool valid() const;
+
+        /// Returns the utility of the compiled tree at the given bundle.
+        double utility(const BundleNegative &b) const;
+
+        /** Returns the derivative of the compiled tree with respect to good `g` at the given
+         * bundle.
+         *
+         * \throws std::logic_error if the tree contains a leaf that is not a
+         * Consumer::Differentiable
+         */
+        double d(const BundleNegative &b, MemberID g) const;
+
+        /** Returns the second derivative of the compiled tree with respect to goods `g1` and `g2`
+         * at the given bundle.
+         *
+         * \throws std::logic_error if the tree contains a leaf that is not a
+         * Consumer::Differentiable
+         */
+        double d2(const BundleNegative &b, MemberID g1, MemberID g2) const;
+
+        /** Returns the gradient of the compiled tree with respect to the given goods.
+         *
+         * \throws std::logic_error if the tree contains a leaf that is not a
+         * Consumer::Differentiable
+         */
+        Eigen::VectorXd gradientVector(const std::vector<id_t> &g, const BundleNegative &b) const;
+
+        /** Returns the Hessian of the compiled tree with respect to the given goods.
+         *
+         * \throws std::logic_error if the tree contains a leaf that is not a
+         * Consumer::Differentiable
+         */
+        Eigen::MatrixXd hessianMatrix(const std::vector<id_t> &g, const BundleNegative &b) const;
+
+        /// The number of distinct nodes (leaves plus sums and products) in the compiled tree.
+        size_t size() const { return nodes_.size(); }
+
+        /// The number of distinct leaf consumers in the compiled tree.
+        size_t leaves() const { return leaves_; }
+
+        /** Holds a lazily-compiled plan for a compound consumer.  get() compiles the plan the
+         * first time it is called, and recompiles it whenever the cached plan is no longer valid.
+         * Copying a Cache gives an empty cache.
+         */
+        class Cache final {
+            public:
+                /// Creates an empty cache.
+                Cache() = default;
+                /// Copying gives an empty cache, since the copy belongs to a different consumer.
+                Cache(const Cache&) {}
+                /// Assignment empties the cache.
+                Cache& operator=(const Cache&) { reset(); return *this; }
+                /** Returns the (possibly just compiled) plan for the given root consumer, which
+                 * must always be the consumer that owns this cache.
+                 */
+                std::shared_ptr<const CompoundPlan> get(const Consumer &root) const;
+                /// Discards any cached plan.
+                void reset();
+            private:
+                mutable std::mutex mutex_;
+                mutable std::shared_ptr<const CompoundPlan> plan_;
+        };
+
+    private:
+        enum class Op { leaf, sum, product };
+        // The type of compound consumer a sum or product node was compiled from, used to check
+        // that its children haven't changed.
+        enum class Kind { none, sum, sum_d, product, product_d };
+
+        struct node {
+            Op op;
+            Kind kind;
+            // The consumer this node was compiled from
+            const Consumer *consumer;
+            // For leaves: the consumer as a Differentiable, or nullptr if it isn't one
+            const Consumer::Differentiable *differentiable;
+            // For sums and products: the indices of the child nodes, and the child consumers.  The
+            // weak references let valid() tell a replaced child apart from a new consumer that
+            // happens to have been allocated at the same address.
+            size_t a, b;
+            const Consumer *first, *second;
+            std::weak_ptr<const Consumer> first_ref, second_ref;
+        };
+
+        std::vector<node> nodes_;
+        size_t leaves_ = 0;
+        bool differentiable_ = true;
+
+        // Recursively adds the subtree rooted at c (if not already added), returning its index.
+        size_t compile(const Consumer *c, std::unordered_map<const Consumer*, size_t> &seen);
+
+        // Returns the current children of the given compound node's consumer.
+        static std::pair<std::shared_ptr<const Consumer>, std::shared_ptr<const Consumer>> children(const node &n);
+
+        // Returns true if the children of the given compound node's consumer are still the ones it
+        // was compiled with.
+        static bool unchanged(const node &n);
+
+        void requireDifferentiable() const;
+
+        // Propagates values, gradients, and (if `hessian` is true) Hessians w.r.t. `g` through
+        // the nodes, returning the root's gradient and Hessian.
+        void propagate(const std::vector<id_t> &g, const BundleNegative &b, bool hessian,
+                Eigen::VectorXd &grad, Eigen::MatrixXd &hess) const;
+};
+
+} }
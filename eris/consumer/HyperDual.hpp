@@ -0,0 +1,125 @@
+#pragma once
+#include <cmath>
+
+namespace eris { namespace consumer {
+
+/** Hyper-dual number for exact forward-mode first and second derivatives.  A hyper-dual number has
+ * the form \f$ a + b\epsilon_1 + c\epsilon_2 + d\epsilon_1\epsilon_2 \f$, where \f$\epsilon_1^2 =
+ * \epsilon_2^2 = 0\f$ but \f$\epsilon_1\epsilon_2 \neq 0\f$.  Evaluating a function \f$f\f$ at
+ * \f$ x + \epsilon_1 e_i + \epsilon_2 e_j \f$ gives \f$ f(x) + \epsilon_1 \partial_i f(x) +
+ * \epsilon_2 \partial_j f(x) + \epsilon_1\epsilon_2 \partial_i\partial_j f(x) \f$, without any of
+ * the truncation or cancellation error of finite differencing.
+ *
+ * Arithmetic operators and the common mathematical functions (exp, log, pow, sqrt, etc.) are
+ * provided; as with std::complex, unqualified calls (e.g. `pow(x, 0.5)` after a `using
+ * std::pow;`) will find the right version for both doubles and hyper-dual numbers.  Comparison
+ * operators compare only the real parts, so that code that branches on values (e.g. min or max)
+ * differentiates the branch taken.
+ *
+ * \sa AutoDiff
+ */
+class HyperDual final {
+    public:
+        /// The real part
+        double value = 0;
+        /// The \f$\epsilon_1\f$ part, i.e. the first derivative with respect to the first variable
+        double e1 = 0;
+        /// The \f$\epsilon_2\f$ part, i.e. the first derivative with respect to the second variable
+        double e2 = 0;
+        /// The \f$\epsilon_1\epsilon_2\f$ part, i.e. the cross derivative
+        double e12 = 0;
+
+        /// Default constructor: zero.
+        HyperDual() = default;
+        /// Implicit conversion from a constant.
+        HyperDual(double value) : value(value) {}
+        /// Constructs a hyper-dual number from its four components.
+        HyperDual(double value, double e1, double e2, double e12) : value(value), e1(e1), e2(e2), e12(e12) {}
+
+        /** Applies a function to this number, given the function's value and its first and second
+         * derivatives at the real part.  This is all that is needed to extend any (twice
+         * differentiable) scalar function to hyper-dual numbers.
+         */
+        HyperDual apply(double f, double fprime, double fprime2) const {
+            return {f, fprime * e1, fprime * e2, fprime * e12 + fprime2 * e1 * e2};
+        }
+
+        /// Unary minus
+        HyperDual operator-() const { return {-value, -e1, -e2, -e12}; }
+        /// Unary plus
+        HyperDual operator+() const { return *this; }
+
+        /// Addition
+        HyperDual& operator+=(const HyperDual &b) { value += b.value; e1 += b.e1; e2 += b.e2; e12 += b.e12; return *this; }
+        /// Subtraction
+        HyperDual& operator-=(const HyperDual &b) { value -= b.value; e1 -= b.e1; e2 -= b.e2; e12 -= b.e12; return *this; }
+        /// Multiplication
+        HyperDual& operator*=(const HyperDual &b) {
+            e12 = value * b.e12 + e1 * b.e2 + e2 * b.e1 + e12 * b.value;
+            e1 = value * b.e1 + e1 * b.value;
+            e2 = value * b.e2 + e2 * b.value;
+            value *= b.value;
+            return *this;
+        }
+        /// Division
+        HyperDual& operator/=(const HyperDual &b) {
+            double inv = 1 / b.value;
+            return *this *= b.apply(inv, -inv*inv, 2*inv*inv*inv);
+        }
+};
+
+/// Addition
+inline HyperDual operator+(HyperDual a, const HyperDual &b) { return a += b; }
+/// Subtraction
+inline HyperDual operator-(HyperDual a, const HyperDual &b) { return a -= b; }
+/// Multiplication
+inline HyperDual operator*(HyperDual a, const HyperDual &b) { return a *= b; }
+/// Division
+inline HyperDual operator/(HyperDual a, const HyperDual &b) { return a /= b; }
+
+/// Compares real parts
+inline bool operator<(const HyperDual &a, const HyperDual &b) { return a.value < b.value; }
+/// Compares real parts
+inline bool operator>(const HyperDual &a, const HyperDual &b) { return a.value > b.value; }
+/// Compares real parts
+inline bool operator<=(const HyperDual &a, const HyperDual &b) { return a.value <= b.value; }
+/// Compares real parts
+inline bool operator>=(const HyperDual &a, const HyperDual &b) { return a.value >= b.value; }
+/// Compares real parts
+inline bool operator==(const HyperDual &a, const HyperDual &b) { return a.value == b.value; }
+/// Compares real parts
+inline bool operator!=(const HyperDual &a, const HyperDual &b) { return a.value != b.value; }
+
+/// Exponential function
+inline HyperDual exp(const HyperDual &x) { double e = std::exp(x.value); return x.apply(e, e, e); }
+/// Natural logarithm
+inline HyperDual log(const HyperDual &x) { return x.apply(std::log(x.value), 1/x.value, -1/(x.value*x.value)); }
+/// Square root
+inline HyperDual sqrt(const HyperDual &x) {
+    double s = std::sqrt(x.value);
+    return x.apply(s, 0.5/s, -0.25/(s*x.value));
+}
+/// Raises a hyper-dual number to a constant power
+inline HyperDual pow(const HyperDual &x, double p) {
+    if (p == 0) return 1.0;
+    if (p == 1) return x;
+    if (p == 2) return x.apply(x.value * x.value, 2 * x.value, 2);
+    return x.apply(std::pow(x.value, p), p * std::pow(x.value, p - 1), p * (p - 1) * std::pow(x.value, p - 2));
+}
+/// Raises a constant to a hyper-dual power
+inline HyperDual pow(double b, const HyperDual &x) {
+    double bx = std::pow(b, x.value), lb = std::log(b);
+    return x.apply(bx, bx * lb, bx * lb * lb);
+}
+/// Raises a hyper-dual number to a hyper-dual power
+inline HyperDual pow(const HyperDual &x, const HyperDual &p) { return exp(p * log(x)); }
+/// Sine
+inline HyperDual sin(const HyperDual &x) { double s = std::sin(x.value); return x.apply(s, std::cos(x.value), -s); }
+/// Cosine
+inline HyperDual cos(const HyperDual &x) { double c = std::cos(x.value); return x.apply(c, -std::sin(x.value), -c); }
+/// Absolute value (not differentiable at 0, where the derivative of the positive branch is used)
+inline HyperDual abs(const HyperDual &x) { return x.value < 0 ? -x : x; }
+/// Absolute value (not differentiable at 0, where the derivative of the positive branch is used)
+inline HyperDual fabs(const HyperDual &x) { return abs(x); }
+
+} }
@@ -1,5 +1,6 @@
 #include <eris/consumer/Polynomial.hpp>
 #include <utility>
+#include <unordered_map>
 
 namespace eris { namespace consumer {
 
@@ -55,6 +56,29 @@ double Polynomial::utility(const BundleNegative &b) const {
     return u;
 }
 
+Eigen::VectorXd Polynomial::utilityBatch(const BundleNegative &base, const std::vector<id_t> &goods,
+        const Eigen::MatrixXd &deltas) const {
+    Eigen::MatrixXd X;
+    auto all = batchQuantities(base, goods, deltas, X);
+    std::unordered_map<id_t, size_t> row;
+    for (size_t i = 0; i < all.size(); i++) row.emplace(all[i], i);
+
+    Eigen::ArrayXd u = Eigen::ArrayXd::Constant(X.cols(), offset);
+    for (auto &c : coefficients) {
+        auto found = row.find(c.first);
+        // Goods that aren't in any candidate have quantity 0, and so don't contribute.
+        if (found == row.end() or c.second.empty()) continue;
+
+        Eigen::ArrayXd q = X.row(found->second).transpose().array();
+        Eigen::ArrayXd acc = Eigen::ArrayXd::Constant(q.size(), c.second.back());
+        for (size_t k = c.second.size() - 1; k > 0; k--)
+            acc = acc * q + c.second[k-1];
+        u += acc * q;
+    }
+
+    return u.matrix();
+}
+
 // Calculate the derivative for good g.  Since utility is separable, we only
 // need to use the coefficients for good g to get the value of the derivative
 double Polynomial::d(const BundleNegative &b, MemberID g) const {
@@ -110,4 +134,26 @@ Polynomial::hessian(const std::vector<id_t> &goods, const BundleNegative &b) con
     return H;
 }
 
+Eigen::VectorXd Polynomial::gradientVector(const std::vector<id_t> &goods, const BundleNegative &b) const {
+    Eigen::VectorXd grad(goods.size());
+    for (size_t i = 0; i < goods.size(); i++)
+        grad[i] = Polynomial::d(b, goods[i]);
+
+    return grad;
+}
+
+Eigen::MatrixXd Polynomial::hessianMatrix(const std::vector<id_t> &goods, const BundleNegative &b) const {
+    Eigen::MatrixXd H = Eigen::MatrixXd::Zero(goods.size(), goods.size());
+    for (size_t i = 0; i < goods.size(); i++) {
+        H(i, i) = Polynomial::d2(b, goods[i], goods[i]);
+        // A good could be listed more than once, in which case the duplicate entries are also
+        // second derivatives with respect to the same good.
+        for (size_t j = 0; j < i; j++) {
+            if (goods[i] == goods[j]) H(i, j) = H(j, i) = H(i, i);
+        }
+    }
+
+    return H;
+}
+
 } }
@@ -56,6 +56,12 @@ class Polynomial : public Consumer::Differentiable {
          */
         virtual double utility(const BundleNegative &b) const override;
 
+        /** Evaluates utility at a batch of candidate bundles.  Each good's polynomial is evaluated
+         * (using Horner's method) for all candidates at once.
+         */
+        virtual Eigen::VectorXd utilityBatch(const BundleNegative &base, const std::vector<id_t> &goods,
+                const Eigen::MatrixXd &deltas) const override;
+
         /** Returns the first derivative of utility with respect to good \f$g\f$, evaluated at
          * Bundle \f$b\f$.  Mathematically:
          * \f[
@@ -78,6 +84,14 @@ class Polynomial : public Consumer::Differentiable {
          */
         virtual std::map<id_t, std::map<id_t, double>>
             hessian(const std::vector<id_t> &g, const BundleNegative &b) const override;
+        /** Returns the gradient as a dense vector.  Since utility is additively separable, each
+         * element depends only on the quantity of and coefficients for its own good.
+         */
+        virtual Eigen::VectorXd gradientVector(const std::vector<id_t> &g, const BundleNegative &b) const override;
+        /** Returns the Hessian as a dense matrix.  Only the diagonal is calculated, since
+         * off-diagonal elements are always 0.
+         */
+        virtual Eigen::MatrixXd hessianMatrix(const std::vector<id_t> &g, const BundleNegative &b) const override;
 
     protected:
         /// The constant offset term in the consumer's utility.
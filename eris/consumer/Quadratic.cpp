@@ -1,6 +1,10 @@
 #include <eris/consumer/Quadratic.hpp>
+#include <Eigen/Cholesky>
+#include <cmath>
+#include <stdexcept>
 #include <utility>
 #include <unordered_map>
+#include <vector>
 
 namespace eris { namespace consumer {
 
@@ -48,6 +52,36 @@ double Quadratic::utility(const BundleNegative &b) const {
     return u;
 }
 
+Eigen::VectorXd Quadratic::utilityBatch(const BundleNegative &base, const std::vector<id_t> &goods,
+        const Eigen::MatrixXd &deltas) const {
+    Eigen::MatrixXd X;
+    auto all = batchQuantities(base, goods, deltas, X);
+    std::unordered_map<id_t, size_t> row;
+    for (size_t i = 0; i < all.size(); i++) row.emplace(all[i], i);
+
+    // Goods that don't appear in any candidate have 0 quantities, and so don't contribute.
+    Eigen::VectorXd a = Eigen::VectorXd::Zero(all.size());
+    for (auto &l : linear) {
+        auto found = row.find(l.first);
+        if (found != row.end()) a[found->second] = l.second;
+    }
+    Eigen::MatrixXd S = Eigen::MatrixXd::Zero(all.size(), all.size());
+    for (auto &r : quad) {
+        auto found1 = row.find(r.first);
+        if (found1 == row.end()) continue;
+        for (auto &c : r.second) {
+            auto found2 = row.find(c.first);
+            if (found2 == row.end()) continue;
+            if (found1->second == found2->second) S(found1->second, found1->second) = c.second;
+            else S(found1->second, found2->second) = S(found2->second, found1->second) = 0.5 * c.second;
+        }
+    }
+
+    Eigen::VectorXd u = (X.transpose() * a).array() + offset;
+    u.array() += (X.array() * (S * X).array()).colwise().sum().transpose();
+    return u;
+}
+
 double Quadratic::d(const BundleNegative &b, MemberID g) const {
     double up = linear.count(g) ? linear.at(g) : 0.0;
 
@@ -71,4 +105,130 @@ double Quadratic::d2(const BundleNegative&, MemberID g1, MemberID g2) const {
     return upp;
 }
 
+Eigen::VectorXd Quadratic::gradientVector(const std::vector<id_t> &goods, const BundleNegative &b) const {
+    std::unordered_map<id_t, std::vector<size_t>> index;
+    for (size_t i = 0; i < goods.size(); i++) index[goods[i]].push_back(i);
+
+    // Calculate the derivatives for each distinct good, then copy them into position
+    std::unordered_map<id_t, double> up;
+    for (auto &l : linear) {
+        if (index.count(l.first)) up[l.first] += l.second;
+    }
+
+    // Each c*g1*g2 term contributes c*g2 to the g1 derivative and c*g1 to the g2 derivative (which
+    // gives the required 2*c*g1 when g1 == g2).
+    for (auto &row : quad) {
+        bool want1 = index.count(row.first);
+        double q1 = b[row.first];
+        for (auto &c : row.second) {
+            if (want1) up[row.first] += c.second * b[c.first];
+            if (index.count(c.first)) up[c.first] += c.second * q1;
+        }
+    }
+
+    Eigen::VectorXd grad = Eigen::VectorXd::Zero(goods.size());
+    for (auto &u : up) {
+        for (auto i : index[u.first]) grad[i] = u.second;
+    }
+
+    return grad;
+}
+
+Eigen::MatrixXd Quadratic::hessianMatrix(const std::vector<id_t> &goods, const BundleNegative&) const {
+    std::unordered_map<id_t, std::vector<size_t>> index;
+    for (size_t i = 0; i < goods.size(); i++) index[goods[i]].push_back(i);
+
+    Eigen::MatrixXd hess = Eigen::MatrixXd::Zero(goods.size(), goods.size());
+    for (auto &row : quad) {
+        auto found1 = index.find(row.first);
+        if (found1 == index.end()) continue;
+        for (auto &c : row.second) {
+            auto found2 = index.find(c.first);
+            if (found2 == index.end()) continue;
+            double upp = row.first == c.first ? 2.0 * c.second : c.second;
+            for (auto i : found1->second) for (auto j : found2->second)
+                hess(i, j) = hess(j, i) = upp;
+        }
+    }
+
+    return hess;
+}
+
+bool Quadratic::demand(const BundleNegative &base, const std::vector<id_t> &goods,
+        const Eigen::VectorXd &prices, double income, Eigen::VectorXd &q) const {
+    const size_t n = goods.size();
+    if ((size_t) prices.size() != n)
+        throw std::invalid_argument("Quadratic::demand: prices must have one element per good");
+    if (n == 0 or not(income >= 0)) return false;
+
+    std::unordered_map<id_t, size_t> index;
+    for (size_t i = 0; i < n; i++) {
+        if (not index.emplace(goods[i], i).second or not(prices[i] > 0)) return false;
+    }
+
+    // Utility is exactly u(base) + g0'q + q'Hq/2
+    Eigen::VectorXd g0 = gradientVector(goods, base);
+    Eigen::MatrixXd H = hessianMatrix(goods, base);
+
+    std::vector<bool> bought(n, true);
+    for (size_t iter = 0; iter < 4*n + 4; iter++) {
+        std::vector<size_t> free;
+        for (size_t i = 0; i < n; i++) if (bought[i]) free.push_back(i);
+        if (free.empty()) return false;
+        const size_t m = free.size();
+
+        // Spend everything on the last free good, then move within the budget plane along the
+        // columns of Z (each of which trades one free good for the last one) to the optimum.
+        const size_t last = free.back();
+        Eigen::VectorXd qf = Eigen::VectorXd::Zero(m);
+        qf[m-1] = income / prices[last];
+        if (m > 1) {
+            Eigen::MatrixXd Z(m, m-1);
+            Z.topRows(m-1).setIdentity();
+            Eigen::VectorXd gf(m);
+            Eigen::MatrixXd Hf(m, m);
+            for (size_t j = 0; j < m; j++) {
+                if (j < m-1) Z(m-1, j) = -prices[free[j]] / prices[last];
+                gf[j] = g0[free[j]];
+                for (size_t k = 0; k < m; k++) Hf(j, k) = H(free[j], free[k]);
+            }
+            Eigen::LLT<Eigen::MatrixXd> llt(-Z.transpose() * Hf * Z);
+            if (llt.info() != Eigen::Success) return false;
+            qf += Z * llt.solve(Z.transpose() * (gf + Hf * qf));
+        }
+
+        q = Eigen::VectorXd::Zero(n);
+        for (size_t j = 0; j < m; j++) q[free[j]] = qf[j];
+
+        // Drop the most negative quantity, if any
+        size_t drop = n;
+        double most = 0;
+        for (auto i : free) {
+            if (q[i] < most) { most = q[i]; drop = i; }
+        }
+        if (drop < n) {
+            bought[drop] = false;
+            continue;
+        }
+
+        // Otherwise check that no dropped good has a higher marginal utility per dollar than the
+        // purchased goods; if one does, add back the one that is most underpurchased.
+        Eigen::VectorXd mu = g0 + H * q;
+        double mu_spent = 0, p_spent = 0;
+        for (auto i : free) { mu_spent += mu[i]; p_spent += prices[i]; }
+        const double lambda = mu_spent / p_spent;
+        size_t add = n;
+        double worst = 1e-10 * std::fabs(lambda);
+        for (size_t i = 0; i < n; i++) {
+            if (bought[i]) continue;
+            double excess = mu[i] / prices[i] - lambda;
+            if (excess > worst) { worst = excess; add = i; }
+        }
+        if (add == n) return true;
+        bought[add] = true;
+    }
+
+    return false;
+}
+
 } }
@@ -16,7 +16,7 @@ namespace eris { namespace consumer {
  *
  * \sa Polynomial, for additively separable, arbitrary order polynomials.
  */
-class Quadratic : public Consumer::Differentiable {
+class Quadratic : public Consumer::Differentiable, public virtual Consumer::AnalyticDemand {
     public:
         /// Initialize with no coefficients with an optional constant offset.
         Quadratic(double offset = 0.0);
@@ -53,11 +53,41 @@ class Quadratic : public Consumer::Differentiable {
 
         /// Evaluates the utility given the current coefficients at bundle \f$b\f$.
         double utility(const BundleNegative &b) const override;
+        /** Evaluates utility at a batch of candidate bundles as \f$c + a'X + \mathrm{diag}(X'SX)\f$
+         * over the matrix \f$X\f$ of candidate quantities, where \f$S\f$ is the symmetric matrix
+         * of quadratic coefficients.
+         */
+        Eigen::VectorXd utilityBatch(const BundleNegative &base, const std::vector<id_t> &goods,
+                const Eigen::MatrixXd &deltas) const override;
 
         /// Returns the first derivative w.r.t. good g, evaluated at bundle b.
         double d(const BundleNegative &b, MemberID g) const override;
         /// Returns the second derivative w.r.t. goods g1, g2, evaluated at bundle b.
         double d2(const BundleNegative &b, MemberID g1, MemberID g2) const override;
+        /** Returns the gradient as a dense vector.  This makes a single pass through the
+         * coefficients rather than calling d() for each good.
+         */
+        Eigen::VectorXd gradientVector(const std::vector<id_t> &g, const BundleNegative &b) const override;
+        /** Returns the Hessian as a dense matrix.  The Hessian doesn't depend on the bundle, so
+         * this is filled directly from the quadratic coefficients.
+         */
+        Eigen::MatrixXd hessianMatrix(const std::vector<id_t> &g, const BundleNegative &b) const override;
+        /** Calculates demand by solving the first-order (KKT) conditions directly: since utility
+         * is quadratic, the optimum on any set of purchased goods is the solution of a linear
+         * system.  Goods whose solution quantity is negative are dropped from the purchased set,
+         * and dropped goods whose marginal utility per dollar exceeds that of the purchased goods
+         * at the solution are added back, until neither happens.  Typically this takes only one
+         * or two linear solves.
+         *
+         * Returns false if utility is not strictly concave over the budget set of the goods being
+         * purchased (so that the first-order conditions don't identify a maximum), any price
+         * isn't positive, a good appears more than once in `goods`, or the purchased set doesn't
+         * settle within a few iterations.
+         *
+         * \throws std::invalid_argument if `prices` and `goods` have different sizes.
+         */
+        bool demand(const BundleNegative &base, const std::vector<id_t> &goods,
+                const Eigen::VectorXd &prices, double income, Eigen::VectorXd &q) const override;
     protected:
         /// The constant offset.  \sa coef()
         double offset = 0.0;
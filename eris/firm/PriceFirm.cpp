@@ -8,12 +8,14 @@ PriceFirm::PriceFirm(Bundle output, Bundle price, double capacity) :
 
 void PriceFirm::setPrice(Bundle price) noexcept {
     price_ = price;
+    supplyChanged();
 }
 const Bundle& PriceFirm::price() const noexcept {
     return price_;
 }
 void PriceFirm::setOutput(Bundle output) noexcept {
     output_ = output;
+    supplyChanged();
 }
 const Bundle& PriceFirm::output() const noexcept {
     return output_;
@@ -101,6 +103,7 @@ void PriceFirm::reduceExcessProduction() {
 
 void PriceFirm::interAdvance() {
     capacity_used_ = 0;
+    supplyChanged();
 }
 
 } }
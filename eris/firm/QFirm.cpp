@@ -35,6 +35,7 @@ const Bundle& QFirm::output() const noexcept {
 void QFirm::interAdvance() {
     // Clear everything except what is left by depreciation
     assets = depreciate();
+    supplyChanged();
 }
 
 void QFirm::intraInitialize() {
@@ -5,6 +5,7 @@
 #include <cmath>
 #include <map>
 #include <limits>
+#include <queue>
 #include <set>
 #include <unordered_map>
 #include <utility>
@@ -27,19 +28,34 @@ void IncrementalBuyer::permuteZeros(const bool &pz) noexcept {
     permute_zeros = pz;
 }
 
+void IncrementalBuyer::lazy(const bool &lz) noexcept {
+    lazy_ = lz;
+}
+
 /** \todo need to worry about locking the markets until we decide which one to buy from.
  */
 void IncrementalBuyer::intraOptimize() {
     round = 0;
-    while (oneRound()) {}
+    if (lazy_)
+        lazyOptimize();
+    else
+        while (oneRound()) {}
+}
+
+// Returns true if we can buy from the given market with (only) money
+static bool buys_with_money(const Market &market, const Bundle &money_unit, id_t money) {
+    // price_unit must be just money, and the market must not also produce money (which would be
+    // rather screwy).
+    return market.price_unit.covers(money_unit) and money_unit.covers(market.price_unit)
+        and not(market.output_unit[money] > 0);
 }
 
 void IncrementalBuyer::intraApply() {
-    for (auto &res : reservations)
-        res.buy();
+    Market::buyAll(reservations);
 }
 
 void IncrementalBuyer::intraReset() {
+    Market::releaseAll(reservations);
     reservations.clear();
 }
 
@@ -52,66 +68,97 @@ bool IncrementalBuyer::oneRound() {
     Bundle &a = consumer->assets;
 
     double cash = a[money];
-    if (cash <= 0) {
-        // All out of money
+    if (cash <= 0 or round > rounds) {
+        // All out of money (or out of rounds: the last round already tried to spend everything)
         return false;
     }
 
     // The amount of money to spend for this increment:
     const Bundle spending = (cash / (rounds-round+1)) * money_unit;
-    Bundle remaining = a - spending;
 
     // Stores the utility changes for each market
     std::map<id_t, double> delta_u;
 
-    double current_utility = consumer->utility(a);
+    // Utility is evaluated including the output of the purchases reserved in earlier rounds, which
+    // won't be in the consumer's assets until they are applied.
+    Bundle current = a;
+    for (auto &res : reservations) {
+        if (res.state() == ReservationState::pending)
+            current += res.quantity() * res.market->output_unit;
+    }
+    double current_utility = consumer->utility(current);
 
     // The base case: don't spend anything (0 is special for "don't spend")
     std::vector<id_t> best {0};
     double best_delta_u = 0;
 
-    // market->quantity() can be a relatively expensive operation, so cache its
-    // results.  This stores the market m quantity for price spending/n in
-    // q_cache[m][n]
-    std::unordered_map<id_t, std::unordered_map<int, Market::quantity_info>> q_cache;
-
-    for (auto market : sim->markets()) {
-
-        if (not(market->price_unit.covers(money_unit) and money_unit.covers(market->price_unit))) {
-            // price_unit is not (or not just) money; we can't handle that, so ignore this market
-            continue;
+    // The candidate purchases are collected as changes to the consumer's assets (one column per
+    // candidate, one row per good) so that the consumer can evaluate them all in a single
+    // utilityBatch() call.  Row 0 is the money good; the rest are the markets' output goods.
+    std::vector<id_t> goods {money};
+    std::unordered_map<id_t, size_t> good_row {{money, 0}};
+    std::vector<std::vector<std::pair<size_t, double>>> candidates;
+    auto add_candidate = [&](std::vector<std::pair<size_t, double>> &cand, const Bundle &b, double mult) {
+        for (auto &g : b) {
+            auto ins = good_row.emplace(g.first, goods.size());
+            if (ins.second) goods.push_back(g.first);
+            cand.emplace_back(ins.first->second, mult * g.second);
+        }
+    };
+    auto evaluate = [&]() -> Eigen::VectorXd {
+        Eigen::MatrixXd deltas = Eigen::MatrixXd::Zero(goods.size(), candidates.size());
+        for (size_t j = 0; j < candidates.size(); j++) {
+            deltas(0, j) = -spending[money];
+            for (auto &d : candidates[j]) deltas(d.first, j) += d.second;
         }
+        Eigen::VectorXd u = consumer->utilityBatch(current, goods, deltas);
+        candidates.clear();
+        return u.array() - current_utility;
+    };
+
+    // Nothing gets reserved until the end of the round, so each market's quantity for a given
+    // amount of spending (which only depends on the combination size) only needs to be queried
+    // once per round: remember them here.  (This uses the market's quote cache, if enabled, too).
+    std::map<std::pair<id_t, double>, Market::quantity_info> quotes;
+    auto quantity = [&](const SharedMember<Market> &market, double p) -> const Market::quantity_info& {
+        auto key = std::make_pair(market->id(), p);
+        auto found = quotes.find(key);
+        if (found == quotes.end()) found = quotes.emplace(key, market->cachedQuantity(p)).first;
+        return found->second;
+    };
+
+    std::vector<id_t> candidate_markets;
+    for (auto market : sim->markets()) {
 
-        if (market->output_unit[money] > 0) {
-            // Something screwy about this market: it costs money, but also produces money.  Ignore.
+        if (not buys_with_money(*market, money_unit, money)) {
+            // price_unit is not (or not just) money, or the market is screwy; ignore it
             continue;
         }
 
         // Figure out how much `spending' buys in this market:
-        double spend = market->price_unit.multiples(spending);
-        auto qinfo = market->quantity(spend);
+        auto &qinfo = quantity(market, spending.multiples(market->price_unit));
 
         if (qinfo.quantity == 0) {
             // Don't consider a market that doesn't give any output (e.g. an exhausted market).
             continue;
         }
 
-        auto mktid = market->id();
-
-        // Cache the value, as we may need it again and ->quantity can be expensive
-        q_cache[mktid].emplace(1, qinfo);
-
-        Bundle cons = remaining + qinfo.quantity * market->output_unit;
+        candidates.emplace_back();
+        add_candidate(candidates.back(), market->output_unit, qinfo.quantity);
         // If spending hit a constraint, we need to add the unused spending back in (as cash)
-        if (qinfo.constrained) {
-            cons += qinfo.unspent * market->price_unit;
-        }
+        if (qinfo.constrained)
+            add_candidate(candidates.back(), market->price_unit, qinfo.unspent);
+        candidate_markets.push_back(market->id());
+    }
 
-        double mkt_delta_u = consumer->utility(cons) - current_utility;
-        delta_u[mktid] = mkt_delta_u;
-        if (mkt_delta_u > best_delta_u) {
-            best[0] = mktid;
-            best_delta_u = mkt_delta_u;
+    if (not candidate_markets.empty()) {
+        Eigen::VectorXd mkt_delta_u = evaluate();
+        for (size_t i = 0; i < candidate_markets.size(); i++) {
+            delta_u[candidate_markets[i]] = mkt_delta_u[i];
+            if (mkt_delta_u[i] > best_delta_u) {
+                best[0] = candidate_markets[i];
+                best_delta_u = mkt_delta_u[i];
+            }
         }
     }
 
@@ -132,40 +179,43 @@ bool IncrementalBuyer::oneRound() {
     // From everything added into permute, above, we need to build all possible multi-element
     // combinations; e.g. if permute = {1,2,3} we have 4 possibilities: {1,2}, {1,3}, {2,3}, {1,2,3}
 
+    std::vector<std::vector<id_t>> combinations;
     eris::all_combinations(permute.cbegin(), permute.cend(),
             [&](const std::vector<id_t> &combination) -> void {
 
         int comb_size = combination.size();
 
-        const Bundle spend_each = spending / comb_size;
-
         // Ignore 0- or 1-element combinations (we already checked those above)
         if (comb_size < 2) return;
 
-        Bundle comb = remaining;
+        const Bundle spend_each = spending / comb_size;
+
+        candidates.emplace_back();
         for (auto mkt_id : combination) {
             auto market = sim->market(mkt_id);
 
-            // Get the market quantity we can afford (if we haven't already), spending an equal
-            // share of the spending chunk on each good in the combination
-            if (!q_cache[mkt_id].count(comb_size))
-                q_cache[mkt_id].emplace(comb_size, market->quantity(market->price_unit.multiples(spend_each)));
-
-            auto qinfo = q_cache[mkt_id][comb_size];
+            // Get the market quantity we can afford, spending an equal share of the spending
+            // chunk on each good in the combination
+            auto &qinfo = quantity(market, spend_each.multiples(market->price_unit));
 
-            comb += qinfo.quantity * market->output_unit;
+            add_candidate(candidates.back(), market->output_unit, qinfo.quantity);
 
             // Re-add any unspent income due to market constraints
             if (qinfo.constrained)
-                comb += qinfo.unspent * market->price_unit;
+                add_candidate(candidates.back(), market->price_unit, qinfo.unspent);
         }
+        combinations.push_back(combination);
+    });
 
-        double mkt_delta_u = consumer->utility(comb) - current_utility;
-        if (mkt_delta_u > best_delta_u) {
-            best = combination;
-            best_delta_u = mkt_delta_u;
+    if (not combinations.empty()) {
+        Eigen::VectorXd comb_delta_u = evaluate();
+        for (size_t i = 0; i < combinations.size(); i++) {
+            if (comb_delta_u[i] > best_delta_u) {
+                best = combinations[i];
+                best_delta_u = comb_delta_u[i];
+            }
         }
-    });
+    }
 
     // Finished: best contains the best set of market combinations, so reserve it and then we're done.
 
@@ -177,17 +227,30 @@ bool IncrementalBuyer::oneRound() {
         return false;
     }
 
+    // Look up all the quantities before reserving anything: each reservation changes the quotes.
+    const Bundle spend_each = spending / comb_size;
+    std::vector<std::pair<SharedMember<Market>, double>> buy;
+    for (auto mkt_id : best) {
+        auto market = sim->market(mkt_id);
+        buy.emplace_back(market, quantity(market, spend_each.multiples(market->price_unit)).quantity);
+    }
+    reserveQuantities(buy, spending);
+
+    return true;
+}
+
+void IncrementalBuyer::reserveQuantities(const std::vector<std::pair<SharedMember<Market>, double>> &buy, const Bundle &spending) {
+    SharedMember<Consumer> consumer = simulation()->agent(con_id);
+    Bundle &a = consumer->assets;
+
     // Add a tiny extra bit of cash just to make sure we don't hit a negativity constraint when
     // reserving the quantity.  We subtract it off again after reserving (and add again during
     // apply()).
     const Bundle tiny_extra = 1e-13 * spending;
     a += tiny_extra;
 
-    for (auto mkt_id : best) {
-        auto market = sim->market(mkt_id);
-        auto q = q_cache.at(mkt_id).at(comb_size);
-        reservations.push_front(market->reserve(consumer, q.quantity));
-    }
+    for (auto &b : buy)
+        reservations.push_back(b.first->reserve(consumer, b.second));
 
     if (a[money] < 2*tiny_extra[money])
         // If leftover money isn't at least "2 epsilons" above 0, assume it's a numerical error and
@@ -196,8 +259,129 @@ bool IncrementalBuyer::oneRound() {
     else
         // Otherwise subtract off the tiny amount we added, above.
         a -= tiny_extra;
+}
 
-    return true;
+void IncrementalBuyer::lazyOptimize() {
+    auto sim = simulation();
+    SharedMember<Consumer> consumer = sim->agent(con_id);
+    const Bundle &a = consumer->assets;
+
+    double cash = a[money];
+    if (cash <= 0) return;
+
+    // The usual per-round spending, which is also the smallest purchase we make
+    const double base = cash / rounds;
+    double step = lazy_max_multiple * base;
+
+    std::vector<SharedMember<Market>> markets;
+    for (auto market : sim->markets()) {
+        if (buys_with_money(*market, money_unit, money))
+            markets.push_back(market);
+    }
+
+    // The bundle we are evaluating utility at: the consumer's assets plus the output of anything
+    // already reserved.
+    Bundle current;
+    auto recalculate = [&]() {
+        current = a;
+        for (auto &res : reservations) {
+            if (res.state() == ReservationState::pending)
+                current += res.quantity() * res.market->output_unit;
+        }
+    };
+    recalculate();
+    double current_utility = consumer->utility(current);
+
+    // Queue entries are the utility gain per unit of money from spending `step` in a market,
+    // calculated when `state` had the value in `.state`: entries from an earlier state are stale.
+    struct entry {
+        double gain;
+        size_t market;
+        unsigned long state;
+        double quantity;
+        bool operator<(const entry &other) const { return gain < other.gain; }
+    };
+    std::priority_queue<entry> queue;
+    unsigned long state = 1;
+    // Everything starts out stale, with an infinite gain, so that it gets evaluated
+    for (size_t i = 0; i < markets.size(); i++)
+        queue.push({std::numeric_limits<double>::infinity(), i, 0, 0});
+
+    // Stale gains are only upper bounds on the current gains when goods aren't complements: when
+    // they are (e.g. Cobb-Douglas utility), buying one good *raises* the gain from buying the
+    // others.  We thus force every market to be re-evaluated after every `markets.size()`
+    // purchases (and after falling back to a regular round) so that such markets can't be starved.
+    auto refresh = [&]() {
+        std::priority_queue<entry> refreshed;
+        for (; not queue.empty(); queue.pop())
+            refreshed.push({std::numeric_limits<double>::infinity(), queue.top().market, 0, 0});
+        queue.swap(refreshed);
+    };
+    size_t purchases = 0;
+
+    size_t last = markets.size();
+    int repeats = 0;
+    while (cash > 0 and not queue.empty()) {
+        // Spend everything left if it's not much more than a single step
+        if (cash - step < 0.5 * base) step = cash;
+        const Bundle spending = step * money_unit;
+
+        // Pop stale entries, updating them and putting them back, until the top entry is fresh
+        entry top = queue.top();
+        queue.pop();
+        while (top.state != state) {
+            auto &market = markets[top.market];
+            auto qinfo = market->cachedQuantity(spending.multiples(market->price_unit));
+            // Drop any market that no longer gives any output (e.g. an exhausted market)
+            if (qinfo.quantity > 0) {
+                Bundle after = current + market->output_unit * qinfo.quantity - spending;
+                if (qinfo.constrained) after += market->price_unit * qinfo.unspent;
+                queue.push({(consumer->utility(after) - current_utility) / step, top.market, state, qinfo.quantity});
+            }
+            if (queue.empty()) break;
+            top = queue.top();
+            queue.pop();
+        }
+        if (top.state != state) break; // Everything was dropped
+
+        if (not(top.gain > 0)) {
+            // No single market gives a utility gain.  Spending across a combination of markets
+            // might (e.g. for \f$u = xy\f$), so fall back to a regular round spending
+            // (approximately) `step`.
+            int remaining = std::max<int>(1, std::lround(cash / step));
+            round = std::max(0, rounds - remaining);
+            if (not oneRound()) break;
+            recalculate();
+            last = markets.size();
+            repeats = 0;
+            queue.push(top);
+            refresh();
+        }
+        else {
+            auto &market = markets[top.market];
+            reserveQuantities({{market, top.quantity}}, spending);
+            current += market->output_unit * top.quantity;
+            current.set(money, a[money]);
+
+            // Adapt the step size: make smaller purchases when the best market changes (since
+            // we're balancing spending across markets), and larger ones when it doesn't.
+            if (top.market == last) {
+                if (++repeats >= 2) step = std::min(2 * step, lazy_max_multiple * base);
+            }
+            else {
+                if (last < markets.size()) step = std::max(base, step / 2);
+                last = top.market;
+                repeats = 0;
+            }
+            queue.push(top);
+            if (++purchases % markets.size() == 0) refresh();
+        }
+
+        // Everything is now stale
+        ++state;
+        current_utility = consumer->utility(current);
+        cash = a[money];
+    }
 }
 
 void IncrementalBuyer::added() {
@@ -2,7 +2,7 @@
 #include <eris/Member.hpp>
 #include <eris/Market.hpp>
 #include <eris/Optimize.hpp>
-#include <forward_list>
+#include <vector>
 
 namespace eris { class Consumer; }
 
@@ -100,6 +100,32 @@ class IncrementalBuyer : public Member, public virtual OptApplyReset {
          */
         void permuteZeros(const bool &pz) noexcept;
 
+        /** Enables or disables lazy mode (disabled by default).  In lazy mode, rather than
+         * rescanning every market in every round, the optimizer keeps each market's last
+         * calculated utility gain per unit of money in a priority queue.  After each purchase the
+         * queued gains are marked stale; only the market at the top of the queue is re-evaluated,
+         * and it is bought from if its updated gain still beats every other market's (stale) gain.
+         * Since marginal gains only fall as more is bought when utility is concave and supply
+         * curves are increasing, this usually requires re-evaluating only one or two markets per
+         * purchase.  (Because that doesn't hold for complementary goods, every market is also
+         * re-evaluated periodically.)
+         *
+         * Lazy mode also adapts the size of each purchase: purchases start out at
+         * `lazy_max_multiple` times the usual `1/rounds` share of income, are halved (down to the
+         * usual share) whenever the best market changes from one purchase to the next, and doubled
+         * again when the same market is chosen repeatedly.  Large purchases are thus made while a
+         * single market is clearly preferred, and small ones while the optimizer is balancing
+         * spending between markets.
+         *
+         * Combinations of markets (see permuteThreshold() and permuteZeros()) are only considered,
+         * by falling back to a regular round, when no single market yields a positive utility
+         * gain.
+         */
+        void lazy(const bool &lz) noexcept;
+
+        /// The largest purchase made in lazy mode, as a multiple of `1/rounds` of initial income.
+        static constexpr int lazy_max_multiple = 8;
+
         /** Performs optimization.  When this is called the consumer takes the number of steps
          * specified in the constructor, purchasing whichever goods yields the highest utility gain
          * at each step.
@@ -133,10 +159,12 @@ class IncrementalBuyer : public Member, public virtual OptApplyReset {
          * good permutations.  \sa permuteZeros()
          */
         bool permute_zeros = false;
+        /// Whether lazy mode is enabled.  \sa lazy()
+        bool lazy_ = false;
         /** Market reservations for the goods the agent has decided to buy.  These are established
          * during intraOptimize(), completed during intraApply(), and cancelled in intraReset().
          */
-        std::forward_list<Market::Reservation> reservations;
+        std::vector<Market::Reservation> reservations;
 
         /** Declares a dependency on the consumer and the money good when added to a simulation so
          * that removing either the consumer or the money good from the simulation will
@@ -148,6 +176,16 @@ class IncrementalBuyer : public Member, public virtual OptApplyReset {
          * time.  This is called repeatedly by optimize().
          */
         virtual bool oneRound();
+
+        /** Performs the optimization in lazy mode.  This is called by intraOptimize() instead of
+         * repeatedly calling oneRound() when lazy mode is enabled.  \sa lazy()
+         */
+        virtual void lazyOptimize();
+
+        /** Reserves the given quantities from the given markets, using up the money given in
+         * `spending`, and adds the reservations to `reservations`.
+         */
+        void reserveQuantities(const std::vector<std::pair<SharedMember<Market>, double>> &buy, const Bundle &spending);
 };
 
 }}
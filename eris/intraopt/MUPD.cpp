@@ -2,6 +2,7 @@
 #include <eris/Consumer.hpp>
 #include <eris/Market.hpp>
 #include <eris/Good.hpp>
+#include <cmath>
 #include <limits>
 #include <unordered_map>
 #include <utility>
@@ -16,13 +17,15 @@ MUPD::MUPD(SharedMember<Consumer::Differentiable> c, SharedMember<Good> m, doubl
 
 double MUPD::price_ratio(const SharedMember<Market> &m) const {
     auto mid = m->id();
-    if (!price_ratio_cache.count(mid))
-        price_ratio_cache[mid] = money_unit.coverage(m->price_unit);
+    std::lock_guard<std::mutex> lock(price_ratio_mutex_);
+    auto found = price_ratio_cache.find(mid);
+    if (found == price_ratio_cache.end())
+        found = price_ratio_cache.emplace(mid, money_unit.coverage(m->price_unit)).first;
 
-    return price_ratio_cache[mid];
+    return found->second;
 }
 
-MUPD::allocation MUPD::spending_allocation(const unordered_map<id_t, double> &spending) const {
+MUPD::allocation MUPD::spending_allocation(const unordered_map<id_t, double> &spending, const snapshot_map &snaps) const {
     allocation a = {};
 
     auto sim = simulation();
@@ -38,7 +41,7 @@ MUPD::allocation MUPD::spending_allocation(const unordered_map<id_t, double> &sp
                 // Otherwise query the market for the resulting quantity
                 auto mkt = sim->market(m.first);
 
-                auto q = mkt->quantity(m.second * price_ratio(mkt));
+                auto q = market_quantity(mkt, m.second * price_ratio(mkt), snaps);
 
                 a.quantity[m.first] = q.quantity;
                 a.bundle += mkt->output_unit * q.quantity;
@@ -62,14 +65,17 @@ double MUPD::calc_mu_per_d(
         Member::Lock &lock,
         id_t mkt_id,
         const allocation &alloc,
-        const Bundle &b) const {
+        const Bundle &b,
+        const snapshot_map &snaps) const {
 
     if (mkt_id == 0)
         return con->d(b, money);
 
     auto sim = simulation();
     auto mkt = sim->market(mkt_id);
-    lock.add(mkt);
+    // No need to lock the market if we're using a snapshot of it
+    bool live = not snaps.count(mkt_id);
+    if (live) lock.add(mkt);
 
     double mu = 0.0;
     // Add together all of the marginal utilities weighted by the output level, since the market may
@@ -78,9 +84,9 @@ double MUPD::calc_mu_per_d(
         mu += g.second * con->d(b, g.first);
 
     double q = alloc.quantity.count(mkt_id) ? alloc.quantity.at(mkt_id) : 0;
-    auto pricing = mkt->price(q);
+    auto pricing = market_price(mkt, q, snaps);
 
-    lock.remove(mkt);
+    if (live) lock.remove(mkt);
 
     if (!pricing.feasible) {
         throw market_exhausted_error(mkt_id);
@@ -89,23 +95,71 @@ double MUPD::calc_mu_per_d(
     return mu / pricing.marginal * price_ratio(mkt);
 }
 
-void MUPD::intraOptimize() {
+void MUPD::take_snapshots(const std::vector<id_t> &markets) {
+    snapshots_.clear();
+    if (not use_snapshots) return;
 
     auto sim = simulation();
+    for (auto &mkt_id : markets) {
+        auto snap = sim->market(mkt_id)->snapshot();
+        if (snap) snapshots_.emplace(mkt_id, std::move(snap));
+    }
+}
 
+unordered_map<id_t, double> MUPD::initial_spending(const std::vector<id_t> &markets, double cash) const {
+    unordered_map<id_t, double> spending;
+    spending[0] = 0.0;
+
+    if (warm_start and not warm_shares_.empty()) {
+        // Use the previous shares of the markets that are still eligible (and of cash), scaled up
+        // to account for any markets that have dropped out.
+        double total = 0;
+        auto share = [&](id_t id) {
+            auto found = warm_shares_.find(id);
+            double s = found == warm_shares_.end() ? 0.0 : found->second;
+            spending[id] = s;
+            total += s;
+        };
+        share(0);
+        for (auto &mkt_id : markets) share(mkt_id);
+
+        if (total > 0 and spending[0] < total) {
+            for (auto &m : spending) m.second *= cash / total;
+            return spending;
+        }
+        spending.clear();
+        spending[0] = 0.0;
+    }
 
-    // Before bothering with anything else, make sure the consumer actually has some money to spend
-    {
-        auto lock = con->readLock();
-        if (con->assets[money] <= 0)
-            return;
+    // Cold start: equal spending in every market, no spending in the 0 (don't spend) pseudo-market
+    for (auto &mkt_id : markets)
+        spending[mkt_id] = cash / markets.size();
+    return spending;
+}
+
+void MUPD::remember_spending(const unordered_map<id_t, double> &spending, double cash) {
+    warm_shares_.clear();
+    if (not warm_start or not(cash > 0)) return;
+    for (auto &m : spending) {
+        if (m.second > 0) warm_shares_[m.first] = m.second / cash;
     }
+}
 
-    unordered_map<id_t, double> spending;
+Market::quantity_info MUPD::market_quantity(const SharedMember<Market> &m, double p, const snapshot_map &snaps) const {
+    auto found = snaps.find(m->id());
+    if (found != snaps.end()) return found->second->quantity(p);
+    return m->cachedQuantity(p);
+}
 
-    spending[0] = 0.0; // 0 is the "don't spend"/"hold cash" option
+Market::price_info MUPD::market_price(const SharedMember<Market> &m, double q, const snapshot_map &snaps) const {
+    auto found = snaps.find(m->id());
+    if (found != snaps.end()) return found->second->price(q);
+    return m->cachedPrice(q);
+}
 
-    for (auto &market : sim->markets()) {
+std::vector<id_t> MUPD::eligible_markets() const {
+    std::vector<id_t> eligible;
+    for (auto &market : simulation()->markets()) {
         auto mlock = market->readLock();
 
         if (not(market->price_unit.covers(money_unit) and money_unit.covers(market->price_unit))) {
@@ -118,27 +172,37 @@ void MUPD::intraOptimize() {
             continue;
         }
 
-        if (not market->price(0).feasible) {
+        if (not market->cachedPrice(0).feasible) {
             // The market cannot produce any output (i.e. it is exhausted/constrained), so don't
             // consider it.
             continue;
         }
 
-        // We assign an exact value later, once we know how many eligible markets there are.
-        spending[market->id()] = 0.0;
+        eligible.push_back(market->id());
     }
 
-    unsigned int markets = spending.size()-1; // -1 to account for the cash non-market (id=0)
+    return eligible;
+}
+
+void MUPD::intraOptimize() {
+
+    // Before bothering with anything else, make sure the consumer actually has some money to spend
+    {
+        auto lock = con->readLock();
+        if (con->assets[money] <= 0)
+            return;
+    }
+
+    auto eligible = eligible_markets();
 
     // If there are no viable markets, there's nothing to do.
-    if (markets == 0) return;
+    if (eligible.empty()) return;
+
+    take_snapshots(eligible);
 
     // Now hold a write lock on this optimizer and the consumer.  We'll add and remove market locks to this as needed.
     auto big_lock = writeLock(con);
 
-    markets = spending.size()-1; // -1 for the id=0 cash pseudo-market
-    if (markets == 0) return;
-
     Bundle &a = con->assets;
     Bundle a_no_money = a;
     double cash = a_no_money.remove(money);
@@ -147,208 +211,361 @@ void MUPD::intraOptimize() {
         return;
     }
 
-    // Start out with equal spending in every market, no spending in the 0 (don't spend)
-    // pseudo-market
-    for (auto &m : spending) {
-        if (m.first != 0)
-            m.second = cash / markets;
-    }
+    // If the consumer has a closed-form demand function and is facing constant prices, there's no
+    // need to search.
+    if (analytic_demand and analytic_reserve(eligible, big_lock, cash, a_no_money))
+        return;
 
-    unordered_map <id_t, double> mu_per_d;
+    // Start out from the previous optimization's spending shares, if we have them, otherwise from
+    // equal spending in every market.  Market 0 is the "don't spend"/"hold cash" option.
+    unordered_map<id_t, double> spending = initial_spending(eligible, cash);
 
     allocation final_alloc = {};
 
     while (true) {
-        while (true) {
-            try {
-                allocation alloc = spending_allocation(spending);
-                Bundle tryout = a_no_money + alloc.bundle;
+        if (not solve(eligible, cash, a_no_money, big_lock, snapshots_, spending, final_alloc))
+            return;
 
-                for (auto m : spending) {
-                    mu_per_d[m.first] = calc_mu_per_d(con, big_lock, m.first, alloc, tryout);
-                }
+        // Safety check: make sure we're actually increasing utility; if not, don't do anything.
+        if (con->utility(a_no_money + final_alloc.bundle) <= con->currUtility()) {
+            return;
+        }
 
-                id_t highest = 0, lowest = 0;
-                double highest_u = mu_per_d[0], lowest_u = std::numeric_limits<double>::infinity();
-                for (auto m : mu_per_d) {
-                    // Consider all markets (even eligible ones that we aren't currently spending in) for
-                    // best return, but exclude markets that are constrained (since we can't spend any more
-                    // in them).
-                    // FIXME: do this last bit?
-                    if (m.second > highest_u) {
-                        highest = m.first;
-                        highest_u = m.second;
-                    }
-                    // Only count markets where we are actually spending positive amounts as "lowest", since
-                    // we can't transfer away from a market without any expenditure.
-                    if (spending[m.first] > 0 and m.second < lowest_u) {
-                        lowest = m.first;
-                        lowest_u = m.second;
-                    }
-                }
+        if (reserve_allocation(final_alloc, big_lock, cash, spending[0] <= 0)) {
+            remember_spending(spending, cash);
+            break;
+        }
+        // Else a reservation failed, so repeat the entire loop (with fresh snapshots, since the
+        // failure probably means a market has changed)
+        take_snapshots(eligible);
+    }
+}
+
+bool MUPD::solve(const std::vector<id_t>&, double, const Bundle &a_no_money, Member::Lock &lock,
+        const snapshot_map &snaps, unordered_map<id_t, double> &spending, allocation &result) const {
+    auto sim = simulation();
+    unordered_map <id_t, double> mu_per_d;
+
+    while (true) {
+        try {
+            allocation alloc = spending_allocation(spending, snaps);
+            Bundle tryout = a_no_money + alloc.bundle;
+
+            for (auto m : spending) {
+                mu_per_d[m.first] = calc_mu_per_d(con, lock, m.first, alloc, tryout, snaps);
+            }
 
-                if (highest_u <= lowest_u or (highest_u - lowest_u) / highest_u < tolerance) {
-                    final_alloc = alloc;
-                    break; // Nothing more to optimize
+            id_t highest = 0, lowest = 0;
+            double highest_u = mu_per_d[0], lowest_u = std::numeric_limits<double>::infinity();
+            for (auto m : mu_per_d) {
+                // Consider all markets (even eligible ones that we aren't currently spending in) for
+                // best return, but exclude markets that are constrained (since we can't spend any more
+                // in them).
+                // FIXME: do this last bit?
+                if (m.second > highest_u) {
+                    highest = m.first;
+                    highest_u = m.second;
                 }
+                // Only count markets where we are actually spending positive amounts as "lowest", since
+                // we can't transfer away from a market without any expenditure.
+                if (spending[m.first] > 0 and m.second < lowest_u) {
+                    lowest = m.first;
+                    lowest_u = m.second;
+                }
+            }
+
+            if (highest_u <= lowest_u or (highest_u - lowest_u) / highest_u < tolerance) {
+                result = alloc;
+                break; // Nothing more to optimize
+            }
 
-                double baseU = con->utility(tryout);
-                // Attempt to transfer all of the low utility spending to the high-utility market.  If MU/$
-                // are equal, we're done; if the lower utility is still lower, transfer 3/4, otherwise
-                // transfer 1/4.  Repeat.
+            double baseU = con->utility(tryout);
+            // Attempt to transfer all of the low utility spending to the high-utility market.  If MU/$
+            // are equal, we're done; if the lower utility is still lower, transfer 3/4, otherwise
+            // transfer 1/4.  Repeat.
+            //
+            // We do have to be careful, however: transferring everything might screw things up (e.g.
+            // consider u = xyz^2: setting z=0 will result in MU=0 for all three goods.  So we need to
+            // check not just the marginal utilities, but that this reallocation actually increases
+            // overall utility.
+            unordered_map<id_t, double> try_spending = spending;
+
+            try_spending[highest] = spending[highest] + spending[lowest];
+            try_spending[lowest] = 0;
+
+            alloc = spending_allocation(try_spending, snaps);
+            tryout = a_no_money + alloc.bundle;
+            if (con->utility(tryout) < baseU or
+                    calc_mu_per_d(con, lock, highest, alloc, tryout, snaps) < calc_mu_per_d(con, lock, lowest, alloc, tryout, snaps)) {
+                // Transferring *everything* from lowest to highest is too much (MU/$ for the highest
+                // good would end up lower than the lowest good, post-transfer, or else overall utility
+                // goes down entirely).
                 //
-                // We do have to be careful, however: transferring everything might screw things up (e.g.
-                // consider u = xyz^2: setting z=0 will result in MU=0 for all three goods.  So we need to
-                // check not just the marginal utilities, but that this reallocation actually increases
-                // overall utility.
-                unordered_map<id_t, double> try_spending = spending;
-
-                try_spending[highest] = spending[highest] + spending[lowest];
-                try_spending[lowest] = 0;
-
-                alloc = spending_allocation(try_spending);
-                tryout = a_no_money + alloc.bundle;
-                if (con->utility(tryout) < baseU or
-                        calc_mu_per_d(con, big_lock, highest, alloc, tryout) < calc_mu_per_d(con, big_lock, lowest, alloc, tryout)) {
-                    // Transferring *everything* from lowest to highest is too much (MU/$ for the highest
-                    // good would end up lower than the lowest good, post-transfer, or else overall utility
-                    // goes down entirely).
-                    //
-                    // We need to transfer less than everything, so use a binary search to figure out the
-                    // optimum transfer.
-                    //
-                    // Take 10 binary steps (which means we get granularity of 1/1024).  However, since
-                    // we'll probably come in here again (comparing this good to other goods) before
-                    // optimize() finishes, this gets amplified.
-                    //
-                    // FIXME: this is a very good target for optimization; typically this loop will run
-                    // around 53 times (which makes perfect sense, as that's about where step_size runs off
-                    // the end of the least precise double bit--sometimes a bit more, if the transfer ratio
-                    // is a very small number).
-                    double step_size = 0.25;
-                    double last_transfer = 1.0;
-                    double transfer = 0.5;
-
-                    for (int i = 0; transfer != last_transfer and i < 100; ++i) {
-                        last_transfer = transfer;
-
-                        double pre_try_h = try_spending[highest], pre_try_l = try_spending[lowest];
-
-                        try_spending[highest] = spending[highest] + transfer * spending[lowest];
-                        try_spending[lowest] = (1-transfer) * spending[lowest];
-
-                        if (try_spending[highest] == pre_try_h and try_spending[lowest] == pre_try_l) {
-                            // The transfer is too small to numerically affect things, so we're done.
-                            break;
-                        }
-
-                        alloc = spending_allocation(try_spending);
-                        tryout = a_no_money + alloc.bundle;
-                        double delta = calc_mu_per_d(con, big_lock, highest, alloc, tryout) - calc_mu_per_d(con, big_lock, lowest, alloc, tryout);
-                        if (delta == 0)
-                            // We equalized MU/$.  Done.
-                            break;
-                        else if (delta > 0)
-                            // MU/$ is still higher for `highest', so transfer more
-                            transfer += step_size;
-                        else
-                            // Otherwise transfer less
-                            transfer -= step_size;
-                        // Eventually this step_size will become too small to change transfer
-                        step_size /= 2;
-                    }
-                }
+                // We need to transfer less than everything, so use a binary search to figure out the
+                // optimum transfer.
+                //
+                // Take 10 binary steps (which means we get granularity of 1/1024).  However, since
+                // we'll probably come in here again (comparing this good to other goods) before
+                // optimize() finishes, this gets amplified.
+                //
+                // FIXME: this is a very good target for optimization; typically this loop will run
+                // around 53 times (which makes perfect sense, as that's about where step_size runs off
+                // the end of the least precise double bit--sometimes a bit more, if the transfer ratio
+                // is a very small number).
+                double step_size = 0.25;
+                double last_transfer = 1.0;
+                double transfer = 0.5;
+
+                for (int i = 0; transfer != last_transfer and i < 100; ++i) {
+                    last_transfer = transfer;
+
+                    double pre_try_h = try_spending[highest], pre_try_l = try_spending[lowest];
+
+                    try_spending[highest] = spending[highest] + transfer * spending[lowest];
+                    try_spending[lowest] = (1-transfer) * spending[lowest];
 
-                final_alloc = alloc;
+                    if (try_spending[highest] == pre_try_h and try_spending[lowest] == pre_try_l) {
+                        // The transfer is too small to numerically affect things, so we're done.
+                        break;
+                    }
 
-                if (spending[highest] == try_spending[highest] or spending[lowest] == try_spending[lowest]) {
-                    // What we just identified isn't actually a change, probably because we're hitting the
-                    // boundaries of storable double values, so end.
-                    break;
+                    alloc = spending_allocation(try_spending, snaps);
+                    tryout = a_no_money + alloc.bundle;
+                    double delta = calc_mu_per_d(con, lock, highest, alloc, tryout, snaps) - calc_mu_per_d(con, lock, lowest, alloc, tryout, snaps);
+                    if (delta == 0)
+                        // We equalized MU/$.  Done.
+                        break;
+                    else if (delta > 0)
+                        // MU/$ is still higher for `highest', so transfer more
+                        transfer += step_size;
+                    else
+                        // Otherwise transfer less
+                        transfer -= step_size;
+                    // Eventually this step_size will become too small to change transfer
+                    step_size /= 2;
                 }
+            }
 
-                spending[highest] = try_spending[highest];
-                spending[lowest] = try_spending[lowest];
+            result = alloc;
+
+            if (spending[highest] == try_spending[highest] or spending[lowest] == try_spending[lowest]) {
+                // What we just identified isn't actually a change, probably because we're hitting the
+                // boundaries of storable double values, so end.
+                break;
             }
-            catch (market_exhausted_error &e) {
-                // One of the markets has become exhausted.  If it's completely exhausted, take it out
-                // of the spending set; otherwise just restart the whole thing (the new limit will be
-                // taken care of in the initial spending_allocation() call).
-
-                if (not sim->market(e.market)->price(0).feasible) {
-                    // Completely exhausted market: transfer its spending to cash
-                    spending[0] += spending[e.market];
-                    spending.erase(e.market);
-                    markets = spending.size() - 1;
-                    if (markets == 0) return;
-                }
+
+            spending[highest] = try_spending[highest];
+            spending[lowest] = try_spending[lowest];
+        }
+        catch (market_exhausted_error &e) {
+            // One of the markets has become exhausted.  If it's completely exhausted, take it out
+            // of the spending set; otherwise just restart the whole thing (the new limit will be
+            // taken care of in the initial spending_allocation() call).
+
+            if (not market_price(sim->market(e.market), 0, snaps).feasible) {
+                // Completely exhausted market: transfer its spending to cash
+                spending[0] += spending[e.market];
+                spending.erase(e.market);
+                if (spending.size() <= 1) return false;
             }
         }
+    }
 
-        // Safety check: make sure we're actually increasing utility; if not, don't do anything.
-        if (con->utility(a_no_money + final_alloc.bundle) <= con->currUtility()) {
-            return;
-        }
+    return true;
+}
 
-        // If we haven't held back on any spending, add a tiny fraction of the amount of cash we are
-        // spending to assets (to prevent numerical errors causing insufficient assets exceptions), then
-        // subtract it off (if possible) after reserving.
-        double extra = 0;
-        if (spending[0] == 0.0) {
-            extra = cash * 1e-13;
-            a += extra * money_unit;
-        }
+bool MUPD::analytic_allocation(const std::vector<id_t> &markets, double cash, const Bundle &a_no_money,
+        const snapshot_map &snaps, allocation &alloc, unordered_map<id_t, double> &spending) const {
+    auto analytic = dynamic_cast<const Consumer::AnalyticDemand*>(con.get());
+    if (not analytic) return false;
 
-        bool restart = false; // Will become true if a reservation fails
+    auto sim = simulation();
 
-        for (auto &m : final_alloc.quantity) {
-            if (m.first != 0 and m.second > 0) {
-                auto market = sim->market(m.first);
-                big_lock.add(market);
-                try {
-                    reservations.push_front(market->reserve(con, m.second));
-                }
-                catch (Market::output_infeasible &e) {
-                    restart = true;
-                }
-                catch (Market::insufficient_assets &e) {
-                    restart = true;
-                }
-                big_lock.remove(market);
-                if (restart) break;
+    // Money is the first good; each market adds the one good that it sells.
+    std::vector<id_t> goods{money->id()};
+    std::vector<double> prices{1.0}, per_unit{1.0};
+    std::unordered_map<id_t, size_t> good_index{{money->id(), 0}};
+    for (auto &mkt_id : markets) {
+        auto mkt = sim->market(mkt_id);
+        if (mkt->output_unit.size() != 1) return false;
+        auto &out = *mkt->output_unit.begin();
+        if (not(out.second > 0) or not good_index.emplace(out.first, goods.size()).second) return false;
+
+        // The marginal price must be the same for the first unit and for the last unit that all
+        // of our cash could buy.
+        double ratio = price_ratio(mkt);
+        auto first = market_price(mkt, 0, snaps);
+        if (not first.feasible or not(first.marginalFirst > 0)) return false;
+        auto last = market_price(mkt, cash * ratio / first.marginalFirst, snaps);
+        if (not last.feasible or std::fabs(last.marginal - first.marginalFirst) > 1e-12 * first.marginalFirst)
+            return false;
+
+        goods.push_back(out.first);
+        per_unit.push_back(out.second);
+        prices.push_back(first.marginalFirst / ratio / out.second);
+    }
+
+    Eigen::VectorXd q;
+    if (not analytic->demand(a_no_money, goods, Eigen::Map<const Eigen::VectorXd>(prices.data(), prices.size()), cash, q))
+        return false;
+
+    alloc = {};
+    spending.clear();
+    spending[0] = 0.0;
+    if (q[0] > 0) {
+        alloc.quantity[0] = q[0];
+        alloc.bundle += money_unit * q[0];
+        spending[0] = q[0];
+    }
+    for (size_t i = 1; i < goods.size(); i++) {
+        auto mkt = sim->market(markets[i-1]);
+        spending[mkt->id()] = 0.0;
+        if (not(q[i] > 0)) continue;
+        alloc.quantity[mkt->id()] = q[i] / per_unit[i];
+        alloc.bundle += mkt->output_unit * (q[i] / per_unit[i]);
+        spending[mkt->id()] = q[i] * prices[i];
+    }
+
+    return true;
+}
+
+bool MUPD::analytic_reserve(const std::vector<id_t> &markets, Member::Lock &lock, double cash, const Bundle &a_no_money) {
+    allocation alloc;
+    unordered_map<id_t, double> spending;
+    if (not analytic_allocation(markets, cash, a_no_money, snapshots_, alloc, spending))
+        return false;
+
+    if (con->utility(a_no_money + alloc.bundle) <= con->currUtility())
+        return false;
+
+    if (not reserve_allocation(alloc, lock, cash, not(spending[0] > 0))) {
+        // A market has changed since we priced it, so the numerical optimization should start from
+        // fresh snapshots
+        take_snapshots(markets);
+        return false;
+    }
+
+    remember_spending(spending, cash);
+    return true;
+}
+
+Eigen::VectorXd MUPD::demand(const market::QMarket &market, const Eigen::VectorXd &prices) const {
+    Eigen::VectorXd q = Eigen::VectorXd::Zero(prices.size());
+
+    auto sim = simulation();
+    auto target = sim->market(market.id());
+    if (not(target->price_unit.covers(money_unit) and money_unit.covers(target->price_unit))
+            or target->output_unit[money] > 0)
+        return q;
+
+    // Every other eligible market is priced from a snapshot (where it supports one), so that each
+    // price is evaluated against the same supply; the target market goes last.
+    std::vector<id_t> markets;
+    snapshot_map snaps;
+    for (auto &mkt_id : eligible_markets()) {
+        if (mkt_id == target->id()) continue;
+        markets.push_back(mkt_id);
+        auto snap = sim->market(mkt_id)->snapshot();
+        if (snap) snaps.emplace(mkt_id, std::move(snap));
+    }
+    markets.push_back(target->id());
+
+    auto lock = con->readLock();
+
+    // Money in our pending reservations would be returned to the consumer if we reoptimized at a
+    // different price, so it's available to spend.
+    Bundle a_no_money = con->assets;
+    double cash = a_no_money.remove(money);
+    for (auto &r : reservations) {
+        if (r.state() == ReservationState::pending)
+            cash += r.price() / price_ratio(r.market);
+    }
+    if (not(cash > 0)) return q;
+
+    unordered_map<id_t, double> spending = initial_spending(markets, cash);
+    for (int i = 0; i < prices.size(); i++) {
+        // The target market supplies any quantity at the given price:
+        snaps[target->id()] = std::make_shared<const Market::Snapshot>(std::vector<std::pair<double, double>>{
+                {prices[i], std::numeric_limits<double>::infinity()}});
+
+        // Each search starts from the optimal spending at the previous price, which is usually close
+        allocation alloc;
+        if (not(analytic_demand and analytic_allocation(markets, cash, a_no_money, snaps, alloc, spending))
+                and not solve(markets, cash, a_no_money, lock, snaps, spending, alloc))
+            continue;
+
+        auto found = alloc.quantity.find(target->id());
+        if (found != alloc.quantity.end()) q[i] = found->second;
+    }
+
+    return q;
+}
+
+bool MUPD::reserve_allocation(const allocation &alloc, Member::Lock &lock, double cash, bool spend_all) {
+    auto sim = simulation();
+    Bundle &a = con->assets;
+    // If we haven't held back on any spending, add a tiny fraction of the amount of cash we are
+    // spending to assets (to prevent numerical errors causing insufficient assets exceptions), then
+    // subtract it off (if possible) after reserving.
+    double extra = 0;
+    if (spend_all) {
+        extra = cash * 1e-13;
+        a += extra * money_unit;
+    }
+
+    bool restart = false; // Will become true if a reservation fails
+
+    for (auto &m : alloc.quantity) {
+        if (m.first != 0 and m.second > 0) {
+            auto market = sim->market(m.first);
+            lock.add(market);
+            try {
+                reservations.push_back(market->reserve(con, m.second));
+            }
+            catch (Market::output_infeasible &e) {
+                restart = true;
             }
+            catch (Market::insufficient_assets &e) {
+                restart = true;
+            }
+            lock.remove(market);
+            if (restart) break;
         }
+    }
 
-        if (extra > 0) {
-            // Subtract up to 2 times the tiny extra amount.  Thus for [0,extra) we're handling
-            // numerical imprecision that resulted in the reservations taking slightly more than was
-            // available; for (extra,2*extra] we're correcting for reservations taking not quite
-            // enough.  In either case, extra is a very small number (1e-13 times the money we
-            // started with--i.e. 10 cents for a trillionaire); this is mainly just cleaning up to
-            // have nice 0 values in assets instead of stupidly small values.
-            if (2*extra >= a[money]) a.set(money, 0);
-            else a -= extra * money_unit;
-        }
+    if (extra > 0) {
+        // Subtract up to 2 times the tiny extra amount.  Thus for [0,extra) we're handling
+        // numerical imprecision that resulted in the reservations taking slightly more than was
+        // available; for (extra,2*extra] we're correcting for reservations taking not quite
+        // enough.  In either case, extra is a very small number (1e-13 times the money we
+        // started with--i.e. 10 cents for a trillionaire); this is mainly just cleaning up to
+        // have nice 0 values in assets instead of stupidly small values.
+        if (2*extra >= a[money]) a.set(money, 0);
+        else a -= extra * money_unit;
+    }
 
-        if (not restart) break;
-        // Else abort any established reservations and repeat the entire loop
+    if (restart) {
+        // Abort any established reservations
+        Market::releaseAll(reservations);
         reservations.clear();
     }
+
+    return not restart;
 }
 
 void MUPD::intraReset() {
     auto lock = writeLock(con);
+    snapshots_.clear();
 
+    Market::releaseAll(reservations);
     reservations.clear();
 }
 
 void MUPD::intraApply() {
     auto lock = writeLock(con);
+    snapshots_.clear();
 
-    for (auto &res: reservations) {
-        res.buy();
-    }
-
+    Market::buyAll(reservations);
     reservations.clear();
 }
 
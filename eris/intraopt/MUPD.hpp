@@ -2,10 +2,12 @@
 #include <eris/Consumer.hpp>
 #include <eris/Optimize.hpp>
 #include <eris/Market.hpp>
+#include <eris/market/QMarket.hpp>
+#include <mutex>
 #include <stdexcept>
 #include <unordered_map>
 #include <unordered_set>
-#include <forward_list>
+#include <vector>
 
 namespace eris { namespace intraopt {
 
@@ -18,8 +20,12 @@ namespace eris { namespace intraopt {
  * from the lowest (potentially negative) market to the highest market, and iterating until the
  * marginal utility per money unit is equal in each available market.  Multi-good markets are
  * handled (the marginal utility is the sum of the marginal utility of the individual goods).
+ *
+ * MUPD optimizers are also QMarket::PriceTaker members: a QMarket demand search can ask for the
+ * consumer's demand at hypothetical prices, which is found by repeating the optimization with the
+ * QMarket's price replaced.
  */
-class MUPD : public Member, public virtual OptApplyReset {
+class MUPD : public Member, public virtual OptApplyReset, public virtual market::QMarket::PriceTaker {
     public:
         /// The default value of the constructor's tolerance parameter
         static constexpr double default_tolerance = 1.0e-10;
@@ -46,9 +52,48 @@ class MUPD : public Member, public virtual OptApplyReset {
         /// Applies spending calculated and reserved in optimize().
         virtual void intraApply() override;
 
+        /** Returns the quantity that the consumer would buy in the given QMarket at each of the
+         * given per-unit prices, holding the consumer's assets and the supply in every other market
+         * fixed.  Each quantity is found by optimizing (without reserving anything) against a
+         * market that supplies any quantity at the given price and snapshots of the other markets,
+         * using the closed-form demand if `analytic_demand` applies and solve() otherwise.  Money
+         * that the consumer has tied up in reservations from the current optimization counts as
+         * available to spend.  Returns all zeros if the market isn't priced in the money good.
+         */
+        virtual Eigen::VectorXd demand(const market::QMarket &market, const Eigen::VectorXd &prices) const override;
+
         /** The relative tolerance level at which optimization stops. */
         double tolerance;
 
+        /** If true, the optimizer takes a Market::snapshot() of each eligible market at the start
+         * of intraOptimize() and optimizes against the snapshots rather than the live markets, so
+         * that no market locks are needed until the final allocation is reserved.  Concurrent
+         * optimizers thus don't contend for popular markets.  If a reservation fails because the
+         * market has changed since the snapshot was taken, fresh snapshots are taken and the
+         * optimization is repeated.  Markets that don't support snapshots are queried directly.
+         * Defaults to false.
+         */
+        bool use_snapshots = false;
+
+        /** If true (the default), each optimization starts from the spending shares of the last
+         * successful optimization (from the previous pass or period) rather than from equal
+         * spending in every market.  Markets that are no longer eligible are dropped from the
+         * previous shares, and newly eligible markets start with no spending; if nothing is left,
+         * equal spending is used.  When prices have changed only slightly, as between QMarket
+         * price-search steps, the optimum is then only a few iterations away.
+         */
+        bool warm_start = true;
+
+        /** If true (the default) and the consumer implements Consumer::AnalyticDemand, the
+         * optimizer first checks whether every eligible market sells a single good (not sold by
+         * any other eligible market) at a constant marginal price over every quantity the
+         * consumer could afford.  If so, the consumer faces fixed per-unit prices, and its
+         * closed-form demand() is used to find the optimal bundle directly, without any iterative
+         * search.  If any market doesn't qualify, or demand() declines to give an answer, the
+         * usual numerical optimization is used.
+         */
+        bool analytic_demand = true;
+
         /** Exception class thrown if attempting to perform an action in a market that can't be done
          * because the market is exhausted.  A typical example of this is trying to compute the
          * market's marginal utility per dollar (calc_mu_per_d()) on an exhausted market.
@@ -84,11 +129,14 @@ class MUPD : public Member, public virtual OptApplyReset {
             std::unordered_set<id_t> constrained;
         };
 
+        /// Market snapshots by market id, as stored by take_snapshots()
+        typedef std::unordered_map<id_t, std::shared_ptr<const Market::Snapshot>> snapshot_map;
+
         /** Calculates the Bundle that the given spending allocation will buy.  A market id of 0 is
          * interpreted as a pseudomarket for holding onto cash, i.e. the "spending" is just held as
-         * cash.
+         * cash.  Markets with a snapshot in `snaps` are priced from the snapshot.
          */
-        allocation spending_allocation(const std::unordered_map<id_t, double> &spending) const;
+        allocation spending_allocation(const std::unordered_map<id_t, double> &spending, const snapshot_map &snaps) const;
 
         /** Calculates the marginal utility per money unit evaluated at the given Bundle.
          * \param con the consumer
@@ -96,6 +144,7 @@ class MUPD : public Member, public virtual OptApplyReset {
          * \param mkt_id the market id for which to calculate MU/$
          * \param a the allocation as returned by spending_allocation()
          * \param b the Bundle at which to evaluate marginal utility
+         * \param snaps market snapshots to use instead of the live markets
          *
          * Note that this method is not, by itself, thread-safe: calling code should have already
          * locked the consumer and relevant markets.
@@ -105,21 +154,119 @@ class MUPD : public Member, public virtual OptApplyReset {
                 Member::Lock &lock,
                 id_t mkt_id,
                 const allocation &a,
-                const Bundle &b) const;
+                const Bundle &b,
+                const snapshot_map &snaps) const;
+
+        /** Finds the utility-maximizing spending of `cash` across the given markets (and the cash
+         * pseudo-market, id 0), without reserving anything.  MUPD transfers spending between the
+         * markets with the highest and lowest MU/$; subclasses can override this to use a
+         * different search.
+         *
+         * \param markets the eligible markets
+         * \param cash the amount of money available to spend
+         * \param a_no_money the consumer's assets, excluding money
+         * \param lock an already-active (read or write) lock on the consumer
+         * \param snaps market snapshots to use instead of the live markets
+         * \param spending the spending allocation to start from (as returned by
+         * initial_spending()); updated to the optimal spending allocation
+         * \param alloc set to the allocation that the optimal spending buys
+         *
+         * Returns false (leaving `alloc` unchanged) if every market turns out to be exhausted.
+         */
+        virtual bool solve(const std::vector<id_t> &markets, double cash, const Bundle &a_no_money,
+                Member::Lock &lock, const snapshot_map &snaps,
+                std::unordered_map<id_t, double> &spending, allocation &alloc) const;
+
+        /** Returns the ids of the simulation markets that this optimizer can spend in: those priced
+         * in exactly the money good, that don't produce money, and that can currently supply some
+         * output.
+         */
+        std::vector<id_t> eligible_markets() const;
+
+        /** Reserves the market quantities of the given allocation, adding the reservations to
+         * `reservations`.  If any reservation fails, all reservations are released and false is
+         * returned; otherwise returns true.
+         *
+         * \param alloc the allocation to reserve, as returned by spending_allocation()
+         * \param lock an already-active write lock on the consumer
+         * \param cash the amount of money the allocation spends
+         * \param spend_all true if the allocation holds no cash back, in which case a tiny amount
+         * of slack is given to the consumer during reserving to absorb numerical error
+         */
+        bool reserve_allocation(const allocation &alloc, Member::Lock &lock, double cash, bool spend_all);
+
+        /** Returns the spending allocation to start optimizing from, spending `cash` across the
+         * given markets (and the cash pseudo-market, id 0).  This uses the shares stored by
+         * remember_spending() if `warm_start` is enabled and any of them apply to the given
+         * markets, otherwise equal spending in every market.
+         */
+        std::unordered_map<id_t, double> initial_spending(const std::vector<id_t> &markets, double cash) const;
+
+        /** Stores the shares of `cash` in the given spending allocation for use as the next warm
+         * start.
+         */
+        void remember_spending(const std::unordered_map<id_t, double> &spending, double cash);
+
+        /** Calculates the optimal allocation using the consumer's closed-form demand, as described
+         * in `analytic_demand`, pricing markets from `snaps` where available.  Money is included in
+         * the demand calculation as a good with a price of 1, so that the consumer can choose to
+         * keep some.  Returns false (leaving `alloc` and `spending` unchanged) if the consumer has
+         * no closed-form demand, a market doesn't qualify, or demand() declines to give an answer.
+         */
+        bool analytic_allocation(const std::vector<id_t> &markets, double cash, const Bundle &a_no_money,
+                const snapshot_map &snaps, allocation &alloc, std::unordered_map<id_t, double> &spending) const;
+
+        /** Attempts to optimize using the consumer's closed-form demand, as described in
+         * `analytic_demand`, and reserves the resulting allocation.  Money is included in the
+         * demand calculation as a good with a price of 1, so that the consumer can choose to keep
+         * some.  Returns true if the closed-form demand applied and its allocation was reserved;
+         * otherwise nothing is reserved, and false is returned so that the caller can fall back to
+         * a numerical optimization.
+         *
+         * \param markets the eligible markets
+         * \param lock an already-active write lock on the consumer
+         * \param cash the amount of money available to spend
+         * \param a_no_money the consumer's assets, excluding money
+         */
+        bool analytic_reserve(const std::vector<id_t> &markets, Member::Lock &lock, double cash, const Bundle &a_no_money);
+
+        /** If `use_snapshots` is true, replaces any stored market snapshots with new snapshots of
+         * the given markets; otherwise just discards any stored snapshots.
+         */
+        void take_snapshots(const std::vector<id_t> &markets);
+
+        /** Returns the quantity that `p` units of the market's price buys, from the market's
+         * snapshot in `snaps` if there is one, otherwise from Market::cachedQuantity() (which is a
+         * live query unless the market has enabled Market::cache_quotes).
+         */
+        Market::quantity_info market_quantity(const SharedMember<Market> &m, double p, const snapshot_map &snaps) const;
+
+        /** Returns the price of `q` units of the market's output, from the market's snapshot in
+         * `snaps` if there is one, otherwise from Market::cachedPrice().
+         */
+        Market::price_info market_price(const SharedMember<Market> &m, double q, const snapshot_map &snaps) const;
 
         /// Returns the ratio between the market's output price and the optimizer's money unit.
-        /// Results are cached for performance.
+        /// Results are cached for performance; this is safe to call from multiple threads.
         double price_ratio(const SharedMember<Market> &m) const;
 
         /// Declares a dependency on the consumer when added to a simulation
         virtual void added() override;
 
         /// Reservations populated during optimize(), applied during apply().
-        std::forward_list<Market::Reservation> reservations;
+        std::vector<Market::Reservation> reservations;
+
+        /// Market snapshots taken by take_snapshots()
+        snapshot_map snapshots_;
 
     private:
         /// Stores cached price ratios
         mutable std::unordered_map<id_t, double> price_ratio_cache;
+        /// Guards price_ratio_cache, since demand() may be called from several threads at once
+        mutable std::mutex price_ratio_mutex_;
+
+        /// Spending shares of the last successful optimization, for warm starts
+        std::unordered_map<id_t, double> warm_shares_;
 
 };
 
@@ -0,0 +1,245 @@
+#include <eris/intraopt/ProjectedNewton.hpp>
+#include <eris/Consumer.hpp>
+#include <eris/Market.hpp>
+#include <eris/Good.hpp>
+#include <Eigen/Cholesky>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <unordered_map>
+#include <utility>
+
+using namespace Eigen;
+
+namespace eris { namespace intraopt {
+
+ProjectedNewton::ProjectedNewton(SharedMember<Consumer::Differentiable> c, SharedMember<Good> m, double tolerance) :
+    MUPD(std::move(c), std::move(m), tolerance)
+    {}
+
+ProjectedNewton::point ProjectedNewton::evaluate(
+        const VectorXd &spending, const std::vector<SharedMember<Market>> &markets, const Bundle &base,
+        const snapshot_map &snaps) const {
+    point p;
+    p.spending = spending;
+    p.bundle = base;
+    p.constrained.resize(spending.size(), false);
+
+    for (size_t i = 1; i < (size_t) spending.size(); i++) {
+        if (spending[i] <= 0) continue;
+
+        auto &mkt = markets[i-1];
+        double ratio = price_ratio(mkt);
+        auto q = market_quantity(mkt, spending[i] * ratio, snaps);
+
+        p.alloc.quantity[mkt->id()] = q.quantity;
+        p.bundle += mkt->output_unit * q.quantity;
+
+        if (q.constrained) {
+            // Move whatever can't be spent into cash
+            p.constrained[i] = true;
+            p.alloc.constrained.insert(mkt->id());
+            p.spending[i] -= q.unspent / ratio;
+            p.spending[0] += q.unspent / ratio;
+        }
+    }
+
+    if (p.spending[0] > 0) {
+        p.alloc.quantity[0] = p.spending[0];
+        p.bundle += money_unit * p.spending[0];
+    }
+    p.alloc.bundle = p.bundle - base;
+    p.utility = con->utility(p.bundle);
+
+    return p;
+}
+
+void ProjectedNewton::intraReset() {
+    MUPD::intraReset();
+    iterations_ = 0;
+}
+
+bool ProjectedNewton::solve(const std::vector<id_t> &markets, double cash, const Bundle &a_no_money, Member::Lock&,
+        const snapshot_map &snaps, std::unordered_map<id_t, double> &spending, allocation &alloc) const {
+    iterations_ += newton(markets, cash, a_no_money, snaps, spending, alloc);
+    return true;
+}
+
+unsigned int ProjectedNewton::newton(const std::vector<id_t> &eligible, double cash, const Bundle &a_no_money,
+        const snapshot_map &snaps, std::unordered_map<id_t, double> &spending, allocation &alloc) const {
+    auto sim = simulation();
+    std::vector<SharedMember<Market>> markets;
+    for (auto &mkt_id : eligible)
+        markets.push_back(sim->market(mkt_id));
+
+    // Index 0 is the cash pseudo-market; market i is at index i+1.
+    const size_t n = markets.size() + 1;
+
+    // The goods involved (money first), and the matrix of goods per unit of each market's output,
+    // with one column per market.
+    std::vector<id_t> goods{money->id()};
+    std::unordered_map<id_t, size_t> good_index{{money->id(), 0}};
+    for (auto &mkt : markets) {
+        for (auto &g : mkt->output_unit) {
+            if (good_index.emplace(g.first, goods.size()).second)
+                goods.push_back(g.first);
+        }
+    }
+    MatrixXd output = MatrixXd::Zero(goods.size(), n);
+    output(0, 0) = 1;
+    for (size_t i = 1; i < n; i++) {
+        for (auto &g : markets[i-1]->output_unit)
+            output(good_index[g.first], i) = g.second;
+    }
+
+    VectorXd x(n);
+    x[0] = spending[0];
+    for (size_t i = 1; i < n; i++) {
+        auto found = spending.find(eligible[i-1]);
+        x[i] = found == spending.end() ? 0.0 : found->second;
+    }
+    point cur = evaluate(x, markets, a_no_money, snaps);
+
+    unsigned int iterations = 0;
+    for (; iterations < max_iterations; ++iterations) {
+        x = cur.spending;
+
+        // The derivative of quantity with respect to spending in each market, from the
+        // marginal price at the current quantity.  Markets where we can't price the marginal
+        // unit are held fixed.
+        VectorXd dq = VectorXd::Zero(n);
+        std::vector<bool> fixed(n, false), can_increase(n, true);
+        dq[0] = 1;
+        for (size_t i = 1; i < n; i++) {
+            auto &mkt = markets[i-1];
+            auto found = cur.alloc.quantity.find(mkt->id());
+            auto pricing = market_price(mkt, found == cur.alloc.quantity.end() ? 0 : found->second, snaps);
+            if (not pricing.feasible or not(pricing.marginal > 0)) {
+                fixed[i] = true;
+                can_increase[i] = false;
+            }
+            else {
+                dq[i] = price_ratio(mkt) / pricing.marginal;
+                can_increase[i] = not cur.constrained[i];
+            }
+        }
+
+        // Gradient and Hessian of utility with respect to goods...
+        VectorXd grad_u = con->gradientVector(goods, cur.bundle);
+        MatrixXd hess_u = con->hessianMatrix(goods, cur.bundle);
+        // ... and with respect to spending.  g is thus the MU/$ of each market.
+        MatrixXd dgoods = output * dq.asDiagonal();
+        VectorXd g = dgoods.transpose() * grad_u;
+        MatrixXd H = dgoods.transpose() * hess_u * dgoods;
+
+        // Check the KKT conditions: MU/$ must be equal (to within tolerance) across markets
+        // with positive spending, and no higher in any market we could spend more in.
+        double highest = -std::numeric_limits<double>::infinity(), lowest = std::numeric_limits<double>::infinity();
+        size_t enter = n;
+        for (size_t i = 0; i < n; i++) {
+            if (fixed[i]) continue;
+            if (x[i] > 0 and g[i] < lowest) lowest = g[i];
+            if (can_increase[i] and g[i] > highest) {
+                highest = g[i];
+                if (x[i] <= 0) enter = i;
+                else enter = n;
+            }
+        }
+        if (highest <= lowest or (highest - lowest) / std::fabs(highest) < tolerance)
+            break;
+
+        // The free set: everything with positive spending, plus the best market not yet being
+        // spent in (if it beats what we are spending on).
+        std::vector<size_t> free;
+        for (size_t i = 0; i < n; i++) {
+            if (not fixed[i] and (x[i] > 0 or i == enter)) free.push_back(i);
+        }
+
+        // Solve for the Newton step on the free set subject to total spending not changing.
+        // We eliminate the budget constraint by writing the step as d = Z r, where Z = [I; -1']
+        // spans the steps that keep total spending fixed, then take a Newton step in r.  Since
+        // we are maximizing, the reduced matrix A = -Z'HZ should be positive definite; if it
+        // isn't (e.g. for linear utility, or away from the optimum of a non-concave utility),
+        // we add a multiple of the identity until it is.  Markets whose step would violate a
+        // bound (increasing a constrained market, or decreasing a market we aren't spending in)
+        // are removed from the free set and the step recalculated.
+        VectorXd d = VectorXd::Zero(n);
+        bool resolve = true;
+        while (resolve and free.size() >= 2) {
+            resolve = false;
+            const size_t m = free.size();
+            MatrixXd Z(m, m-1);
+            Z.topRows(m-1).setIdentity();
+            Z.row(m-1).setConstant(-1);
+            MatrixXd Hf(m, m);
+            VectorXd gf(m);
+            for (size_t j = 0; j < m; j++) {
+                gf[j] = g[free[j]];
+                for (size_t k = 0; k < m; k++) Hf(j, k) = H(free[j], free[k]);
+            }
+            MatrixXd A = -Z.transpose() * Hf * Z;
+            VectorXd gr = Z.transpose() * gf;
+
+            double mu = 0, mu_min = 1e-10 * A.diagonal().cwiseAbs().maxCoeff();
+            if (not(mu_min > 0)) mu_min = gr.cwiseAbs().maxCoeff() / cash;
+            LDLT<MatrixXd> ldlt;
+            for (int tries = 0; tries < 40; tries++) {
+                ldlt.compute(A + mu * MatrixXd::Identity(m-1, m-1));
+                if (ldlt.info() == Success and ldlt.vectorD().minCoeff() > 0) break;
+                mu = std::max(10 * mu, mu_min);
+            }
+            VectorXd df = Z * ldlt.solve(gr);
+
+            d.setZero();
+            std::vector<size_t> keep;
+            for (size_t j = 0; j < m; j++) {
+                size_t i = free[j];
+                if ((df[j] > 0 and not can_increase[i]) or (df[j] < 0 and x[i] <= 0))
+                    resolve = true;
+                else
+                    keep.push_back(i);
+                d[i] = df[j];
+            }
+            if (resolve) free = std::move(keep);
+        }
+        if (free.size() < 2) break;
+
+        double ascent = g.dot(d);
+        if (not(ascent > 0)) break;
+
+        // Don't step past the point where some spending hits zero
+        double t = 1;
+        size_t blocking = n;
+        for (size_t i = 0; i < n; i++) {
+            if (d[i] < 0 and x[i] / -d[i] < t) {
+                t = x[i] / -d[i];
+                blocking = i;
+            }
+        }
+
+        // Backtrack until utility increases sufficiently
+        bool accepted = false;
+        for (int halvings = 0; halvings < 40; halvings++, t /= 2) {
+            VectorXd xt = (x + t * d).cwiseMax(0.0);
+            if (halvings == 0 and blocking < n) xt[blocking] = 0;
+            xt[0] = std::max(0.0, xt[0] + cash - xt.sum());
+
+            point trial = evaluate(xt, markets, a_no_money, snaps);
+            if (trial.utility >= cur.utility + 1e-4 * t * ascent) {
+                cur = std::move(trial);
+                accepted = true;
+                break;
+            }
+        }
+        if (not accepted) break;
+    }
+
+
+    alloc = std::move(cur.alloc);
+    spending.clear();
+    spending[0] = cur.spending[0];
+    for (size_t i = 1; i < n; i++) spending[eligible[i-1]] = cur.spending[i];
+    return iterations;
+}
+
+} }
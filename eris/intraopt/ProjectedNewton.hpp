@@ -0,0 +1,107 @@
+#pragma once
+#include <eris/intraopt/MUPD.hpp>
+#include <Eigen/Core>
+#include <atomic>
+#include <unordered_map>
+#include <vector>
+
+namespace eris { namespace intraopt {
+
+/** IntraOptimizer class that solves the same problem as MUPD--spending the consumer's money so as
+ * to maximize utility--but does so using a projected Newton (active set) method on the spending
+ * allocation rather than by pairwise reallocation between the highest and lowest MU/$ markets.
+ *
+ * Each iteration queries every eligible market once for the quantity its current spending buys and
+ * the marginal price at that quantity, and evaluates the consumer's gradient and Hessian once.
+ * These give the gradient and (ignoring the curvature of the markets' supply schedules) the
+ * Hessian of utility with respect to spending.  The Newton step for the spending in markets with
+ * positive spending is then obtained by solving the KKT system for the budget constraint, with
+ * markets entering the free set when their MU/$ exceeds that of the markets currently being spent
+ * in, and leaving it when the step would drive their spending below zero.  A backtracking line
+ * search on utility keeps the step from overshooting.
+ *
+ * Near the optimum convergence is quadratic, so far fewer market queries are needed than with
+ * MUPD when there are many markets; with MUPD::warm_start, re-optimizing after small price changes
+ * starts close to the optimum and so typically takes only a couple of iterations.  Stopping uses
+ * the same relative MU/$ tolerance as MUPD.  As
+ * with MUPD, this is restricted to Consumer::Differentiable consumers and to markets priced in a
+ * single money good.
+ */
+class ProjectedNewton : public MUPD {
+    public:
+        /// The default value of max_iterations
+        static constexpr unsigned int default_max_iterations = 100;
+
+        /** Constructs a ProjectedNewton optimizer given a differentiable consumer instance and a
+         * money good.
+         *
+         * \param consumer the consumer this optimizer controls
+         * \param money the money good that the consumer spends
+         * \param tolerance the relative tolerance of the algorithm, as in MUPD.
+         */
+        ProjectedNewton(SharedMember<Consumer::Differentiable> consumer, SharedMember<Good> money, double tolerance = default_tolerance);
+
+        /** The maximum number of Newton iterations performed by a single solve() (and so for each
+         * optimization attempt in intraOptimize()).
+         */
+        unsigned int max_iterations = default_max_iterations;
+
+        /** Returns the number of Newton iterations performed since the last intraReset(): that is,
+         * by the current (or last) intraOptimize() call, plus any needed to answer demand()
+         * queries since.
+         */
+        unsigned int iterations() const { return iterations_; }
+
+        /// Resets the iterations() counter, in addition to the MUPD reset.
+        virtual void intraReset() override;
+
+    protected:
+        /** The state of the optimization at a particular spending allocation, as returned by
+         * evaluate().
+         */
+        struct point {
+            /** The spending in each market, with the amount held as cash at index 0.  This can
+             * differ from the requested spending when a market constraint is hit, in which case the
+             * unspent amount is moved into cash.
+             */
+            Eigen::VectorXd spending;
+            /// The allocation that the spending buys
+            allocation alloc;
+            /// The consumer's resulting bundle
+            Bundle bundle;
+            /// The consumer's utility of `bundle`
+            double utility;
+            /// True for each market in which spending cannot be increased because of a constraint
+            std::vector<bool> constrained;
+        };
+
+        /** Evaluates a spending allocation.  Each market is queried exactly once.
+         *
+         * \param spending the spending allocation; index 0 is cash, index i is `markets[i-1]`
+         * \param markets the markets being optimized over
+         * \param base the consumer's assets, less money
+         * \param snaps market snapshots to use instead of the live markets
+         */
+        point evaluate(const Eigen::VectorXd &spending, const std::vector<SharedMember<Market>> &markets,
+                const Bundle &base, const snapshot_map &snaps) const;
+
+        /** Finds the optimal spending allocation using the projected Newton search, performing at
+         * most `max_iterations` iterations, and adds the iterations performed to iterations().
+         */
+        virtual bool solve(const std::vector<id_t> &markets, double cash, const Bundle &a_no_money,
+                Member::Lock &lock, const snapshot_map &snaps,
+                std::unordered_map<id_t, double> &spending, allocation &alloc) const override;
+
+        /** Runs the projected Newton search from the given spending allocation, as described for
+         * MUPD::solve(), for at most `max_iterations` iterations.  Returns the number of iterations
+         * performed.
+         */
+        unsigned int newton(const std::vector<id_t> &markets, double cash, const Bundle &a_no_money,
+                const snapshot_map &snaps, std::unordered_map<id_t, double> &spending, allocation &alloc) const;
+
+    private:
+        // The counter returned by iterations(), updated by solve()
+        mutable std::atomic<unsigned int> iterations_{0};
+};
+
+} }
@@ -3,6 +3,8 @@
 #include <eris/Market.hpp>
 #include <eris/random/rng.hpp>
 #include <boost/random/uniform_int_distribution.hpp>
+#include <algorithm>
+#include <cmath>
 #include <unordered_map>
 #include <utility>
 #include <vector>
@@ -13,122 +15,154 @@ Bertrand::Bertrand(Bundle output_unit, Bundle price_unit, bool randomize)
     : Market(output_unit, price_unit), randomize(randomize) {}
 
 Market::price_info Bertrand::price(double q) const {
-    return allocate(q).p;
+    return schedule()->snapshot->price(q);
 }
 
 Market::quantity_info Bertrand::quantity(double price) const {
-    // Keys are prices, values are aggregate quantities available
-    std::unordered_map<double, double> price_quantity;
+    return schedule()->snapshot->quantity(price);
+}
+
+std::shared_ptr<const Market::Snapshot> Bertrand::snapshot() const {
+    return schedule()->snapshot;
+}
+
+std::shared_ptr<const Bertrand::supply_schedule> Bertrand::schedule() const {
+    // Lock the market; we'll add firms to this lock if we need to rebuild the schedule
+    auto lock = readLock();
+
+    // This has to be read before any firm's versions, so that a change made while we're checking or
+    // rebuilding makes us check again next time.
+    const unsigned long epoch = Firm::supplyEpoch();
+    {
+        std::lock_guard<std::mutex> guard(schedule_mutex_);
+        if (schedule_) {
+            // If no firm anywhere has changed its supply or assets, there's nothing to check
+            if (epoch == schedule_epoch_) return schedule_;
+
+            // Otherwise the schedule is still good if none of our firms' supply versions or asset
+            // bundles have changed.  Checking the assets catches direct modifications of a firm's
+            // assets that didn't call supplyChanged().
+            bool changed = false;
+            for (auto &fv : schedule_->versions) {
+                if (fv.firm->supplyVersion() != fv.supply or fv.firm->assets.version() != fv.assets) {
+                    changed = true;
+                    break;
+                }
+            }
+            if (not changed) {
+                schedule_epoch_ = epoch;
+                return schedule_;
+            }
+        }
+    }
 
     std::vector<SharedMember<firm::PriceFirm>> suppliers;
-    for (auto &fid : suppliers_) suppliers.push_back(simAgent(fid));
+    suppliers.reserve(suppliers_.size());
+    for (auto &fid : suppliers_) suppliers.push_back(simAgent<firm::PriceFirm>(fid));
+    lock.add(suppliers);
 
-    // Lock the market and firms
-    auto lock = readLock(suppliers);
+    auto sched = std::make_shared<supply_schedule>();
+    sched->versions.reserve(suppliers.size());
 
+    // Elements are (price, (firm id, capacity)), to be sorted by price
+    std::vector<std::pair<double, std::pair<id_t, double>>> offers;
     for (auto &firm : suppliers) {
-        double s = firm->canSupplyAny(output_unit);
-        if (s > 0) {
+        // The versions have to be read before the firm's supply, so that any change that happens
+        // while we're rebuilding invalidates the new schedule.
+        sched->versions.push_back({firm, firm->supplyVersion(), firm->assets.version()});
+        // Make sure the "price" object in this market can pay for the units the firm wants
+        if (not price_unit.covers(firm->price())) continue;
+
+        double capacity = firm->canSupplyAny(output_unit);
+        if (capacity > 0) {
+            // First we need the market output supplied per firm output bundle unit, then we
+            // multiple that by the firm's price per market price.  This is because one firm
+            // could have (price=2,output=2), while another has (price=3,output=3) and another
+            // has (price=1,output=1); all three have the same per-unit price.
+            // Intuitively we want:
+            //     (market.output/market.price) / (firm.output/firm.price)
+            // but we have to actually compute it as:
+            //     (market.outout/firm.output) * (firm.price / market.price)
+            // because those divisions are lossy when Bundles aren't scaled versions of each
+            // other (see Bundle.hpp's description of Bundle division)
             double firm_price = output_unit.coverage(firm->output()) * firm->price().coverage(price_unit);
-            price_quantity[firm_price] += s;
+            offers.push_back({firm_price, {firm->id(), capacity}});
         }
     }
-
-    double quantity = 0;
-    double unspent = price;
-    for (auto pf : price_quantity) {
-        double p = pf.first;
-        double q = pf.second;
-        if (unspent > p*q) {
-            // Buying everything at this price level doesn't exhaust income
-            quantity += q;
-            unspent -= p*q;
-        }
-        else {
-            // Otherwise buy as much as possible at this price level, and we're done.
-            quantity += unspent/p;
-            unspent = 0;
-            break;
+    // Sorting by price (and then by firm id) gives the schedule a deterministic order
+    std::sort(offers.begin(), offers.end());
+
+    auto &levels = sched->levels;
+    double q_before = 0, p_before = 0;
+    for (auto &offer : offers) {
+        if (levels.empty() or levels.back().price != offer.first) {
+            if (not levels.empty()) {
+                auto &last = levels.back();
+                // Nothing beyond an infinite-quantity level can ever be bought
+                if (std::isinf(last.q)) break;
+                q_before += last.q;
+                p_before += last.price * last.q;
+            }
+            levels.push_back({offer.first, 0, q_before, p_before, {}});
         }
+        levels.back().q += offer.second.second;
+        levels.back().firms.push_back(offer.second);
     }
 
-    return { quantity, price > 0, price-unspent, unspent };
+    std::vector<std::pair<double, double>> segments;
+    segments.reserve(levels.size());
+    for (auto &l : levels) segments.emplace_back(l.price, l.q);
+    sched->snapshot = std::make_shared<const Snapshot>(segments);
+
+    std::lock_guard<std::mutex> guard(schedule_mutex_);
+    schedule_ = sched;
+    schedule_epoch_ = epoch;
+    return schedule_;
 }
 
 Bertrand::allocation Bertrand::allocate(double q) const {
-    // Lock the market; we'll add firms to this lock as needed
-    auto lock = readLock();
+    auto sched = schedule();
+    auto &levels = sched->levels;
 
-    // Keys are prices, values are fraction of q*output_unit available at that price
-    std::unordered_map<double, double> price_agg_q;
-
-    // Keys are prices, values are maps of <firm -> fraction of q*output_unit available> available
-    // at that price.
-    std::unordered_map<double, std::vector<std::pair<id_t, double>>> schedule;
-
-    double agg_quantity = 0.0;
-    Bundle q_bundle = q * output_unit;
+    allocation a = {};
+    if (levels.empty()) return a; // Nothing available: infeasible
 
-    for (auto f : suppliers_) {
-        auto firm = simAgent<firm::PriceFirm>(f);
-        lock.add(firm);
-        // Make sure the "price" object in this market can pay for the units the firm wants
-        if (price_unit.covers(firm->price())) {
-            double productivity = firm->canSupplyAny(q_bundle);
-            if (productivity > 0) {
-                agg_quantity += productivity;
-                // First we need the market output supplied per firm output bundle unit, then we
-                // multiple that by the firm's price per market price.  This is because one firm
-                // could have (price=2,output=2), while another has (price=3,output=3) and another
-                // has (price=1,output=1); all three have the same per-unit price.
-                // Intuitively we want:
-                //     (market.output/market.price) / (firm.output/firm.price)
-                // but we have to actually compute it as:
-                //     (market.outout/firm.output) * (firm.price / market.price)
-                // because those divisions are lossy when Bundles aren't scaled versions of each
-                // other (see Bundle.hpp's description of Bundle division)
-                double firm_price = output_unit.coverage(firm->output()) * firm->price().coverage(price_unit);
-                price_agg_q[firm_price] += productivity;
-                schedule[firm_price].emplace_back(firm->id(), productivity);
-            }
-        }
-        lock.remove(firm);
+    a.p.total = 0;
+    a.p.marginalFirst = a.p.marginal = levels.front().price;
+    if (q <= 0) {
+        a.p.feasible = true;
+        return a;
     }
 
-    // Figure out how we're going to allocate this.
-    allocation a = {};
-
+    // Walk through the price levels from cheapest to most expensive, stopping as soon as the
+    // needed quantity has been allocated.
     double need_q = q;
-    bool first_price = true;
-    for (auto pf : schedule) {
-        double price = pf.first;
-        if (first_price) {
-            a.p.marginalFirst = price;
-            first_price = false;
-        }
-        double agg_q = price_agg_q[price];
+    for (auto &level : levels) {
+        double price = level.price;
+        double agg_q = level.q;
+        a.p.marginal = price;
         a.p.total += price * (agg_q <= need_q ? agg_q : need_q);
 
-        auto firms = pf.second;
-
         if (agg_q <= need_q) {
             // The aggregate quantity at this price does not exceed the needed aggregate quantity,
-            // so allocation is easy: every firm supplies their full reported productivity value.
-            for (auto firmprod : firms) {
-                a.shares[firmprod.first].q += firmprod.second;
-                a.shares[firmprod.first].p += price*firmprod.second;
+            // so allocation is easy: every firm supplies their full capacity.
+            for (auto &firmcap : level.firms) {
+                a.shares[firmcap.first].q += firmcap.second;
+                a.shares[firmcap.first].p += price*firmcap.second;
             }
             need_q -= agg_q;
         }
-        else if (firms.size() == 1) {
+        else if (level.firms.size() == 1) {
             // There is excess capacity, but all from one firm, so allocation is easy again.
-            a.shares[firms[0].first].q += need_q;
-            a.shares[firms[0].first].p += price*need_q;
+            a.shares[level.firms[0].first].q += need_q;
+            a.shares[level.firms[0].first].p += price*need_q;
             need_q = 0;
         }
         else {
             // Otherwise life is more complicated: there is excess capacity, so we need to worry
-            // about allocation rules among multiple firms.
+            // about allocation rules among multiple firms.  (The cached schedule is shared, so
+            // work with a copy of the level's firms and capacities).
+            auto firms = level.firms;
             while (need_q > 0) {
                 unsigned nFirms = firms.size();
                 if (nFirms == 1) {
@@ -214,7 +248,6 @@ Bertrand::allocation Bertrand::allocate(double q) const {
             }
         }
 
-        a.p.marginal = price;
         // If we've allocated all the needed quantity, we're done.
         if (need_q <= 0) break;
     }
@@ -242,23 +275,20 @@ Market::Reservation Bertrand::reserve(SharedMember<Agent> agent, double q, doubl
     if (!(agent->assets >= cost)) throw insufficient_assets();
 
     double total_q = 0, total_p = 0;
-
-    std::unordered_map<id_t, BundleNegative> firm_transfers;
-
-    // Figure out how much each firm contributes to the reservation
     for (auto &firm_share : a.shares) {
-        auto firm = simAgent<firm::PriceFirm>(firm_share.first);
-        auto share = firm_share.second;
-
-        total_q += share.q;
-        total_p += share.p;
-        firm_transfers[firm->id()] += share.p * -price_unit + share.q * output_unit;
+        total_q += firm_share.second.q;
+        total_p += firm_share.second.p;
     }
 
+    // Reserve each firm's contribution to the reservation
     Reservation res = createReservation(agent, total_q, total_p);
-    for (auto &ft : firm_transfers) {
-        res.firmReserve(ft.first, ft.second);
+    std::vector<std::pair<id_t, BundleNegative>> transfers;
+    transfers.reserve(a.shares.size());
+    for (auto &firm_share : a.shares) {
+        auto &share = firm_share.second;
+        transfers.emplace_back(firm_share.first, share.p * -price_unit + share.q * output_unit);
     }
+    res.firmReserve(transfers);
 
     return res;
 }
@@ -266,6 +296,14 @@ Market::Reservation Bertrand::reserve(SharedMember<Agent> agent, double q, doubl
 void Bertrand::addFirm(SharedMember<Firm> f) {
     requireInstanceOf<firm::PriceFirm>(f, "Firm passed to Bertrand.addFirm(...) is not a PriceFirm instance");
     Market::addFirm(f);
+    std::lock_guard<std::mutex> guard(schedule_mutex_);
+    schedule_.reset();
+}
+
+void Bertrand::removeFirm(id_t fid) {
+    Market::removeFirm(fid);
+    std::lock_guard<std::mutex> guard(schedule_mutex_);
+    schedule_.reset();
 }
 
 } }
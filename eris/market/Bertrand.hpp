@@ -1,7 +1,11 @@
 #pragma once
 #include <eris/Market.hpp>
 #include <limits>
+#include <memory>
+#include <mutex>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 namespace eris { namespace market {
 
@@ -32,6 +36,8 @@ class Bertrand : public Market {
         /// Returns the quantity (in terms of multiples of the output Bundle) that p units of the
         /// price Bundle will purchase.
         virtual quantity_info quantity(double p) const override;
+        /// Returns a snapshot of the market's supply schedule.
+        virtual std::shared_ptr<const Snapshot> snapshot() const override;
         /// Reserves q units, paying at most p_max for them.
         virtual Reservation reserve(
                 SharedMember<Agent> agent,
@@ -39,6 +45,8 @@ class Bertrand : public Market {
                 double p_max = std::numeric_limits<double>::infinity()) override;
         /// Adds a firm to this market.  The Firm must be a PriceFirm object (or subclass)
         virtual void addFirm(SharedMember<Firm> f) override;
+        /// Removes a firm from this market.
+        virtual void removeFirm(id_t fid) override;
 
     protected:
         /** Whether to randomize when multiple firms offer the good at exactly the same (lowest)
@@ -60,9 +68,66 @@ class Bertrand : public Market {
         };
         /** Calculates the allocations across firms for a purchase of q units of the good.
          * Lower-priced firms get priority, with ties as decided by the randomize parameter
-         * specified during object construction.
+         * specified during object construction.  This walks the price levels of the cached
+         * schedule() from cheapest to most expensive, stopping as soon as q is allocated.
          */
         virtual allocation allocate(double q) const;
+
+        /** A single price level of the market supply schedule: the firms offering output at a
+         * given per-unit price, and their aggregate capacity.
+         */
+        struct price_level {
+            /// The price per unit of output (as a multiple of price_unit)
+            double price;
+            /// The aggregate quantity (possibly infinite) that firms supply at this price
+            double q;
+            /// The cumulative quantity supplied at all lower price levels
+            double q_before;
+            /// The total cost of buying the `q_before` units supplied at lower price levels
+            double p_before;
+            /// The ids and capacities (in multiples of output_unit) of the firms at this price
+            std::vector<std::pair<id_t, double>> firms;
+        };
+
+        /** The supply schedule of the market, as built by schedule(). */
+        struct supply_schedule {
+            /** The price levels, sorted by ascending price.  Only firms that can supply a positive
+             * quantity are included, and any levels above the first level with infinite quantity
+             * are omitted (as they can never be reached).
+             */
+            std::vector<price_level> levels;
+            /// A firm and its versions when the schedule was built
+            struct firm_version {
+                /// The firm
+                SharedMember<Firm> firm;
+                /// The firm's Firm::supplyVersion()
+                unsigned long supply;
+                /// The version() of the firm's assets bundle
+                unsigned long assets;
+            };
+            /// The market's firms and their versions when the schedule was built
+            std::vector<firm_version> versions;
+            /// The schedule as a Market::Snapshot, which answers price() and quantity() queries
+            std::shared_ptr<const Snapshot> snapshot;
+        };
+
+        /** Returns the current supply schedule of the market.  The schedule is cached, and is only
+         * rebuilt when a firm is added or removed, or when the Firm::supplyVersion() or assets
+         * Bundle::version() of one of the market's firms has changed.  Validating the schedule only
+         * compares those counters (and only compares the global Firm::supplyEpoch() if no firm
+         * has changed since the last validation), and price and quantity queries are answered by
+         * searching the schedule's snapshot, so repeated queries between changes don't require
+         * any firm to be locked or queried.
+         */
+        std::shared_ptr<const supply_schedule> schedule() const;
+
+    private:
+        // The cached supply schedule; null if it needs to be rebuilt.
+        mutable std::shared_ptr<const supply_schedule> schedule_;
+        // The Firm::supplyEpoch() at which schedule_ was last built or validated
+        mutable unsigned long schedule_epoch_ = 0;
+        // Guards access to schedule_ and schedule_epoch_
+        mutable std::mutex schedule_mutex_;
 };
 
 } }
@@ -0,0 +1,369 @@
+#include <eris/market/OrderBook.hpp>
+#include <eris/Simulation.hpp>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <utility>
+
+namespace eris { namespace market {
+
+OrderBook::OrderBook(Bundle output_unit, Bundle price_unit) : Market(output_unit, price_unit) {}
+
+std::vector<OrderBook::level>::iterator OrderBook::findLevel(std::vector<level> &book, bool ascending, double price) {
+    return ascending
+        ? std::lower_bound(book.begin(), book.end(), price, [](const level &l, double p) { return l.price < p; })
+        : std::lower_bound(book.begin(), book.end(), price, [](const level &l, double p) { return l.price > p; });
+}
+
+OrderBook::order_id OrderBook::add(std::vector<level> &book, bool ascending, double price, order o) {
+    auto l = findLevel(book, ascending, price);
+    if (l == book.end() or l->price != price)
+        l = book.insert(l, level{price, 0, {}});
+
+    o.id = next_id_++;
+    index_.emplace(o.id, std::make_pair(not ascending, price));
+    l->q += o.q;
+    l->orders.push_back(std::move(o));
+    quotesChanged();
+    return l->orders.back().id;
+}
+
+void OrderBook::popBest(std::vector<level> &book) {
+    auto &best = book.back();
+    index_.erase(best.orders.front().id);
+    best.orders.pop_front();
+    if (best.orders.empty()) book.pop_back();
+}
+
+OrderBook::order_id OrderBook::ask(SharedMember<Firm> firm, double price, double q) {
+    auto lock = writeLock();
+    if (suppliers_.count(firm->id()) == 0)
+        throw std::invalid_argument("OrderBook::ask: firm is not a firm in this market");
+    if (not (q > 0) or not (price >= 0))
+        throw std::invalid_argument("OrderBook::ask: quantity must be positive and price non-negative");
+
+    return add(asks_, false, price, order{0, firm, q, Bundle()});
+}
+
+OrderBook::order_id OrderBook::bid(SharedMember<Agent> agent, double price, double q) {
+    if (not (q > 0) or not (price >= 0))
+        throw std::invalid_argument("OrderBook::bid: quantity must be positive and price non-negative");
+
+    auto lock = writeLock(agent);
+    Bundle payment = price * q * price_unit;
+    if (not (agent->assets >= payment)) throw insufficient_assets();
+
+    order o{0, agent, q, Bundle()};
+    agent->assets.transfer(payment, o.escrow);
+    return add(bids_, true, price, std::move(o));
+}
+
+bool OrderBook::findOrder(order_id id, bool &is_ask, std::vector<level>::iterator &l, std::deque<order>::iterator &o) {
+    auto found = index_.find(id);
+    if (found == index_.end()) return false;
+
+    is_ask = found->second.first;
+    auto &book = is_ask ? asks_ : bids_;
+    l = findLevel(book, not is_ask, found->second.second);
+    o = std::find_if(l->orders.begin(), l->orders.end(), [id](const order &o) { return o.id == id; });
+    return true;
+}
+
+void OrderBook::removeAsk(std::vector<level>::iterator l, std::deque<order>::iterator o) {
+    index_.erase(o->id);
+    l->orders.erase(o);
+    if (l->orders.empty()) asks_.erase(l);
+}
+
+bool OrderBook::cancel(order_id id) {
+    auto lock = writeLock();
+    bool is_ask;
+    std::vector<level>::iterator l;
+    std::deque<order>::iterator o;
+    if (not findOrder(id, is_ask, l, o)) return false;
+
+    if (is_ask) {
+        // Any reservations claiming this ask will be refunded for it when they are matched
+        l->q -= o->q;
+        l->claimed -= o->claimed;
+        removeAsk(l, o);
+    }
+    else {
+        // Return the held payment
+        lock.add(o->member);
+        o->member->assets += o->escrow;
+        l->q -= o->q;
+        l->orders.erase(o);
+        if (l->orders.empty()) bids_.erase(l);
+        index_.erase(id);
+    }
+    quotesChanged();
+    return true;
+}
+
+double OrderBook::bestAsk() const {
+    auto lock = readLock();
+    return asks_.empty() ? std::numeric_limits<double>::quiet_NaN() : asks_.back().price;
+}
+
+double OrderBook::bestBid() const {
+    auto lock = readLock();
+    return bids_.empty() ? std::numeric_limits<double>::quiet_NaN() : bids_.back().price;
+}
+
+template <typename F>
+void OrderBook::walkAsks(const F &f) const {
+    for (auto l = asks_.rbegin(); l != asks_.rend(); ++l) {
+        double available = l->q - l->claimed;
+        if (not(available > 0)) continue;
+        if (not f(l->price, available)) return;
+    }
+}
+
+bool OrderBook::bestUnclaimedAsk(std::vector<level>::iterator &l, std::deque<order>::iterator &o) {
+    for (l = asks_.end(); l != asks_.begin(); ) {
+        --l;
+        if (not(l->q - l->claimed > 0)) continue;
+        for (o = l->orders.begin(); o != l->orders.end(); ++o) {
+            if (o->q - o->claimed > 0) return true;
+        }
+    }
+    return false;
+}
+
+Market::price_info OrderBook::price(double q) const {
+    auto lock = readLock();
+
+    bool any = false;
+    double need = q, total = 0, marginal = 0, marginal_first = 0;
+    walkAsks([&](double price, double available) {
+        if (not any) { marginal_first = price; any = true; }
+        marginal = price;
+        double buy = std::min(need, available);
+        total += price * buy;
+        need -= buy;
+        return need > 0;
+    });
+
+    if (not any or need > 0) return price_info(); // Not enough available
+    return price_info(total, marginal, marginal_first);
+}
+
+Market::quantity_info OrderBook::quantity(double p) const {
+    auto lock = readLock();
+
+    double q = 0, unspent = p;
+    walkAsks([&](double price, double available) {
+        double cost = price * available;
+        if (unspent > cost) {
+            // Buying everything at this price level doesn't exhaust the spending amount
+            q += available;
+            unspent -= cost;
+            return true;
+        }
+        q += price > 0 ? unspent / price : available;
+        unspent = 0;
+        return false;
+    });
+
+    return { q, unspent > 0, p - unspent, unspent };
+}
+
+std::shared_ptr<const Market::Snapshot> OrderBook::snapshot() const {
+    auto lock = readLock();
+
+    std::vector<std::pair<double, double>> schedule;
+    walkAsks([&](double price, double available) {
+        schedule.emplace_back(price, available);
+        return true;
+    });
+    return std::make_shared<const Snapshot>(schedule);
+}
+
+Market::Reservation OrderBook::reserve(SharedMember<Agent> agent, double q, double p_max) {
+    auto lock = writeLock(agent);
+
+    // Claim unclaimed ask quantities, best first, until we have enough
+    std::vector<claim> claims;
+    std::vector<std::pair<level*, order*>> claimed;
+    double need = q, total = 0;
+    for (auto l = asks_.rbegin(); l != asks_.rend() and need > 0; ++l) {
+        if (not(l->q - l->claimed > 0)) continue;
+        for (auto &o : l->orders) {
+            double take = std::min(need, o.q - o.claimed);
+            if (not(take > 0)) continue;
+            claims.push_back({o.id, take});
+            claimed.emplace_back(&*l, &o);
+            total += l->price * take;
+            need -= take;
+            if (not(need > 0)) break;
+        }
+    }
+
+    if (need > 0 or (q == 0 and not price(0).feasible)) throw output_infeasible();
+    if (total > p_max) throw low_price();
+    if (not (agent->assets >= total * price_unit)) throw insufficient_assets();
+
+    auto res = createReservation(agent, q, total);
+    for (size_t i = 0; i < claims.size(); i++) {
+        claimed[i].first->claimed += claims[i].q;
+        claimed[i].second->claimed += claims[i].q;
+    }
+    claims_[reservationSlot_(res)] = std::move(claims);
+    return res;
+}
+
+void OrderBook::buy(Reservation &res) {
+    if (res.state() != ReservationState::pending)
+        throw Reservation::non_pending_exception();
+
+    {
+        auto lock = writeLock();
+        reservationState_(res) = ReservationState::complete;
+        // The reservation's held payment and claims become the market order's
+        Bundle &payment = reservationBundle_(res);
+        market_orders_.push_back(market_order{res.agent(), payment, {}});
+        payment.clear();
+        auto found = claims_.find(reservationSlot_(res));
+        if (found != claims_.end()) {
+            market_orders_.back().claims = std::move(found->second);
+            claims_.erase(found);
+        }
+        quotesChanged();
+    }
+
+    // If this market's intraApply() is still to come in the current stage, leave the matching for
+    // it; otherwise match right away.
+    auto sim = simulation();
+    if (sim->runStage() != Simulation::RunStage::intra_Apply or sim->runStagePriority() >= intraApplyPriority())
+        match();
+}
+
+void OrderBook::release(Reservation &res) {
+    if (res.state() == ReservationState::pending) {
+        auto lock = writeLock();
+        auto found = claims_.find(reservationSlot_(res));
+        if (found != claims_.end()) {
+            for (auto &c : found->second) {
+                bool is_ask;
+                std::vector<level>::iterator l;
+                std::deque<order>::iterator o;
+                if (findOrder(c.ask, is_ask, l, o)) {
+                    o->claimed = std::max(0.0, o->claimed - c.q);
+                    l->claimed = std::max(0.0, l->claimed - c.q);
+                }
+            }
+            claims_.erase(found);
+        }
+    }
+    Market::release(res);
+}
+
+void OrderBook::removeFirm(id_t fid) {
+    Market::removeFirm(fid);
+
+    std::vector<order_id> cancel_ids;
+    {
+        auto lock = readLock();
+        for (auto &l : asks_) for (auto &o : l.orders) {
+            if (o.member->id() == fid) cancel_ids.push_back(o.id);
+        }
+    }
+    for (auto &id : cancel_ids) cancel(id);
+}
+
+void OrderBook::intraApply() {
+    match();
+}
+
+bool OrderBook::fill(const SharedMember<Agent> &buyer, Bundle &escrow,
+        std::vector<level>::iterator l, std::deque<order>::iterator ask, double q) {
+    SharedMember<Firm> firm = ask->member;
+
+    Bundle trade;
+    try {
+        auto res = firm->reserve((q * l->price) * -price_unit + q * output_unit);
+        // Move the payment into `trade`; the firm transfer replaces it with the output
+        escrow.transfer(q * l->price * price_unit, trade, firm->epsilon);
+        res.transfer(trade);
+    }
+    catch (Firm::supply_failure&) {
+        // The firm can't supply the ask, so cancel it (after undoing any payment transfer)
+        escrow += trade;
+        l->q -= ask->q;
+        l->claimed -= ask->claimed;
+        removeAsk(l, ask);
+        return false;
+    }
+
+    buyer->assets += trade;
+    ask->q -= q;
+    l->q -= q;
+    if (ask->q <= 0) {
+        l->claimed -= ask->claimed;
+        removeAsk(l, ask);
+    }
+    return true;
+}
+
+void OrderBook::match() {
+    auto lock = writeLock();
+
+    // Lock every member with an order that could be matched.  Market orders and asks can all be
+    // matched, but bids only if they cross the current best ask.
+    std::vector<SharedMember<Member>> members;
+    for (auto &o : market_orders_) members.push_back(o.member);
+    for (auto &l : asks_) for (auto &o : l.orders) members.push_back(o.member);
+    if (not asks_.empty()) {
+        for (auto l = bids_.rbegin(); l != bids_.rend() and l->price >= asks_.back().price; ++l)
+            for (auto &o : l->orders) members.push_back(o.member);
+    }
+    lock.add(members);
+
+    // Market orders (i.e. bought reservations) go first, each filled from the asks it claimed:
+    while (not market_orders_.empty()) {
+        auto &mo = market_orders_.front();
+
+        for (auto &c : mo.claims) {
+            bool is_ask;
+            std::vector<level>::iterator l;
+            std::deque<order>::iterator ask;
+            // If the ask has since been cancelled, its share of the payment is refunded below
+            if (not findOrder(c.ask, is_ask, l, ask)) continue;
+
+            ask->claimed = std::max(0.0, ask->claimed - c.q);
+            l->claimed = std::max(0.0, l->claimed - c.q);
+            // The held payment was calculated to cover exactly the claimed asks, but don't let
+            // numerical error overdraw it
+            double q = c.q;
+            if (l->price > 0) q = std::min(q, mo.escrow.multiples(l->price * price_unit));
+            if (q > 0) fill(mo.member, mo.escrow, l, ask, q);
+        }
+
+        // Refund whatever is left of the payment
+        mo.member->assets += mo.escrow;
+        market_orders_.pop_front();
+    }
+
+    // Then limit bids, for as long as the best bid crosses the best unclaimed ask:
+    std::vector<level>::iterator l;
+    std::deque<order>::iterator ask;
+    while (not bids_.empty() and bestUnclaimedAsk(l, ask) and bids_.back().price >= l->price) {
+        auto &best = bids_.back();
+        auto &b = best.orders.front();
+        double q = std::min(b.q, ask->q - ask->claimed);
+        if (not fill(b.member, b.escrow, l, ask, q)) continue;
+
+        b.q -= q;
+        best.q -= q;
+        if (b.q <= 0) {
+            // Fully filled: refund any payment the bid held beyond what it spent
+            b.member->assets += b.escrow;
+            popBest(bids_);
+        }
+    }
+
+    quotesChanged();
+}
+
+} }
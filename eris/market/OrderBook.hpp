@@ -0,0 +1,204 @@
+#pragma once
+#include <eris/Optimize.hpp>
+#include <eris/Market.hpp>
+#include <deque>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+namespace eris { namespace market {
+
+/** Order book market with price-time priority matching.
+ *
+ * Firms participating in the market post asks (offers to sell a quantity of output at a given
+ * per-unit price) with ask(), and agents may post bids (offers to buy a quantity of output at up to
+ * a given per-unit price) with bid(); orders rest in the book until filled or cancelled, and carry
+ * over from one period to the next.  Orders at the same price are filled in the order in which they
+ * were posted.
+ *
+ * The market also works through the standard Market interface, so that existing buyers (such as
+ * eris::intraopt::MUPD) can trade in it: price(), quantity(), and reserve() price purchases against
+ * the ask book, as market orders that take the best available asks.  A reservation claims the
+ * specific asks (and quantities of them) that it was priced against, in price-time order; claimed
+ * quantities are unavailable to further reservations and to limit bids until the reservation is
+ * released or matched.  Buying a reservation escrows its payment as a market order, which is
+ * matched ahead of all limit bids against exactly the asks it claimed, so reservations get what
+ * they were priced at regardless of the order in which they are bought.  Part of the payment is
+ * refunded only if a claimed ask was cancelled, or its firm could not supply it, in the meantime.
+ *
+ * Matching happens in a single batch in the market's intraApply() (which has priority 1, so that
+ * it runs after buyers with default priority have bought their reservations), or immediately when
+ * buy() is called outside of that stage.  Trades take place at the ask price.  Asks are not
+ * escrowed: if a firm cannot supply an ask when it is matched, the ask is cancelled.
+ *
+ * Each side of the book is a vector of price levels sorted so that the best level is at the back
+ * (giving constant-time best-price access and removal), with the orders of each level in a FIFO
+ * queue.
+ */
+class OrderBook : public Market, public virtual intraopt::Apply {
+    public:
+        /// Constructs an order book market exchanging multiples of output_unit for price_unit.
+        OrderBook(Bundle output_unit, Bundle price_unit);
+
+        /// Identifier of an order in the book, returned by ask() and bid()
+        using order_id = unsigned long;
+
+        /** Posts an ask: an offer by a firm in this market to sell `q` units of output at `price`
+         * per unit.  Returns the order id, which can be passed to cancel().
+         *
+         * \throws std::invalid_argument if the firm is not a firm in this market, if `q` is not
+         * positive, or if `price` is negative.
+         */
+        order_id ask(SharedMember<Firm> firm, double price, double q);
+
+        /** Posts a bid: an offer by `agent` to buy `q` units of output at up to `price` per unit.
+         * The maximum payment, `price*q` units of price_unit, is removed from the agent's assets
+         * and held until the bid is filled (in which case any unspent amount is returned) or
+         * cancelled.  Returns the order id, which can be passed to cancel().
+         *
+         * \throws std::invalid_argument if `q` is not positive, or if `price` is negative.
+         * \throws Market::insufficient_assets if the agent's assets don't cover the payment.
+         */
+        order_id bid(SharedMember<Agent> agent, double price, double q);
+
+        /** Cancels the unfilled portion of an order.  For a bid, the unspent held payment is
+         * returned to the agent.  Returns false if there is no such order in the book (e.g.
+         * because it has already been filled or cancelled), true otherwise.
+         */
+        bool cancel(order_id order);
+
+        /// Returns the best (i.e. lowest) ask price, or NaN if there are no asks.
+        double bestAsk() const;
+
+        /// Returns the best (i.e. highest) bid price, or NaN if there are no bids.
+        double bestBid() const;
+
+        /// Returns the pricing information for purchasing q units from the ask book.
+        virtual price_info price(double q) const override;
+
+        /// Returns the quantity that p units of the price Bundle will purchase from the ask book.
+        virtual quantity_info quantity(double p) const override;
+
+        /// Returns a snapshot of the ask book, less any quantity claimed by reservations.
+        virtual std::shared_ptr<const Snapshot> snapshot() const override;
+
+        /// Reserves q units from the ask book, paying at most p_max for them.
+        virtual Reservation reserve(
+                SharedMember<Agent> agent,
+                double q,
+                double p_max = std::numeric_limits<double>::infinity()) override;
+
+        /** Buys a reservation by converting it (and its held payment) into a market order, which
+         * is matched immediately unless called during the intra-apply stage before this market's
+         * intraApply().
+         */
+        virtual void buy(Reservation &res) override;
+
+        /// Releases a reservation, returning the asks it claimed to the available book.
+        virtual void release(Reservation &res) override;
+
+        /// Removes a firm from this market, cancelling any of its asks.
+        virtual void removeFirm(id_t fid) override;
+
+        /// Matches crossing orders in the book.
+        virtual void intraApply() override;
+
+        /// Returns 1, so that matching happens after buyers (at the default priority) have bought.
+        virtual double intraApplyPriority() const override { return 1.0; }
+
+    protected:
+        /// A single order in the book
+        struct order {
+            /// The order's id
+            order_id id;
+            /// The firm (for asks) or agent (for bids) that posted the order
+            SharedMember<Agent> member;
+            /// The remaining, unfilled quantity of the order
+            double q;
+            /// The held payment of a bid (empty for asks)
+            Bundle escrow;
+            /// The part of `q` claimed by reservations (always 0 for bids)
+            double claimed = 0;
+        };
+
+        /// A price level of the book: the orders at a given price, in time priority
+        struct level {
+            /// The per-unit price of the orders at this level
+            double price;
+            /// The aggregate remaining quantity of the orders at this level
+            double q;
+            /// The orders at this level, earliest first
+            std::deque<order> orders;
+            /// The aggregate claimed quantity of the orders at this level
+            double claimed = 0;
+        };
+
+        /// A reservation's claim on part of an ask
+        struct claim {
+            /// The ask's order id
+            order_id ask;
+            /// The quantity of the ask claimed
+            double q;
+        };
+
+        /// A bought reservation waiting to be matched against the asks it claimed
+        struct market_order {
+            /// The agent that bought the reservation
+            SharedMember<Agent> member;
+            /// The reservation's held payment
+            Bundle escrow;
+            /// The asks claimed by the reservation
+            std::vector<claim> claims;
+        };
+
+        /// The ask levels, sorted by descending price, so that the lowest ask is at the back
+        std::vector<level> asks_;
+        /// The bid levels, sorted by ascending price, so that the highest bid is at the back
+        std::vector<level> bids_;
+        /// Bought reservations waiting to be matched, in the order in which they were bought
+        std::deque<market_order> market_orders_;
+        /// The claims of pending reservations, by reservation ledger slot
+        std::unordered_map<size_t, std::vector<claim>> claims_;
+
+        /** Matches market orders, then crossing limit bids, against the ask book. */
+        void match();
+
+    private:
+        // Walks the ask book from the best ask, and calls `f(price, q)` with the unclaimed quantity
+        // of each successive price level until `f` returns false.
+        template <typename F> void walkAsks(const F &f) const;
+
+        // Finds the order with the given id, setting `l` and `o` to its level and position in its
+        // book (`asks_` if `is_ask` is set to true, otherwise `bids_`).  Returns false if there is
+        // no such order.
+        bool findOrder(order_id id, bool &is_ask, std::vector<level>::iterator &l, std::deque<order>::iterator &o);
+
+        // Finds the best ask with unclaimed quantity, in price-time order.  Returns false if there
+        // isn't one.
+        bool bestUnclaimedAsk(std::vector<level>::iterator &l, std::deque<order>::iterator &o);
+
+        // Removes an ask from the book, along with its level if it was the last order there.
+        void removeAsk(std::vector<level>::iterator l, std::deque<order>::iterator o);
+
+        // Returns the position of the level with the given price in `book`, or the position at
+        // which such a level would be inserted.  `ascending` is true for bids.
+        static std::vector<level>::iterator findLevel(std::vector<level> &book, bool ascending, double price);
+
+        // The id to assign to the next order
+        order_id next_id_ = 1;
+        // Maps each order in the book to whether it is an ask and the price level it is in
+        std::unordered_map<order_id, std::pair<bool, double>> index_;
+
+        // Adds an order to the given side of the book.  `ascending` is true for bids.
+        order_id add(std::vector<level> &book, bool ascending, double price, order o);
+
+        // Removes the front order of the back (i.e. best) level of the given book
+        void popBest(std::vector<level> &book);
+
+        // Fills `q` units of the given ask at the ask price, paid from `escrow` and delivered to the
+        // buyer's assets.  Returns false (after cancelling the ask) if the firm cannot supply it.
+        bool fill(const SharedMember<Agent> &buyer, Bundle &escrow,
+                std::vector<level>::iterator l, std::deque<order>::iterator ask, double q);
+};
+
+} }
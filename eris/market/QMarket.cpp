@@ -1,8 +1,11 @@
 #include <eris/market/QMarket.hpp>
 #include <eris/firm/QFirm.hpp>
 #include <eris/algorithms.hpp>
-#include <unordered_map>
-#include <unordered_set>
+#include <eris/Simulation.hpp>
+#include <algorithm>
+#include <cmath>
+#include <exception>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -45,12 +48,19 @@ Market::quantity_info QMarket::quantity(double p) const {
     return { q, constrained, spent, p-spent };
 }
 
+std::shared_ptr<const Market::Snapshot> QMarket::snapshot() const {
+    return std::make_shared<const Snapshot>(std::vector<std::pair<double, double>>{
+            {price_, firmQuantities(std::numeric_limits<double>::infinity())}});
+}
+
 Market::Reservation QMarket::reserve(SharedMember<Agent> agent, double q, double p_max) {
-    std::vector<SharedMember<firm::QFirm>> supply;
+    // Lock the market, the agent, and the market's firms
+    std::vector<SharedMember<Member>> to_lock;
+    to_lock.push_back(agent);
     for (auto &sid : suppliers_) {
-        supply.push_back(simAgent<firm::QFirm>(sid));
+        to_lock.push_back(simAgent<firm::QFirm>(sid));
     }
-    auto lock = agent->writeLock(supply);
+    auto lock = writeLock(to_lock);
 
     double available = firmQuantities(q);
     if (q > available)
@@ -61,53 +71,59 @@ Market::Reservation QMarket::reserve(SharedMember<Agent> agent, double q, double
     if (not(agent->assets >= payment))
         throw insufficient_assets();
 
-    // Attempt to divide the purchase across all firms.  This might take more than one round,
-    // however, if an equal share would exhaust one or more firms' assets.
-    std::unordered_set<id_t> qfirm;
-
     Reservation res = createReservation(agent, q, q*price_);
 
-    std::unordered_map<id_t, BundleNegative> firm_transfers;
-
-    const double threshold = q * std::numeric_limits<double>::epsilon();
-
-    while (q > threshold) {
-        qfirm.clear();
-        double qmin = 0; // Will store the maximum quantity that all firms can supply
-        for (auto f : suppliers_) {
-            double qi = simAgent<firm::QFirm>(f)->assets.multiples(output_unit);
-            if (qi > 0) {
-                if (qi < qmin or qfirm.empty())
-                    qmin = qi;
-                qfirm.insert(f);
-            }
-        }
+    // Divide the purchase as evenly as possible across all firms with available output: sort
+    // firms by capacity, then give each firm (smallest first) either an equal share of what is
+    // left to supply or, if smaller, everything it has.
+    std::vector<std::pair<double, id_t>> capacity;
+    capacity.reserve(suppliers_.size());
+    for (auto f : suppliers_) {
+        double qi = simAgent<firm::QFirm>(f)->assets.multiples(output_unit);
+        if (qi > 0) capacity.emplace_back(qi, f);
+    }
 
-        if (qfirm.empty()) {
-            // This shouldn't happen, since firmQuantities said we had enough aggregate capacity!
-            throw output_infeasible();
-        }
+    if (capacity.empty()) {
+        // This shouldn't happen, since firmQuantities said we had enough aggregate capacity!
+        throw output_infeasible();
+    }
 
-        double qeach = qmin;
-        if (qeach*qfirm.size() > q) {
-            // No firm is constrained, so just divide everything still to be supplied evenly
-            qeach = q / qfirm.size();
-        }
-        // else one or more firm is constrained, so supply qmin then repeat the loop
+    std::sort(capacity.begin(), capacity.end());
 
-        BundleNegative transfer = qeach * (price_ * -price_unit + output_unit);
-        for (auto f : qfirm) {
-            firm_transfers[f] += transfer;
-            q -= qeach;
-        }
+    const BundleNegative unit_transfer = price_ * -price_unit + output_unit;
+    std::vector<std::pair<id_t, BundleNegative>> transfers;
+    transfers.reserve(capacity.size());
+    double q_left = q;
+    for (size_t i = 0; i < capacity.size() and q_left > 0; i++) {
+        double share = std::min(capacity[i].first, q_left / (capacity.size() - i));
+        q_left -= share;
+        transfers.emplace_back(capacity[i].second, share * unit_transfer);
     }
+    res.firmReserve(transfers);
 
-    for (auto &ft : firm_transfers)
-        res.firmReserve(ft.first, ft.second);
+    reserved_q_ += res.quantity();
 
     return res;
 }
 
+void QMarket::buy(Reservation &res) {
+    bool pending = res.state() == ReservationState::pending;
+    Market::buy(res);
+    if (pending) {
+        auto lock = writeLock();
+        reserved_q_ -= res.quantity();
+    }
+}
+
+void QMarket::release(Reservation &res) {
+    bool pending = res.state() == ReservationState::pending;
+    Market::release(res);
+    if (pending) {
+        auto lock = writeLock();
+        reserved_q_ -= res.quantity();
+    }
+}
+
 void QMarket::addFirm(SharedMember<Firm> f) {
     requireInstanceOf<firm::QFirm>(f, "Firm passed to QMarket.addFirm(...) is not a QFirm instance");
     Market::addFirm(f);
@@ -115,6 +131,7 @@ void QMarket::addFirm(SharedMember<Firm> f) {
 
 void QMarket::setPrice(double p) {
     price_ = p;
+    quotesChanged();
 }
 
 void QMarket::intraInitialize() {
@@ -127,11 +144,12 @@ bool QMarket::intraReoptimize() {
 
     unsigned int max_tries = first_period_ ? tries_first_ : tries_;
 
-    if (tried_ >= max_tries)
-
     // If we're all out of adjustments, don't change the price
     if (++tried_ > max_tries) return false;
 
+    // On the first try, jump straight to the clearing price if we can search demand for it
+    if (tried_ == 1 and demand_search_points > 1 and demandSearch()) return true;
+
     auto qlock = writeLock();
     double excess_capacity = firmQuantities();
 
@@ -156,6 +174,103 @@ bool QMarket::intraReoptimize() {
     return false;
 }
 
+bool QMarket::demandSearch() {
+    auto sim = simulation();
+    // Look for agents and other members (such as optimizers) that can report their demand:
+    // (The SharedMembers are held so that the members can't go away while we use them).
+    std::vector<SharedMember<Member>> members;
+    std::vector<const PriceTaker*> demanders;
+    // Returns false for an optimizer whose demand we can't find out
+    auto check = [&](SharedMember<Member> m) {
+        if (auto pt = dynamic_cast<const PriceTaker*>(m.get())) {
+            members.push_back(std::move(m));
+            demanders.push_back(pt);
+            return true;
+        }
+        return not dynamic_cast<const intraopt::Optimize*>(m.get());
+    };
+    for (auto &a : sim->agents()) { if (not check(a)) return false; }
+    for (auto &o : sim->others()) { if (not check(o)) return false; }
+    if (demanders.empty()) return false;
+
+    const unsigned int n = demand_search_points;
+    double supply, old_price;
+    {
+        auto lock = readLock();
+        // Total supply is what firms still have plus what is already reserved
+        supply = firmQuantities() + reserved_q_;
+        old_price = price_;
+    }
+
+    // The initial grid spreads prices geometrically from price/range to price*range
+    Eigen::VectorXd prices(n);
+    for (unsigned int i = 0; i < n; i++)
+        prices[i] = old_price * std::pow(demand_search_range, 2.0*i/(n-1) - 1.0);
+
+    // The demanders lock this (and other) markets while evaluating demand, so we mustn't hold a
+    // lock on the market here.
+    double new_price = old_price;
+    for (unsigned int round = 0; round < demand_search_rounds; round++) {
+        Eigen::VectorXd excess = aggregateDemand(demanders, prices).array() - supply;
+
+        // Find the first price at which there is no excess demand
+        unsigned int i = 0;
+        while (i < n and excess[i] > 0) i++;
+
+        if (i == 0 or i == n) {
+            // The clearing price is outside the grid, so go as far as we can; the stepper will take
+            // it from there.
+            new_price = prices[i == 0 ? 0 : n-1];
+            break;
+        }
+
+        // The clearing price is in (prices[i-1], prices[i]]: subdivide that for the next round
+        const double lo = prices[i-1], hi = prices[i];
+        new_price = hi;
+        if (hi / lo - 1.0 <= stepper.min_step) break;
+        for (unsigned int j = 0; j < n; j++)
+            prices[j] = lo * std::pow(hi / lo, j / (n - 1.0));
+    }
+
+    if (new_price == old_price) return false;
+    auto lock = writeLock();
+    setPrice(new_price);
+    return true;
+}
+
+Eigen::VectorXd QMarket::aggregateDemand(const std::vector<const PriceTaker*> &demanders, const Eigen::VectorXd &prices) const {
+    // Don't bother starting a thread for fewer than this many members:
+    constexpr size_t min_per_thread = 16;
+    const size_t threads = std::min<size_t>(simulation()->maxThreads(), demanders.size() / min_per_thread);
+
+    if (threads <= 1) {
+        Eigen::VectorXd total = Eigen::VectorXd::Zero(prices.size());
+        for (auto &d : demanders) total += d->demand(*this, prices);
+        return total;
+    }
+
+    std::vector<Eigen::VectorXd> partial(threads, Eigen::VectorXd::Zero(prices.size()));
+    std::vector<std::exception_ptr> error(threads);
+    auto work = [&](size_t t) {
+        try {
+            const size_t end = (t+1) * demanders.size() / threads;
+            for (size_t i = t * demanders.size() / threads; i < end; i++)
+                partial[t] += demanders[i]->demand(*this, prices);
+        }
+        catch (...) {
+            error[t] = std::current_exception();
+        }
+    };
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < threads; t++) workers.emplace_back(work, t);
+    work(0);
+    for (auto &w : workers) w.join();
+    for (auto &e : error) { if (e) std::rethrow_exception(e); }
+
+    for (size_t t = 1; t < threads; t++) partial[0] += partial[t];
+    return partial[0];
+}
+
 void QMarket::added() {
     Market::added();
     first_period_ = true;
@@ -2,7 +2,9 @@
 #include <eris/Optimize.hpp>
 #include <eris/Market.hpp>
 #include <eris/algorithms.hpp>
+#include <Eigen/Core>
 #include <limits>
+#include <vector>
 
 namespace eris { namespace market {
 
@@ -14,6 +16,11 @@ namespace eris { namespace market {
  * to find a (roughly) correct market price.  It relies on the quantity of market reservations made
  * in the intraOptimize() of other optimizers to try to determine the price that just exactly sells
  * out the market.
+ *
+ * Each of those steps requires a complete intra-period reoptimization by every agent.  When buyers
+ * can report their demand as a function of this market's price (by implementing
+ * QMarket::PriceTaker), the market can instead search for the clearing price directly: see
+ * `demand_search_points`.
  */
 class QMarket : public Market,
     public virtual intraopt::Initialize,
@@ -27,6 +34,35 @@ class QMarket : public Market,
         /// Default initial round repricing tries, if not given in constructor
         static constexpr unsigned int default_pricing_tries_first = 25;
 
+        /// Default number of prices evaluated in each round of a demand search
+        static constexpr unsigned int default_demand_search_points = 0;
+        /// Default relative range of the initial demand search price grid
+        static constexpr double default_demand_search_range = 4.0;
+        /// Default maximum number of demand search rounds
+        static constexpr unsigned int default_demand_search_rounds = 4;
+
+        /** Interface for simulation members (typically agents or their optimizers) that can report
+         * their demand in a QMarket at hypothetical prices, for use in a demand search.
+         *
+         * Implementing classes should inherit from this class as `public virtual`.
+         *
+         * \sa demand_search_points
+         */
+        class PriceTaker {
+            public:
+                /** Returns the total quantity (as a multiple of the market's output_unit) that the
+                 * member would want to buy in `market` at each of the given per-unit prices, holding
+                 * everything else (such as prices in other markets) fixed.  The returned vector
+                 * must be the same size as `prices`, and demand should be (weakly) decreasing in
+                 * price.  This may be called simultaneously for different members from multiple
+                 * threads.
+                 */
+                virtual Eigen::VectorXd demand(const QMarket &market, const Eigen::VectorXd &prices) const = 0;
+            protected:
+                /// Protected destructor: object destruction via the interface is not permitted.
+                ~PriceTaker() = default;
+        };
+
         /** Constructs a new quantity market, with a specified unit of output and unit of input
          * (price) per unit of output.
          *
@@ -78,6 +114,11 @@ class QMarket : public Market,
          */
         virtual Market::quantity_info quantity(double p) const override;
 
+        /** Returns a snapshot of the market's supply: the total quantity available from the
+         * market's firms, at the current market price.
+         */
+        virtual std::shared_ptr<const Snapshot> snapshot() const override;
+
         /** Queries the available assets of each firm participating in this market for available
          * quantities of the output bundle and returns the aggregate quantity.  If the optional
          * parameter max is specified, this will stop calculating when at least max units of output
@@ -137,6 +178,35 @@ class QMarket : public Market,
          */
         Stepper stepper {Stepper::default_initial_step, Stepper::default_increase_count, 1.0/65536.0};
 
+        /** If greater than 1, the first intraReoptimize() of each period searches for a clearing
+         * price using the demand reported by the simulation's QMarket::PriceTaker members (if there
+         * are any) instead of taking a single step.  Aggregate demand is evaluated at this many
+         * prices spread geometrically over [p/r, p*r], where p is the current price and r is
+         * `demand_search_range`; the interval in which excess demand becomes non-positive is then
+         * subdivided into the same number of prices for up to `demand_search_rounds` rounds (or
+         * until it is narrower than the stepper's minimum step).  The market price is then set to
+         * the lowest price found with non-positive excess demand, after which any remaining
+         * pricing tries adjust it with the stepper as usual.
+         *
+         * Demand is evaluated in a single vectorized call per member and round, spread across up to
+         * Simulation::maxThreads() threads, without holding a lock on the market.  The search is
+         * skipped (leaving the price to the stepper) if any agent or other member of the simulation
+         * is an intra-period optimizer (i.e. an intraopt::Optimize) that isn't a PriceTaker: such
+         * a member might buy in this market, but has no way to report its demand, so leaving it out
+         * would bias the price downwards.  The default, 0, disables the demand search.
+         */
+        unsigned int demand_search_points = default_demand_search_points;
+        /// The relative range of the initial demand search price grid; must be greater than 1.
+        double demand_search_range = default_demand_search_range;
+        /// The maximum number of rounds of a demand search.
+        unsigned int demand_search_rounds = default_demand_search_rounds;
+
+        /// Completes a reservation.
+        virtual void buy(Reservation &res) override;
+
+        /// Releases a reservation.
+        virtual void release(Reservation &res) override;
+
     protected:
         /// The current price of the good as a multiple of price_unit
         double price_;
@@ -158,6 +228,24 @@ class QMarket : public Market,
         /// Tracks whether this is the first period or not
         bool first_period_ = true;
 
+        /// The quantity reserved by current pending reservations
+        double reserved_q_ = 0.0;
+
+        /** Performs a demand search, as described in `demand_search_points`, and updates the price
+         * accordingly.  Returns true if the price was changed, false if unchanged (or if there are
+         * no PriceTaker members in the simulation, or there are optimizers that aren't PriceTakers).
+         *
+         * This must be called without holding a lock on the market: PriceTaker members generally
+         * need to lock it (and other markets) to evaluate their demand, and may do so from other
+         * threads.
+         */
+        virtual bool demandSearch();
+
+        /** Returns the aggregate demand of the given members at each of the given prices.  The
+         * members are split across up to Simulation::maxThreads() threads.
+         */
+        Eigen::VectorXd aggregateDemand(const std::vector<const PriceTaker*> &demanders, const Eigen::VectorXd &prices) const;
+
         /// Resets first_period_ to true when added to a simulation.
         virtual void added() override;
 };
@@ -0,0 +1,127 @@
+// Benchmarks the core Bundle operations over a range of bundle sizes and good overlap patterns.
+//
+// Output is CSV (one line per operation/size/overlap combination) to make it easy to compare runs
+// before and after changes to Bundle.
+#include <eris/Bundle.hpp>
+#include <eris/random/rng.hpp>
+#include <boost/random/uniform_int_distribution.hpp>
+#include <iostream>
+#include <functional>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdlib>
+
+using eris::Bundle;
+using eris::BundleSigned;
+
+using clk = std::chrono::high_resolution_clock;
+using dur = std::chrono::duration<double>;
+
+// Accumulate results here, so that they can't be compiled away:
+double garbage = 0.0;
+// Runs code for at least the given time; returns the number of times run, and the total runtime.
+std::pair<long, double> bench(const std::function<double()> &f, double at_least) {
+    auto start = clk::now();
+    std::pair<long, double> results;
+    int increment = 5;
+    do {
+        increment *= 2;
+        for (int i = 0; i < increment; i++) {
+            garbage += f();
+        }
+        results.second = dur(clk::now() - start).count();
+        results.first += increment;
+    } while (results.second < at_least);
+
+    return results;
+}
+
+// Good ids are drawn randomly (rather than sequentially) so that the hash table layout resembles
+// that of a simulation with many members.
+std::vector<eris::id_t> random_ids(size_t n) {
+    boost::random::uniform_int_distribution<eris::id_t> id_dist(1, 1000000000);
+    std::vector<eris::id_t> ids;
+    ids.reserve(n);
+    for (size_t i = 0; i < n; i++) ids.push_back(id_dist(eris::random::rng()));
+    return ids;
+}
+
+// Quantities are small integers so that the add/subtract round trips below are exact.
+Bundle make_bundle(const std::vector<eris::id_t> &ids) {
+    Bundle b;
+    double q = 1;
+    for (auto &g : ids) { b.set(g, q); q = q >= 64 ? 1 : q + 1; }
+    return b;
+}
+
+int main(int argc, char *argv[]) {
+    double at_least = 0.1;
+    if (argc > 2 or (argc == 2 and (at_least = std::atof(argv[1])) <= 0)) {
+        std::cerr << "Usage: " << argv[0] << " [SECONDS]\n\n" <<
+            "Runs each benchmark for at least SECONDS (default 0.1) seconds and prints the results as CSV.\n";
+        return 1;
+    }
+
+    std::cout << "operation,size,overlap,iterations,seconds,ns_per_call\n";
+
+    for (size_t size : {1, 3, 10, 30, 100, 300, 1000}) {
+        auto a_ids = random_ids(size);
+        // The overlap patterns determine which goods the second bundle shares with the first: all of
+        // them, half of them, or none of them.
+        for (std::string overlap : {"full", "half", "none"}) {
+            std::vector<eris::id_t> b_ids;
+            if (overlap == "full") b_ids = a_ids;
+            else if (overlap == "half") {
+                b_ids.insert(b_ids.end(), a_ids.begin(), a_ids.begin() + size/2);
+                auto extra = random_ids(size - size/2);
+                b_ids.insert(b_ids.end(), extra.begin(), extra.end());
+            }
+            else b_ids = random_ids(size);
+
+            Bundle a = make_bundle(a_ids), b = make_bundle(b_ids);
+            BundleSigned as = a, bs = b;
+            Bundle big = (a + b) * 1000;
+            Bundle other;
+
+            auto run = [&](const std::string &name, const std::function<double()> &f) {
+                auto r = bench(f, at_least);
+                std::cout << name << "," << size << "," << overlap << "," << r.first << "," << r.second << "," <<
+                    1e9 * r.second / r.first << "\n";
+            };
+
+            // Single-bundle operations don't depend on the overlap pattern, so only run them once
+            if (overlap == "full") {
+                run("set", [&]() { Bundle x; for (auto &g : a_ids) x.set(g, 2.0); return x.size(); });
+                run("set_signed", [&]() { BundleSigned x; for (auto &g : a_ids) x.set(g, -2.0); return x.size(); });
+                run("index_const", [&]() { double s = 0; const Bundle &ca = a; for (auto &g : a_ids) s += ca[g]; return s; });
+                run("index_proxy", [&]() { for (auto &g : a_ids) { a[g] += 1; a[g] -= 1; } return a.size(); });
+                run("iterate", [&]() { double s = 0; for (auto &g : a) s += g.second; return s; });
+                run("copy", [&]() { Bundle x(a); return x.size(); });
+                run("scale", [&]() { a *= 2; a /= 2; return a.size(); });
+                run("transaction_commit", [&]() { a.beginTransaction(); a.set(a_ids[0], 3); a.commitTransaction(); return a.size(); });
+                run("transaction_abort", [&]() { a.beginTransaction(); a.set(a_ids[0], 3); a.abortTransaction(); return a.size(); });
+                run("compare_constant", [&]() { return (a >= 0) + (a > 1000); });
+                run("positive", [&]() { return bs.positive().size(); });
+            }
+
+            run("add_subtract", [&]() { a += b; a -= b; return a.size(); });
+            run("add_subtract_signed", [&]() { as += bs; as -= bs; return as.size(); });
+            run("plus", [&]() { return (a + b).size(); });
+            run("transfer", [&]() { big.transfer(b, other); other.transfer(b, big); return big.size(); });
+            run("transfer_many", [&]() {
+                    BundleSigned::transferMany({{big, other, b}, {other, big, b}});
+                    return big.size(); });
+            run("coverage", [&]() { return a.coverage(b); });
+            run("multiples", [&]() { return a.multiples(b); });
+            run("common", [&]() { return Bundle::common(a, b).size(); });
+            run("reduce", [&]() { Bundle r = Bundle::reduce(a, b); a += r; b += r; return r.size(); });
+            run("compare_eq", [&]() { return a == b; });
+            run("compare_ge", [&]() { return a >= b; });
+            run("compare_lt", [&]() { return a < b; });
+        }
+    }
+
+    // Print garbage to stderr so that the calculations can't be optimized away
+    std::cerr << "(ignore: " << garbage << ")\n";
+}
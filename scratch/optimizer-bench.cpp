@@ -0,0 +1,255 @@
+// Benchmarks the intra-period consumer optimizers (MUPD, ProjectedNewton, and IncrementalBuyer) in
+// synthetic economies over a range of numbers of goods, market types, and thread counts.
+//
+// Output is CSV (one line per optimizer/market type/goods/threads combination) to make it easy to
+// compare runs before and after changes to the optimizers.  Besides timings, each line reports the
+// number of market price/quantity queries, utility evaluations, derivative evaluations and (for
+// ProjectedNewton) Newton iterations per solve, where a solve is one intraOptimize() call.  With
+// QMarkets, each period involves several solves per consumer as the markets search for prices.
+//
+// Each thread runs its own, identical economy, so with perfect scaling solves_per_second grows in
+// proportion to the number of threads.
+#include <eris/Simulation.hpp>
+#include <eris/Good.hpp>
+#include <eris/consumer/CobbDouglas.hpp>
+#include <eris/intraopt/MUPD.hpp>
+#include <eris/intraopt/ProjectedNewton.hpp>
+#include <eris/intraopt/IncrementalBuyer.hpp>
+#include <eris/market/Bertrand.hpp>
+#include <eris/market/QMarket.hpp>
+#include <eris/firm/PriceFirm.hpp>
+#include <eris/firm/QFirm.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace eris;
+using namespace eris::consumer;
+using namespace eris::intraopt;
+
+using clk = std::chrono::high_resolution_clock;
+using dur = std::chrono::duration<double>;
+
+// Counts for a single benchmark economy.  Each economy runs in a single thread, so these don't need
+// any synchronization.
+struct counters {
+    long solves = 0, solve_ns = 0, queries = 0, utility = 0, derivatives = 0, iterations = 0;
+
+    counters& operator+=(const counters &c) {
+        solves += c.solves; solve_ns += c.solve_ns; queries += c.queries;
+        utility += c.utility; derivatives += c.derivatives; iterations += c.iterations;
+        return *this;
+    }
+};
+
+// Market that counts calls to price() and quantity() (but not calls answered from the market's
+// cache or from a snapshot, since those don't need the market's supply to be recalculated).
+template <class M>
+class CountingMarket : public M {
+    public:
+        template <typename... Args>
+        CountingMarket(counters *c, Args&&... args) : M(std::forward<Args>(args)...), c_(c) {}
+        using M::price;
+        Market::price_info price(double q) const override { ++c_->queries; return M::price(q); }
+        Market::quantity_info quantity(double p) const override { ++c_->queries; return M::quantity(p); }
+    private:
+        counters *c_;
+};
+
+// Cobb-Douglas consumer that counts utility and derivative evaluations.  The counts include calls
+// made internally, e.g. by gradientVector() calling utility().
+class CountingCobbDouglas : public CobbDouglas {
+    public:
+        CountingCobbDouglas(counters *c, const std::unordered_map<eris::id_t, double> &exps) : CobbDouglas(exps), c_(c) {}
+        double utility(const BundleNegative &b) const override {
+            ++c_->utility; return CobbDouglas::utility(b); }
+        Eigen::VectorXd utilityBatch(const BundleNegative &base, const std::vector<eris::id_t> &goods,
+                const Eigen::MatrixXd &deltas) const override {
+            c_->utility += deltas.cols(); return CobbDouglas::utilityBatch(base, goods, deltas); }
+        double d(const BundleNegative &b, MemberID g) const override {
+            ++c_->derivatives; return CobbDouglas::d(b, g); }
+        double d2(const BundleNegative &b, MemberID g1, MemberID g2) const override {
+            ++c_->derivatives; return CobbDouglas::d2(b, g1, g2); }
+        Eigen::VectorXd gradientVector(const std::vector<eris::id_t> &g, const BundleNegative &b) const override {
+            ++c_->derivatives; return CobbDouglas::gradientVector(g, b); }
+        Eigen::MatrixXd hessianMatrix(const std::vector<eris::id_t> &g, const BundleNegative &b) const override {
+            ++c_->derivatives; return CobbDouglas::hessianMatrix(g, b); }
+    private:
+        counters *c_;
+};
+
+// QFirm leaves canProduceAny to subclasses; this one can't produce anything mid-period
+class BenchQFirm : public firm::QFirm {
+    public:
+        using QFirm::QFirm;
+        double canProduceAny(const Bundle&) const override { return 0; }
+};
+
+unsigned int iterations(const ProjectedNewton &opt) { return opt.iterations(); }
+template <class O> unsigned int iterations(const O&) { return 0; }
+
+// Optimizer that times and counts its intraOptimize() calls
+template <class O>
+class TimedOptimizer : public O {
+    public:
+        template <typename... Args>
+        TimedOptimizer(counters *c, Args&&... args) : O(std::forward<Args>(args)...), c_(c) {}
+        void intraOptimize() override {
+            auto start = clk::now();
+            O::intraOptimize();
+            c_->solve_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(clk::now() - start).count();
+            ++c_->solves;
+            c_->iterations += iterations(static_cast<const O&>(*this));
+        }
+    private:
+        counters *c_;
+};
+
+using spawner = std::function<void(Simulation&, counters*, const SharedMember<CountingCobbDouglas>&, const SharedMember<Good>&)>;
+struct optimizer {
+    std::string name;
+    spawner spawn;
+    bool has_iterations;
+};
+
+template <class O>
+spawner mupd_spawner(bool analytic) {
+    return [analytic](Simulation &sim, counters *c, const SharedMember<CountingCobbDouglas> &con, const SharedMember<Good> &money) {
+        auto opt = sim.spawn<TimedOptimizer<O>>(c, con, money);
+        opt->analytic_demand = analytic;
+    };
+}
+
+spawner incremental_spawner(bool lazy) {
+    return [lazy](Simulation &sim, counters *c, const SharedMember<CountingCobbDouglas> &con, const SharedMember<Good> &money) {
+        auto opt = sim.spawn<TimedOptimizer<IncrementalBuyer>>(c, *con, money->id());
+        opt->lazy(lazy);
+    };
+}
+
+// Builds an economy with the given number of consumers, each using the given optimizer, in which
+// each good is sold in a Bertrand market (with a fixed-price firm), a QMarket (with a fixed-capacity
+// firm), or both.  Firm supply only changes through the Firm interface, so the markets can cache
+// quotes.  Returns the consumers.
+std::vector<SharedMember<CountingCobbDouglas>> build(Simulation &sim, counters *c, const optimizer &opt,
+        const std::string &markets, int goods, int consumers, double income, SharedMember<Good> &money) {
+    money = sim.spawn<Good>("money");
+    Bundle m1(money, 1);
+
+    std::vector<SharedMember<Good>> good;
+    for (int i = 0; i < goods; i++) {
+        good.push_back(sim.spawn<Good>("g" + std::to_string(i)));
+        Bundle g1(good.back(), 1);
+        double price = 1 + i % 4;
+        if (markets != "qmarket") {
+            auto mkt = sim.spawn<CountingMarket<market::Bertrand>>(c, g1, m1);
+            mkt->cache_quotes = true;
+            mkt->addFirm(sim.spawn<firm::PriceFirm>(g1, price * m1));
+        }
+        if (markets != "bertrand") {
+            auto mkt = sim.spawn<CountingMarket<market::QMarket>>(c, g1, m1, price);
+            mkt->cache_quotes = true;
+            mkt->addFirm(sim.spawn<BenchQFirm>(g1, consumers * income / goods / price));
+        }
+    }
+
+    // Exponents vary (deterministically) across goods and consumers
+    std::vector<SharedMember<CountingCobbDouglas>> cons;
+    for (int j = 0; j < consumers; j++) {
+        std::unordered_map<eris::id_t, double> exps;
+        for (int i = 0; i < goods; i++)
+            exps[good[i]->id()] = 1 + 0.25 * ((7*j + 3*i) % 5);
+        cons.push_back(sim.spawn<CountingCobbDouglas>(c, exps));
+        opt.spawn(sim, c, cons.back(), money);
+    }
+    return cons;
+}
+
+int main(int argc, char *argv[]) {
+    int consumers = 10, periods = 2;
+    unsigned long max_threads = std::thread::hardware_concurrency();
+    if (argc > 4 or
+            (argc > 1 and (consumers = std::atoi(argv[1])) <= 0) or
+            (argc > 2 and (periods = std::atoi(argv[2])) <= 0) or
+            (argc > 3 and (max_threads = std::strtoul(argv[3], nullptr, 10)) == 0)) {
+        std::cerr << "Usage: " << argv[0] << " [CONSUMERS [PERIODS [MAX_THREADS]]]\n\n" <<
+            "Runs PERIODS (default 2) periods of an economy with CONSUMERS (default 10) Cobb-Douglas\n" <<
+            "consumers for each combination of optimizer, market type, and number of goods, and\n" <<
+            "prints the results as CSV.  Each combination is repeated with 1, 2, 4, ... (up to\n" <<
+            "MAX_THREADS, which defaults to the number of hardware threads) copies of the economy,\n" <<
+            "each run in its own thread.\n";
+        return 1;
+    }
+    if (max_threads == 0) max_threads = 1;
+
+    std::vector<unsigned long> thread_counts;
+    for (unsigned long t = 1; t <= max_threads; t *= 2) thread_counts.push_back(t);
+
+    const std::vector<optimizer> optimizers{
+        {"mupd", mupd_spawner<MUPD>(true), false},
+        {"mupd_numeric", mupd_spawner<MUPD>(false), false},
+        {"newton", mupd_spawner<ProjectedNewton>(true), true},
+        {"newton_numeric", mupd_spawner<ProjectedNewton>(false), true},
+        {"incremental", incremental_spawner(false), false},
+        {"incremental_lazy", incremental_spawner(true), false},
+    };
+
+    const double income = 100;
+
+    std::cout << "optimizer,markets,goods,consumers,threads,periods,solves,seconds,solves_per_second," <<
+        "us_per_solve,queries_per_solve,utility_per_solve,derivatives_per_solve,iterations_per_solve\n";
+
+    for (auto &opt : optimizers) {
+        // "both" sells each good in both a Bertrand market and a QMarket
+        for (std::string markets : {"bertrand", "qmarket", "both"}) {
+            // MUPD converges very slowly when each good has both a fixed-price and a quantity market
+            // (minutes per solve with 10 goods), so that combination is limited to fewer goods.
+            for (int goods : markets == "both" ? std::vector<int>{2, 5} : std::vector<int>{2, 5, 10}) {
+                for (auto threads : thread_counts) {
+                    // Threads run separate economies (each with maxThreads() of 0) rather than
+                    // sharing one multithreaded simulation, so that the results reflect the
+                    // optimizers themselves rather than contention for market and firm locks.
+                    std::vector<counters> counts(threads);
+                    std::vector<std::shared_ptr<Simulation>> sims;
+                    std::vector<std::vector<SharedMember<CountingCobbDouglas>>> cons;
+                    std::vector<SharedMember<Good>> money(threads);
+                    for (unsigned long t = 0; t < threads; t++) {
+                        sims.push_back(Simulation::create());
+                        cons.push_back(build(*sims[t], &counts[t], opt, markets, goods, consumers, income, money[t]));
+                    }
+
+                    double seconds = 0;
+                    for (int p = 0; p < periods; p++) {
+                        // Start each period with just income, so that every period is comparable
+                        for (unsigned long t = 0; t < threads; t++) {
+                            for (auto &con : cons[t]) {
+                                con->assets.clear();
+                                con->assets[money[t]] = income;
+                            }
+                        }
+                        auto start = clk::now();
+                        std::vector<std::thread> pool;
+                        for (auto &sim : sims) pool.emplace_back([&sim] { sim->run(); });
+                        for (auto &thr : pool) thr.join();
+                        seconds += dur(clk::now() - start).count();
+                    }
+
+                    counters c;
+                    for (auto &ct : counts) c += ct;
+                    double solves = c.solves;
+                    std::cout << opt.name << "," << markets << "," << goods << "," << consumers << "," <<
+                        threads << "," << periods << "," << c.solves << "," << seconds << "," <<
+                        solves / seconds << "," << 1e-3 * c.solve_ns / solves << "," <<
+                        c.queries / solves << "," << c.utility / solves << "," << c.derivatives / solves << ",";
+                    if (opt.has_iterations) std::cout << c.iterations / solves;
+                    std::cout << "\n" << std::flush;
+                }
+            }
+        }
+    }
+}
@@ -584,11 +584,12 @@ TEST(Transactions, Automatic) {
     Bundle b2 {{1, 2}, {2, 5}};
     Bundle b3 {{1, 4}, {2, 3}};
 
-    // First turn off transactions, and make sure we actually get the partially-subtracted result
+    // First turn off transactions: the new values are validated before anything is changed, so
+    // b1 still shouldn't change.
     b1.beginEncompassing();
     EXPECT_THROW(b1 -= b2, Bundle::negativity_error);
     EXPECT_THROW(b1 -= b3, Bundle::negativity_error);
-    EXPECT_TRUE((b1 == Bundle({{1, 1}, {2, 4}})) or (b1 == Bundle({{1, 3}, {2, 1}})));
+    EXPECT_EQ(b1_orig, b1);
     b1.endEncompassing();
 
     b1 = b1_orig;
@@ -770,6 +771,24 @@ TEST(Modification, erase) {
     EXPECT_TRUE(a2.empty());
 
 }
+TEST(Modification, assign) {
+    Bundle a {{1, 1}, {2, 2}};
+    std::vector<std::pair<eris::id_t, double>> vals {{2, 4}, {3, 0.5}};
+    a.assign(vals.begin(), vals.end());
+    EXPECT_EQ(Bundle({{1, 1}, {2, 4}, {3, 0.5}}), a);
+
+    a.assign(BundleNegative {{1, 8}});
+    EXPECT_EQ(Bundle({{1, 8}, {2, 4}, {3, 0.5}}), a);
+
+    // Nothing should change if any value is negative
+    vals = {{1, 3}, {4, -1}};
+    EXPECT_THROW(a.assign(vals), Bundle::negativity_error);
+    EXPECT_EQ(Bundle({{1, 8}, {2, 4}, {3, 0.5}}), a);
+
+    BundleNegative n;
+    n.assign(vals);
+    EXPECT_EQ(BundleNegative({{1, 3}, {4, -1}}), n);
+}
 TEST(Modification, remove) {
     GIMME_BUNDLES;
 
@@ -1025,6 +1044,95 @@ TEST(AlgebraicModifiers, TransferApprox) {
     EXPECT_FALSE(ha.hasApprox(ht, hb, .00001));
 }
 
+TEST(AlgebraicModifiers, TransferMany) {
+    Bundle a {{1, 10}, {2, 999}};
+    Bundle b {{1, 4}};
+    Bundle c;
+    BundleNegative s {{2, -5}};
+
+    // b pays 8 of good 1 to c, a pays 10 of good 1 to b; b only ends up non-negative because of the
+    // second transfer, which is fine for a batch transfer.  Good 2 triggers the epsilon handling.
+    auto done = BundleNegative::transferMany({
+            {b, c, Bundle {{1, 8}}},
+            {a, b, BundleNegative {{1, 10}, {2, 1000}}},
+            {s, c, BundleNegative {{2, 3}}}}, 1.5e-3);
+
+    ASSERT_EQ(3u, done.size());
+    EXPECT_EQ(BundleNegative({{1, 8}}), done[0]);
+    EXPECT_EQ(BundleNegative({{1, 10}, {2, 999}}), done[1]);
+    EXPECT_EQ(BundleNegative({{2, 3}}), done[2]);
+
+    EXPECT_EQ(0, a.size());
+    EXPECT_EQ(Bundle({{1, 6}, {2, 999}}), b);
+    EXPECT_EQ(Bundle({{1, 8}, {2, 3}}), c);
+    EXPECT_EQ(BundleNegative({{2, -8}}), s);
+
+    // A batch that would leave a Bundle negative shouldn't change anything at all
+    Bundle a2 {{1, 3}}, b2 {{1, 1}}, c2;
+    EXPECT_THROW(BundleNegative::transferMany({
+                {a2, c2, Bundle {{1, 3}}},
+                {b2, c2, Bundle {{1, 2}}}}),
+            Bundle::negativity_error);
+    EXPECT_EQ(Bundle({{1, 3}}), a2);
+    EXPECT_EQ(Bundle({{1, 1}}), b2);
+    EXPECT_EQ(0, c2.size());
+}
+
+TEST(AlgebraicModifiers, Version) {
+    Bundle a {{1, 10}}, b;
+    auto v = a.version();
+
+    // Reading doesn't change the version:
+    EXPECT_EQ(10, a[1]);
+    EXPECT_EQ(Bundle({{1, 10}}), a);
+    EXPECT_EQ(v, a.version());
+
+    // Every kind of modification does:
+    a[1] = 5;
+    EXPECT_GT(a.version(), v); v = a.version();
+    a += Bundle {{2, 1}};
+    EXPECT_GT(a.version(), v); v = a.version();
+    a *= 2;
+    EXPECT_GT(a.version(), v); v = a.version();
+    a.transfer(Bundle {{1, 1}}, b);
+    EXPECT_GT(a.version(), v); v = a.version();
+    BundleNegative::transferMany({{a, b, Bundle {{2, 1}}}});
+    EXPECT_GT(a.version(), v); v = a.version();
+    a.beginTransaction();
+    a[1] = 100;
+    a.abortTransaction();
+    EXPECT_EQ(9, a[1]);
+    EXPECT_GT(a.version(), v); v = a.version();
+    a = Bundle {{3, 1}};
+    EXPECT_GT(a.version(), v); v = a.version();
+    a.clear();
+    EXPECT_GT(a.version(), v);
+}
+
+TEST(AlgebraicModifiers, VersionEpoch) {
+    std::atomic<unsigned long> epoch{0};
+    Bundle a {{1, 10}}, b;
+    a.versionEpoch(&epoch);
+    b.versionEpoch(&epoch);
+
+    a[1] = 5;
+    EXPECT_EQ(1u, epoch);
+    auto e = epoch.load(), va = a.version(), vb = b.version();
+    a.transfer(Bundle {{1, 1}}, b);
+    // Both bundles advance the shared epoch:
+    EXPECT_EQ(e + (a.version() - va) + (b.version() - vb), epoch);
+    e = epoch;
+
+    // The epoch isn't copied:
+    Bundle c(a);
+    c[1] = 1;
+    EXPECT_EQ(e, epoch);
+
+    a.versionEpoch(nullptr);
+    a[1] = 1;
+    EXPECT_EQ(e, epoch);
+}
+
 TEST(AdvancedAlgebra, BundleCoverage) {
     COMPARE_BUNDLES;
 
@@ -0,0 +1,313 @@
+// Tests for consumer utility functions and their derivatives.
+
+#include "sim-fixture.hpp"
+#include <eris/consumer/AutoDiff.hpp>
+#include <eris/consumer/CobbDouglas.hpp>
+#include <eris/consumer/Compound.hpp>
+#include <eris/consumer/Polynomial.hpp>
+#include <eris/consumer/Quadratic.hpp>
+#include <eris/intraopt/ProjectedNewton.hpp>
+#include <eris/market/Bertrand.hpp>
+#include <eris/firm/PriceFirm.hpp>
+#include <cmath>
+#include <limits>
+
+using namespace eris;
+using namespace eris::consumer;
+using namespace eris::intraopt;
+
+class ConsumerTest : public SimFixture {};
+
+TEST_F(ConsumerTest, AnalyticDemand) {
+    auto y = sim->spawn<Good>("y");
+    std::vector<eris::id_t> goods{x->id(), y->id()};
+    Eigen::VectorXd prices(2), q;
+    prices << 1, 2;
+
+    auto cd = sim->spawn<CobbDouglas>(x->id(), 1.0, y->id(), 3.0);
+    ASSERT_TRUE(cd->demand(Bundle(), goods, prices, 20, q));
+    EXPECT_DOUBLE_EQ(5, q[0]);
+    EXPECT_DOUBLE_EQ(7.5, q[1]);
+    // With enough y already, all income goes on x
+    ASSERT_TRUE(cd->demand(Bundle(y, 30), goods, prices, 20, q));
+    EXPECT_DOUBLE_EQ(20, q[0]);
+    EXPECT_DOUBLE_EQ(0, q[1]);
+    // With a bit less, some y is still bought
+    ASSERT_TRUE(cd->demand(Bundle(y, 25), goods, prices, 20, q));
+    EXPECT_DOUBLE_EQ(17.5, q[0]);
+    EXPECT_DOUBLE_EQ(1.25, q[1]);
+    // Utility is always 0 without z
+    auto z = sim->spawn<Good>("z");
+    cd->exp(z) = 1;
+    EXPECT_FALSE(cd->demand(Bundle(), goods, prices, 20, q));
+    EXPECT_THROW(cd->demand(Bundle(), goods, Eigen::VectorXd::Ones(3), 20, q), std::invalid_argument);
+
+    auto quad = sim->spawn<Quadratic>();
+    quad->coef(money) = 1;
+    quad->coef(x) = 10;
+    quad->coef(y) = 8;
+    quad->coef(x, x) = -1;
+    quad->coef(y, y) = -0.5;
+    quad->coef(x, y) = -0.5;
+    goods.insert(goods.begin(), money->id());
+    Eigen::VectorXd prices3(3);
+    prices3 << 1, 1, 2;
+    // MU/$ is 1 in every market: 10 - 2x - y/2 = 1, (8 - y - x/2)/2 = 1
+    ASSERT_TRUE(quad->demand(Bundle(), goods, prices3, 100, q));
+    EXPECT_NEAR(88, q[0], 1e-12);
+    EXPECT_NEAR(24./7, q[1], 1e-12);
+    EXPECT_NEAR(30./7, q[2], 1e-12);
+    // Already holding 5 x, more x isn't worth buying at all:
+    ASSERT_TRUE(quad->demand(Bundle(x, 5), goods, prices3, 100, q));
+    EXPECT_NEAR(93, q[0], 1e-12);
+    EXPECT_EQ(0, q[1]);
+    EXPECT_NEAR(3.5, q[2], 1e-12);
+    // Convex utility has no interior maximum
+    quad->coef(x, x) = 1;
+    EXPECT_FALSE(quad->demand(Bundle(), goods, prices3, 100, q));
+}
+
+TEST_F(ConsumerTest, DenseDerivatives) {
+    auto y = sim->spawn<Good>("y");
+    auto z = sim->spawn<Good>("z");
+    auto w = sim->spawn<Good>("w"); // Not in the utility function
+    std::vector<eris::id_t> goods{x->id(), y->id(), z->id(), w->id(), x->id()};
+
+    auto quad = sim->spawn<Quadratic>();
+    quad->coef(x) = 3;
+    quad->coef(y) = -1;
+    quad->coef(x, x) = -0.5;
+    quad->coef(x, y) = 2;
+    quad->coef(y, z) = -1.5;
+    quad->coef(z, z) = 0.25;
+
+    auto poly = sim->spawn<Polynomial>();
+    poly->coef(x, 1) = 2;
+    poly->coef(x, 3) = -1;
+    poly->coef(z, 2) = 4;
+
+    auto cd = sim->spawn<CobbDouglas>(x->id(), 0.5, y->id(), 2.0, z->id(), 1.5, 3.0);
+
+    BundleNegative interior, boundary;
+    interior.set(x, 1.5);
+    interior.set(y, 2.0);
+    interior.set(z, 0.5);
+    boundary = interior;
+    boundary.erase(y);
+    std::vector<SharedMember<Consumer::Differentiable>> consumers{quad, poly, cd};
+    for (auto &con : consumers) {
+        for (auto &b : {interior, boundary}) {
+            auto grad = con->gradientVector(goods, b);
+            auto hess = con->hessianMatrix(goods, b);
+            ASSERT_EQ(goods.size(), (size_t) grad.size());
+            ASSERT_EQ(goods.size(), (size_t) hess.rows());
+            ASSERT_EQ(goods.size(), (size_t) hess.cols());
+            for (size_t i = 0; i < goods.size(); i++) {
+                EXPECT_NEAR(con->d(b, goods[i]), grad[i], 1e-12);
+                for (size_t j = 0; j < goods.size(); j++)
+                    EXPECT_NEAR(con->d2(b, goods[i], goods[j]), hess(i, j), 1e-12);
+            }
+        }
+    }
+}
+
+TEST_F(ConsumerTest, UtilityBatch) {
+    auto y = sim->spawn<Good>("y");
+    auto z = sim->spawn<Good>("z");
+    auto w = sim->spawn<Good>("w"); // Not in the utility functions
+    std::vector<eris::id_t> goods{x->id(), y->id(), w->id(), x->id()};
+
+    auto quad = sim->spawn<Quadratic>(1.0);
+    quad->coef(x) = 3;
+    quad->coef(z) = -1;
+    quad->coef(x, x) = -0.5;
+    quad->coef(x, y) = 2;
+    quad->coef(y, z) = -1.5;
+    quad->coef(z, z) = 0.25;
+
+    auto poly = sim->spawn<Polynomial>(2.0);
+    poly->coef(x, 1) = 2;
+    poly->coef(x, 3) = -1;
+    poly->coef(z, 2) = 4;
+
+    auto cd = sim->spawn<CobbDouglas>(x->id(), 0.5, y->id(), 2.0, z->id(), 1.5, 3.0);
+
+    auto simple = sim->spawn<Consumer::Simple>([&](const BundleNegative &b) { return b[x] - 2*b[y]*b[z] + b[w]; });
+
+    BundleNegative base;
+    base.set(x, 1.5);
+    base.set(z, 0.5);
+    // Candidates: no change, one with y = 0 (so Cobb-Douglas utility is 0), and some with changes
+    // to repeated and unused goods.
+    Eigen::MatrixXd deltas(4, 4);
+    deltas <<
+        0, 0,   1,  -0.5,
+        0, 0,   2,   0.25,
+        0, 3, 0.5,   1,
+        0, 0,  -1,   0.75;
+
+    std::vector<SharedMember<Consumer>> consumers{quad, poly, cd, simple};
+    for (auto &con : consumers) {
+        auto u = con->utilityBatch(base, goods, deltas);
+        ASSERT_EQ(4, u.size());
+        for (int j = 0; j < deltas.cols(); j++) {
+            BundleNegative b = base;
+            for (size_t i = 0; i < goods.size(); i++) b[goods[i]] += deltas(i, j);
+            EXPECT_NEAR(con->utility(b), u[j], 1e-12);
+        }
+    }
+    EXPECT_EQ(0, cd->utilityBatch(base, goods, deltas)[0]);
+    EXPECT_THROW(quad->utilityBatch(base, {x->id()}, deltas), std::invalid_argument);
+
+    // With a negative exponent, a zero quantity makes utility infinite rather than 0 (when no
+    // factor with a positive exponent is 0 first):
+    for (auto &cdn : {sim->spawn<CobbDouglas>(x->id(), 0.5, y->id(), -1.0),
+            sim->spawn<CobbDouglas>(y->id(), -1.0, z->id(), 2.0),
+            sim->spawn<CobbDouglas>(w->id(), -2.0)}) {
+        auto u = cdn->utilityBatch(base, goods, deltas);
+        for (int j = 0; j < deltas.cols(); j++) {
+            BundleNegative b = base;
+            for (size_t i = 0; i < goods.size(); i++) b[goods[i]] += deltas(i, j);
+            if (std::isinf(cdn->utility(b))) EXPECT_EQ(cdn->utility(b), u[j]);
+            else EXPECT_NEAR(cdn->utility(b), u[j], 1e-12);
+        }
+    }
+    EXPECT_EQ(std::numeric_limits<double>::infinity(), sim->spawn<CobbDouglas>(x->id(), 0.5, y->id(), -1.0)->utilityBatch(base, goods, deltas)[0]);
+}
+
+TEST_F(ConsumerTest, AutoDiff) {
+    auto y = sim->spawn<Good>("y");
+    auto z = sim->spawn<Good>("z");
+    std::vector<eris::id_t> goods{x->id(), y->id(), z->id(), money->id()};
+
+    // Cobb-Douglas, compared against the analytical version
+    auto cd_u = [&](const auto &q) { using std::pow; return 3 * pow(q[x], 0.5) * pow(q[y], 2.0) * pow(q[z], 1.5); };
+    auto ad = sim->spawn<AutoDiff<decltype(cd_u)>>(cd_u);
+    auto cd = sim->spawn<CobbDouglas>(x->id(), 0.5, y->id(), 2.0, z->id(), 1.5, 3.0);
+
+    BundleNegative b;
+    b.set(x, 1.5);
+    b.set(y, 2.0);
+    b.set(z, 0.5);
+    EXPECT_DOUBLE_EQ(cd->utility(b), ad->utility(b));
+    auto grad = ad->gradientVector(goods, b);
+    auto hess = ad->hessianMatrix(goods, b);
+    for (size_t i = 0; i < goods.size(); i++) {
+        EXPECT_NEAR(cd->d(b, goods[i]), ad->d(b, goods[i]), 1e-12);
+        EXPECT_NEAR(cd->d(b, goods[i]), grad[i], 1e-12);
+        for (size_t j = 0; j < goods.size(); j++) {
+            EXPECT_NEAR(cd->d2(b, goods[i], goods[j]), ad->d2(b, goods[i], goods[j]), 1e-12);
+            EXPECT_NEAR(cd->d2(b, goods[i], goods[j]), hess(i, j), 1e-12);
+        }
+    }
+
+    // u = log(1+x) + y/(1+x) + exp(-y)
+    auto u = [&](const auto &q) { using std::log; using std::exp; return log(1 + q[x]) + q[y] / (1 + q[x]) + exp(-q[y]); };
+    auto ad2 = sim->spawn<AutoDiff<decltype(u)>>(u);
+    double xv = 1.5, yv = 2.0;
+    EXPECT_DOUBLE_EQ(std::log(1+xv) + yv/(1+xv) + std::exp(-yv), ad2->utility(b));
+    EXPECT_NEAR(1/(1+xv) - yv/std::pow(1+xv, 2), ad2->d(b, x), 1e-12);
+    EXPECT_NEAR(1/(1+xv) - std::exp(-yv), ad2->d(b, y), 1e-12);
+    EXPECT_NEAR(-1/std::pow(1+xv, 2) + 2*yv/std::pow(1+xv, 3), ad2->d2(b, x, x), 1e-12);
+    EXPECT_NEAR(-1/std::pow(1+xv, 2), ad2->d2(b, x, y), 1e-12);
+    EXPECT_NEAR(-1/std::pow(1+xv, 2), ad2->d2(b, y, x), 1e-12);
+    EXPECT_NEAR(std::exp(-yv), ad2->d2(b, y, y), 1e-12);
+    EXPECT_EQ(0, ad2->d(b, z));
+
+    // Works with gradient-based optimizers
+    for (auto &g : {std::make_pair(x, 1.0), std::make_pair(y, 2.0), std::make_pair(z, 1.0)}) {
+        auto mkt = sim->spawn<market::Bertrand>(Bundle(g.first, 1), m1);
+        mkt->addFirm(sim->spawn<firm::PriceFirm>(Bundle(g.first, 1), g.second * m1));
+    }
+    auto xyz2 = [&](const auto &q) { return q[x] * q[y] * q[z] * q[z]; };
+    auto con = sim->spawn<AutoDiff<decltype(xyz2)>>(xyz2);
+    con->assets[money] = 100;
+    auto opt = sim->spawn<ProjectedNewton>(con, money);
+    opt->intraReset();
+    opt->intraOptimize();
+    opt->intraApply();
+    EXPECT_NEAR(25, con->assets[x], 1e-6);
+    EXPECT_NEAR(12.5, con->assets[y], 1e-6);
+    EXPECT_NEAR(50, con->assets[z], 1e-6);
+}
+
+TEST_F(ConsumerTest, CompoundPlan) {
+    auto y = sim->spawn<Good>("y");
+    auto z = sim->spawn<Good>("z");
+    std::vector<eris::id_t> goods{x->id(), y->id(), z->id()};
+
+    auto quad = std::make_shared<Quadratic>(1.0);
+    quad->coef(x) = 3;
+    quad->coef(x, y) = 2;
+    quad->coef(z, z) = -0.25;
+    auto poly = std::make_shared<Polynomial>(2.0);
+    poly->coef(y, 2) = 1.5;
+    auto cd = std::make_shared<CobbDouglas>(x->id(), 0.5, y->id(), 0.25, z->id(), 0.75, 2.0);
+
+    // u = quad*cd + cd*poly, with cd appearing in both products
+    auto left = std::make_shared<CompoundProduct::Differentiable>(quad, cd);
+    auto right = std::make_shared<CompoundProduct::Differentiable>(cd, poly);
+    auto con = sim->spawn<CompoundSum::Differentiable>(left, right);
+
+    auto plan = con->plan();
+    EXPECT_EQ(3u, plan->leaves());
+    EXPECT_EQ(6u, plan->size());
+
+    BundleNegative b;
+    b.set(x, 1.5);
+    b.set(y, 2.0);
+    b.set(z, 0.5);
+
+    double q = quad->utility(b), p = poly->utility(b), c = cd->utility(b);
+    EXPECT_DOUBLE_EQ(q*c + c*p, con->utility(b));
+    auto grad = con->gradientVector(goods, b);
+    auto hess = con->hessianMatrix(goods, b);
+    for (size_t i = 0; i < goods.size(); i++) {
+        auto gi = goods[i];
+        double expect = quad->d(b, gi)*c + q*cd->d(b, gi) + cd->d(b, gi)*p + c*poly->d(b, gi);
+        EXPECT_NEAR(expect, con->d(b, gi), 1e-10);
+        EXPECT_NEAR(expect, grad[i], 1e-10);
+        for (size_t j = 0; j < goods.size(); j++) {
+            auto gj = goods[j];
+            double expect2 =
+                left->first->d2(b, gi, gj)*c + q*cd->d2(b, gi, gj) + quad->d(b, gi)*cd->d(b, gj) + quad->d(b, gj)*cd->d(b, gi) +
+                cd->d2(b, gi, gj)*p + c*poly->d2(b, gi, gj) + cd->d(b, gi)*poly->d(b, gj) + cd->d(b, gj)*poly->d(b, gi);
+            EXPECT_NEAR(expect2, con->d2(b, gi, gj), 1e-10);
+            EXPECT_NEAR(expect2, hess(i, j), 1e-10);
+        }
+    }
+
+    // Changing a component anywhere in the tree recompiles the plan
+    right->second = quad;
+    EXPECT_FALSE(plan->valid());
+    EXPECT_DOUBLE_EQ(2*q*c, con->utility(b));
+    EXPECT_EQ(2u, con->plan()->leaves());
+    EXPECT_EQ(5u, con->plan()->size());
+
+    // Replacing a subtree that nothing else refers to destroys it; the plan has to notice the
+    // change without looking inside the destroyed subtree.
+    std::weak_ptr<Consumer> old_left = left;
+    left.reset();
+    con->first = std::make_shared<CompoundSum::Differentiable>(quad, poly);
+    EXPECT_TRUE(old_left.expired());
+    EXPECT_DOUBLE_EQ(q + p + q*c, con->utility(b));
+    EXPECT_NEAR(quad->d(b, y) + poly->d(b, y) + quad->d(b, y)*c + q*cd->d(b, y), con->d(b, y), 1e-10);
+    EXPECT_EQ(6u, con->plan()->size());
+
+    // A compound consumer with a zero first factor is zero even if the second isn't finite, and so
+    // are derivatives where both factors have a zero derivative.
+    auto zero = std::make_shared<Polynomial>();
+    auto inf = std::make_shared<CobbDouglas>(x->id(), -1.0);
+    auto prod = sim->spawn<CompoundProduct>(zero, inf);
+    auto prod_d = sim->spawn<CompoundProduct::Differentiable>(zero, inf);
+    b.set(x, 0);
+    EXPECT_EQ(0, prod->utility(b));
+    EXPECT_EQ(0, prod_d->utility(b));
+    EXPECT_EQ(0, prod_d->d(b, y));
+    EXPECT_EQ(0, prod_d->d2(b, y, z));
+}
+
+int main(int argc, char **argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,59 @@
+// Tests for firm reservations.
+
+#include "sim-fixture.hpp"
+#include <eris/firm/PriceFirm.hpp>
+
+using namespace eris;
+
+class FirmTest : public SimFixture {};
+
+TEST_F(FirmTest, ReserveMany) {
+    auto fa = sim->spawn<firm::PriceFirm>(x1, m1, 1);
+    auto fb = sim->spawn<firm::PriceFirm>(x1, m1, 3);
+    fa->assets[x] = 0.5;
+
+    // fb can't produce 5, so neither reservation should be made
+    EXPECT_THROW(Firm::reserveMany({{fa, 1*x1}, {fb, 5*x1}}), Firm::production_constraint);
+    EXPECT_DOUBLE_EQ(0.5, fa->assets[x]);
+    EXPECT_DOUBLE_EQ(1.5, fa->canSupplyAny(x1));
+
+    // fa supplies from its assets first, then from production
+    auto res = Firm::reserveMany({{fa, 1.5*x1}, {fb, 2*x1}});
+    ASSERT_EQ(2, res.size());
+    EXPECT_EQ(fa->id(), res[0].firm->id());
+    EXPECT_DOUBLE_EQ(0, fa->assets[x]);
+    EXPECT_DOUBLE_EQ(0, fa->canSupplyAny(x1));
+    EXPECT_DOUBLE_EQ(1.0 / 3.0, fb->canSupplyAny(3*x1));
+
+    Bundle to;
+    for (auto &r : res) r.transfer(to);
+    EXPECT_DOUBLE_EQ(3.5, to[x]);
+}
+
+TEST_F(FirmTest, SupplyEpoch) {
+    auto f = sim->spawn<firm::PriceFirm>(x1, m1, 1);
+    auto e = Firm::supplyEpoch();
+
+    // Direct changes to a firm's assets advance the epoch, but not changes to other agents' assets
+    f->assets[x] = 1;
+    EXPECT_GT(Firm::supplyEpoch(), e); e = Firm::supplyEpoch();
+    auto a = sim->spawn<Agent>();
+    a->assets[x] = 1;
+    EXPECT_EQ(e, Firm::supplyEpoch());
+}
+
+TEST_F(FirmTest, ReleaseRounding) {
+    auto f = sim->spawn<firm::PriceFirm>(x1, m1, 1);
+
+    // 0.7 + 0.1 - 0.7 is slightly less than 0.1, so releasing the second reservation finds
+    // reserved production a tiny bit short.
+    auto r1 = f->reserve(0.7*x1), r2 = f->reserve(0.1*x1);
+    r1.release();
+    EXPECT_NO_THROW(r2.release());
+    EXPECT_DOUBLE_EQ(1, f->canSupplyAny(x1));
+}
+
+int main(int argc, char **argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,422 @@
+// Tests for the intra-period consumer optimizers.
+
+#include "sim-fixture.hpp"
+#include <eris/consumer/CobbDouglas.hpp>
+#include <eris/consumer/Polynomial.hpp>
+#include <eris/intraopt/IncrementalBuyer.hpp>
+#include <eris/intraopt/MUPD.hpp>
+#include <eris/intraopt/ProjectedNewton.hpp>
+#include <eris/market/Bertrand.hpp>
+#include <eris/firm/PriceFirm.hpp>
+#include <cmath>
+#include <unordered_map>
+
+using namespace eris;
+using namespace eris::consumer;
+using namespace eris::intraopt;
+
+class ProjectedNewtonTest : public SimFixture {};
+class MUPDTest : public SimFixture {};
+class IncrementalBuyerTest : public SimFixture {};
+
+TEST_F(ProjectedNewtonTest, CobbDouglas) {
+    auto y = sim->spawn<Good>("y");
+    auto z = sim->spawn<Good>("z");
+    for (auto &g : {std::make_pair(x, 1.0), std::make_pair(y, 2.0), std::make_pair(z, 1.0)}) {
+        auto mkt = sim->spawn<market::Bertrand>(Bundle(g.first, 1), m1);
+        mkt->addFirm(sim->spawn<firm::PriceFirm>(Bundle(g.first, 1), g.second * m1));
+    }
+
+    // u = xyz^2 spends 1/4 of income on each of x and y, and half on z:
+    auto con = sim->spawn<CobbDouglas>(x->id(), 1.0, y->id(), 1.0, z->id(), 2.0);
+    con->assets[money] = 100;
+    auto opt = sim->spawn<ProjectedNewton>(con, money);
+
+    opt->intraReset();
+    opt->intraOptimize();
+    opt->intraApply();
+    EXPECT_NEAR(25, con->assets[x], 1e-6);
+    EXPECT_NEAR(12.5, con->assets[y], 1e-6);
+    EXPECT_NEAR(50, con->assets[z], 1e-6);
+    EXPECT_NEAR(0, con->assets[money], 1e-6);
+    EXPECT_LT(opt->iterations(), 10);
+}
+
+TEST_F(ProjectedNewtonTest, Numeraire) {
+    auto y = sim->spawn<Good>("y");
+    Bundle y1(y, 1);
+    auto mx = sim->spawn<market::Bertrand>(x1, m1);
+    mx->addFirm(sim->spawn<firm::PriceFirm>(x1, m1));
+    auto my = sim->spawn<market::Bertrand>(y1, m1);
+    my->addFirm(sim->spawn<firm::PriceFirm>(y1, m1));
+
+    // u = m + 5x - x²/2 + 4y - y²/2
+    auto con = sim->spawn<Polynomial>();
+    con->coef(money, 1) = 1;
+    con->coef(x, 1) = 5;
+    con->coef(x, 2) = -0.5;
+    con->coef(y, 1) = 4;
+    con->coef(y, 2) = -0.5;
+    auto opt = sim->spawn<ProjectedNewton>(con, money);
+
+    // With plenty of money, buy where MU/$ falls to 1 and keep the rest:
+    con->assets[money] = 10;
+    opt->intraOptimize();
+    opt->intraApply();
+    EXPECT_NEAR(4, con->assets[x], 1e-8);
+    EXPECT_NEAR(3, con->assets[y], 1e-8);
+    EXPECT_NEAR(3, con->assets[money], 1e-8);
+
+    // With only 2, spend it all, equating the marginal utilities of x and y:
+    con->assets.clear();
+    con->assets[money] = 2;
+    opt->intraOptimize();
+    opt->intraApply();
+    EXPECT_NEAR(1.5, con->assets[x], 1e-8);
+    EXPECT_NEAR(0.5, con->assets[y], 1e-8);
+    EXPECT_NEAR(0, con->assets[money], 1e-8);
+}
+
+TEST_F(ProjectedNewtonTest, WarmStart) {
+    unsigned int iterations[2];
+    for (bool warm : {false, true}) {
+        reset();
+        std::vector<SharedMember<firm::PriceFirm>> firms;
+        std::unordered_map<eris::id_t, double> exps;
+        for (int i = 0; i < 6; i++) {
+            auto g = sim->spawn<Good>("g" + std::to_string(i));
+            auto mkt = sim->spawn<market::Bertrand>(Bundle(g, 1), m1);
+            firms.push_back(sim->spawn<firm::PriceFirm>(Bundle(g, 1), (1 + i) * m1));
+            mkt->addFirm(firms.back());
+            exps[g->id()] = 1 + 0.5*i;
+        }
+        auto con = sim->spawn<CobbDouglas>(exps);
+        con->assets[money] = 100;
+        auto opt = sim->spawn<ProjectedNewton>(con, money);
+        opt->warm_start = warm;
+        // Constant prices would otherwise be solved directly from the closed-form demand
+        opt->analytic_demand = false;
+
+        opt->intraReset();
+        opt->intraOptimize();
+        // A small price change, then re-optimize:
+        opt->intraReset();
+        firms[2]->setPrice(3.03 * m1);
+        opt->intraOptimize();
+        iterations[warm] = opt->iterations();
+        opt->intraApply();
+
+        // Cobb-Douglas spends the exponent's share of income in each market
+        double total = 0;
+        for (auto &e : exps) total += e.second;
+        for (int i = 0; i < 6; i++) {
+            double price = i == 2 ? 3.03 : 1 + i;
+            EXPECT_NEAR(100 * (1 + 0.5*i) / total / price, con->assets[firms[i]->output().begin()->first], 1e-6);
+        }
+    }
+    EXPECT_LT(iterations[1], iterations[0]);
+    EXPECT_LE(iterations[1], 3);
+}
+
+TEST_F(MUPDTest, Snapshots) {
+    for (bool newton : {false, true}) {
+        double result[2][3];
+        for (bool snapshots : {false, true}) {
+            reset();
+            auto y = sim->spawn<Good>("y");
+            auto z = sim->spawn<Good>("z");
+            for (auto &g : {std::make_pair(x, 1.0), std::make_pair(y, 2.0), std::make_pair(z, 1.0)}) {
+                auto mkt = sim->spawn<market::Bertrand>(Bundle(g.first, 1), m1);
+                // The cheapest firm can only supply 20 units; after that the price doubles
+                mkt->addFirm(sim->spawn<firm::PriceFirm>(Bundle(g.first, 1), g.second * m1, 20));
+                mkt->addFirm(sim->spawn<firm::PriceFirm>(Bundle(g.first, 1), 2 * g.second * m1));
+            }
+
+            auto con = sim->spawn<CobbDouglas>(x->id(), 1.0, y->id(), 1.0, z->id(), 2.0);
+            con->assets[money] = 100;
+            SharedMember<MUPD> opt = newton
+                ? SharedMember<MUPD>(sim->spawn<ProjectedNewton>(con, money))
+                : sim->spawn<MUPD>(con, money);
+            opt->use_snapshots = snapshots;
+
+            opt->intraReset();
+            opt->intraOptimize();
+            opt->intraApply();
+            result[snapshots][0] = con->assets[x];
+            result[snapshots][1] = con->assets[y];
+            result[snapshots][2] = con->assets[z];
+            EXPECT_NEAR(0, con->assets[money], 1e-6);
+        }
+        EXPECT_LT(result[1][2], 50);
+        for (int i = 0; i < 3; i++)
+            EXPECT_NEAR(result[0][i], result[1][i], 1e-6);
+    }
+}
+
+TEST_F(MUPDTest, ThreadedSnapshots) {
+    // Threaded optimizers lock their consumers while reserving; the markets' own locking of the
+    // consumer, market, and firms has to nest inside that lock.
+    for (bool newton : {false, true}) for (bool snapshots : {false, true}) for (unsigned long threads : {0, 2}) {
+        reset();
+        sim->maxThreads(threads);
+        auto y = sim->spawn<Good>("y");
+        auto mx = sim->spawn<market::Bertrand>(x1, m1);
+        mx->addFirm(sim->spawn<firm::PriceFirm>(x1, m1));
+        auto my = sim->spawn<market::Bertrand>(Bundle(y, 1), m1);
+        my->addFirm(sim->spawn<firm::PriceFirm>(Bundle(y, 1), 2*m1));
+
+        std::vector<SharedMember<CobbDouglas>> cons;
+        for (int i = 0; i < 4; i++) {
+            cons.push_back(sim->spawn<CobbDouglas>(x->id(), 1.0, y->id(), 1.0));
+            cons.back()->assets[money] = 100;
+            SharedMember<MUPD> opt = newton
+                ? SharedMember<MUPD>(sim->spawn<ProjectedNewton>(cons.back(), money))
+                : sim->spawn<MUPD>(cons.back(), money);
+            opt->use_snapshots = snapshots;
+            // Use the numerical search rather than the closed-form demand
+            opt->analytic_demand = false;
+        }
+
+        sim->run();
+
+        // u = xy spends half of income on each good
+        for (auto &con : cons) {
+            EXPECT_NEAR(50, con->assets[x], 1e-6);
+            EXPECT_NEAR(25, con->assets[y], 1e-6);
+            EXPECT_NEAR(0, con->assets[money], 1e-6);
+        }
+    }
+}
+
+TEST_F(MUPDTest, PriceTaker) {
+    // MUPD and ProjectedNewton report their consumers' demand to a QMarket demand search, which can
+    // then find the clearing price with only a couple of pricing tries.
+    for (bool newton : {false, true}) for (bool analytic : {false, true}) {
+        reset();
+        auto y = sim->spawn<Good>("y");
+        auto firm = sim->spawn<TestQFirm>(x1, 5);
+        auto mx = sim->spawn<market::QMarket>(x1, m1, 1.0, 2, 2);
+        mx->addFirm(firm);
+        mx->demand_search_points = 33;
+        auto my = sim->spawn<market::Bertrand>(Bundle(y, 1), m1);
+        my->addFirm(sim->spawn<firm::PriceFirm>(Bundle(y, 1), 2*m1));
+
+        std::vector<SharedMember<MUPD>> opts;
+        for (int i = 0; i < 2; i++) {
+            auto con = sim->spawn<CobbDouglas>(x->id(), 1.0, y->id(), 1.0);
+            con->assets[money] = 10;
+            opts.push_back(newton
+                    ? SharedMember<MUPD>(sim->spawn<ProjectedNewton>(con, money))
+                    : sim->spawn<MUPD>(con, money));
+            opts.back()->analytic_demand = analytic;
+        }
+
+        // u = xy spends half of income on x, whatever its price
+        Eigen::VectorXd prices(3);
+        prices << 0.5, 1, 4;
+        Eigen::VectorXd demand = opts[0]->demand(*mx, prices);
+        ASSERT_EQ(3, demand.size());
+        for (int i = 0; i < 3; i++)
+            EXPECT_NEAR(5 / prices[i], demand[i], 1e-6);
+
+        sim->run();
+
+        // Total demand is 10/p against a supply of 5, so the market should clear at a price near 2
+        EXPECT_NEAR(2, mx->price(), 0.1);
+        EXPECT_NEAR(10, firm->assets[money], 1e-6);
+    }
+}
+
+TEST_F(MUPDTest, ThreadedPriceTaker) {
+    // Enough consumers that the demand search evaluates demand in several threads, each of which
+    // has to lock the market being searched; a second searching QMarket competes for the same locks.
+    sim->maxThreads(4);
+    auto y = sim->spawn<Good>("y");
+    auto z = sim->spawn<Good>("z");
+    auto fx = sim->spawn<TestQFirm>(x1, 160);
+    auto mx = sim->spawn<market::QMarket>(x1, m1, 1.0, 2, 2);
+    mx->addFirm(fx);
+    auto fz = sim->spawn<TestQFirm>(Bundle(z, 1), 320);
+    auto mz = sim->spawn<market::QMarket>(Bundle(z, 1), m1, 1.0, 2, 2);
+    mz->addFirm(fz);
+    for (auto &m : {mx, mz}) m->demand_search_points = 9;
+    auto my = sim->spawn<market::Bertrand>(Bundle(y, 1), m1);
+    my->addFirm(sim->spawn<firm::PriceFirm>(Bundle(y, 1), 2*m1));
+
+    for (int i = 0; i < 64; i++) {
+        auto con = sim->spawn<CobbDouglas>(x->id(), 1.0, y->id(), 1.0, z->id(), 1.0);
+        con->assets[money] = 15;
+        sim->spawn<MUPD>(con, money);
+    }
+
+    sim->run();
+
+    // Each consumer spends 5 on each good, so demand for x is 320/p against a supply of 160.  (The z
+    // market searches against x's supply at the old price of 1, which is sold out, so it doesn't end
+    // up with a clean clearing price in two tries; it's here to search at the same time as x).
+    EXPECT_NEAR(2, mx->price(), 0.1);
+    EXPECT_LT(0, fz->assets[money]);
+}
+
+TEST_F(MUPDTest, WarmStart) {
+    for (bool warm : {false, true}) {
+        reset();
+        auto y = sim->spawn<Good>("y");
+        Bundle y1(y, 1);
+        auto mx = sim->spawn<market::Bertrand>(x1, m1);
+        auto fx = sim->spawn<firm::PriceFirm>(x1, m1);
+        mx->addFirm(fx);
+        auto my = sim->spawn<market::Bertrand>(y1, m1);
+        my->addFirm(sim->spawn<firm::PriceFirm>(y1, 2*m1));
+
+        auto con = sim->spawn<CobbDouglas>(x->id(), 1.0, y->id(), 3.0);
+        con->assets[money] = 100;
+        auto opt = sim->spawn<MUPD>(con, money);
+        opt->warm_start = warm;
+        // Constant prices would otherwise be solved directly from the closed-form demand
+        opt->analytic_demand = false;
+
+        opt->intraReset();
+        opt->intraOptimize();
+        opt->intraReset();
+        fx->setPrice(1.1 * m1);
+        opt->intraOptimize();
+        opt->intraApply();
+        EXPECT_NEAR(25 / 1.1, con->assets[x], 1e-6);
+        EXPECT_NEAR(37.5, con->assets[y], 1e-6);
+    }
+}
+
+TEST_F(MUPDTest, AnalyticDemand) {
+    for (bool newton : {false, true}) {
+        double result[2][3];
+        for (bool analytic : {false, true}) {
+            reset();
+            auto y = sim->spawn<Good>("y");
+            auto z = sim->spawn<Good>("z");
+            for (auto &g : {std::make_pair(x, 1.0), std::make_pair(y, 2.0), std::make_pair(z, 4.0)}) {
+                auto mkt = sim->spawn<market::Bertrand>(Bundle(g.first, 2), m1);
+                mkt->addFirm(sim->spawn<firm::PriceFirm>(Bundle(g.first, 2), g.second * m1));
+            }
+
+            auto con = sim->spawn<CobbDouglas>(x->id(), 1.0, y->id(), 1.0, z->id(), 2.0);
+            con->assets[money] = 100;
+            con->assets[x] = 10;
+            SharedMember<MUPD> opt = newton
+                ? SharedMember<MUPD>(sim->spawn<ProjectedNewton>(con, money))
+                : sim->spawn<MUPD>(con, money);
+            opt->analytic_demand = analytic;
+
+            opt->intraReset();
+            opt->intraOptimize();
+            if (newton and analytic) {
+                EXPECT_EQ(0, SharedMember<ProjectedNewton>(opt)->iterations());
+            }
+            opt->intraApply();
+            result[analytic][0] = con->assets[x];
+            result[analytic][1] = con->assets[y];
+            result[analytic][2] = con->assets[z];
+            EXPECT_NEAR(0, con->assets[money], 1e-9);
+        }
+        // Income is effectively 105 (including the 10 x held, at 0.5 each); x gets a quarter of
+        // that, at 0.5 per unit; y a quarter at 1; z half at 2.
+        EXPECT_NEAR(52.5, result[1][0], 1e-9);
+        EXPECT_NEAR(26.25, result[1][1], 1e-9);
+        EXPECT_NEAR(26.25, result[1][2], 1e-9);
+        for (int i = 0; i < 3; i++)
+            EXPECT_NEAR(result[0][i], result[1][i], 1e-5);
+    }
+}
+
+TEST_F(IncrementalBuyerTest, CobbDouglas) {
+    auto y = sim->spawn<Good>("y");
+    Bundle y1(y, 1);
+    auto mx = sim->spawn<market::Bertrand>(x1, m1);
+    mx->addFirm(sim->spawn<firm::PriceFirm>(x1, m1));
+    auto my = sim->spawn<market::Bertrand>(y1, m1);
+    my->addFirm(sim->spawn<firm::PriceFirm>(y1, 2*m1));
+
+    // u = xy^3 spends 1/4 of income on x and 3/4 on y
+    auto con = sim->spawn<CobbDouglas>(x->id(), 1.0, y->id(), 3.0);
+    con->assets[money] = 100;
+    auto opt = sim->spawn<IncrementalBuyer>(*con, money->id(), 100);
+    opt->permuteZeros(true);
+
+    opt->intraReset();
+    opt->intraOptimize();
+    opt->intraApply();
+    EXPECT_NEAR(25, con->assets[x], 2);
+    EXPECT_NEAR(37.5, con->assets[y], 1);
+    EXPECT_NEAR(0, con->assets[money], 1e-8);
+}
+
+TEST_F(IncrementalBuyerTest, QueriesPerRound) {
+    auto y = sim->spawn<Good>("y");
+    auto z = sim->spawn<Good>("z");
+    std::vector<SharedMember<CountingBertrand>> mkts;
+    for (auto &g : {x, y, z}) {
+        mkts.push_back(sim->spawn<CountingBertrand>(Bundle(g, 1), m1));
+        mkts.back()->addFirm(sim->spawn<firm::PriceFirm>(Bundle(g, 1), m1));
+    }
+
+    auto con = sim->spawn<CobbDouglas>(x->id(), 1.0, y->id(), 1.0, z->id(), 1.0);
+    con->assets[money] = 30;
+    auto opt = sim->spawn<IncrementalBuyer>(*con, money->id(), 1);
+    opt->permuteAll();
+
+    // A single round considers each market alone, in three pairs, and all together, then buys all
+    // three; but each market only needs to be queried once for each of the three combination sizes.
+    opt->intraReset();
+    opt->intraOptimize();
+    for (auto &m : mkts) EXPECT_EQ(3, m->queries);
+    opt->intraApply();
+    EXPECT_NEAR(10, con->assets[x], 1e-9);
+}
+
+TEST_F(IncrementalBuyerTest, Lazy) {
+    int queries[2];
+    double x_q[2], y_q[2], z_q[2];
+    for (int lazy : {0, 1}) {
+        reset();
+        auto y = sim->spawn<Good>("y");
+        auto z = sim->spawn<Good>("z");
+        Bundle y1(y, 1), z1(z, 1);
+        std::vector<SharedMember<CountingBertrand>> mkts{
+            sim->spawn<CountingBertrand>(x1, m1), sim->spawn<CountingBertrand>(y1, m1), sim->spawn<CountingBertrand>(z1, m1)};
+        mkts[0]->addFirm(sim->spawn<firm::PriceFirm>(x1, m1));
+        mkts[1]->addFirm(sim->spawn<firm::PriceFirm>(y1, 2*m1));
+        mkts[2]->addFirm(sim->spawn<firm::PriceFirm>(z1, 4*m1));
+
+        // u = xy^3z^2 spends 1/6 of income on x, 1/2 on y, and 1/3 on z
+        auto con = sim->spawn<CobbDouglas>(x->id(), 1.0, y->id(), 3.0, z->id(), 2.0);
+        con->assets[money] = 120;
+        auto opt = sim->spawn<IncrementalBuyer>(*con, money->id(), 120);
+        opt->permuteZeros(true);
+        opt->lazy(lazy);
+
+        opt->intraReset();
+        opt->intraOptimize();
+        opt->intraApply();
+        x_q[lazy] = con->assets[x];
+        y_q[lazy] = con->assets[y];
+        z_q[lazy] = con->assets[z];
+        EXPECT_NEAR(0, con->assets[money], 1e-8);
+        queries[lazy] = 0;
+        for (auto &m : mkts) queries[lazy] += m->queries;
+    }
+
+    // The lazy buyer's larger purchases make it slightly less precise, but it should get almost
+    // all of the attainable utility with far fewer market queries.
+    for (int lazy : {0, 1}) {
+        EXPECT_NEAR(20, x_q[lazy], 2);
+        EXPECT_NEAR(30, y_q[lazy], 1);
+        EXPECT_NEAR(10, z_q[lazy], lazy ? 1 : 0.5);
+        EXPECT_GT(x_q[lazy] * std::pow(y_q[lazy], 3) * std::pow(z_q[lazy], 2), 0.99 * 20 * 27000 * 100);
+    }
+    EXPECT_LT(5 * queries[1], queries[0]);
+}
+
+int main(int argc, char **argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,542 @@
+// Tests for the market implementations and the Market base class.
+
+#include "sim-fixture.hpp"
+#include <eris/market/Bertrand.hpp>
+#include <eris/market/OrderBook.hpp>
+#include <eris/market/QMarket.hpp>
+#include <eris/firm/PriceFirm.hpp>
+#include <eris/intraopt/Callback.hpp>
+#include <cmath>
+
+using namespace eris;
+
+class BertrandTest : public SimFixture {};
+class OrderBookTest : public SimFixture {};
+class QMarketTest : public SimFixture {};
+class MarketTest : public SimFixture {};
+
+TEST_F(BertrandTest, Schedule) {
+    auto mkt = sim->spawn<market::Bertrand>(x1, m1);
+    auto f1 = sim->spawn<firm::PriceFirm>(x1, 3*m1, 1);
+    auto f2 = sim->spawn<firm::PriceFirm>(2*x1, 2*m1, 2); // Price 1, capacity 4
+    auto f3 = sim->spawn<firm::PriceFirm>(x1, 2*m1, 0.5);
+    mkt->addFirm(f1);
+    mkt->addFirm(f2);
+    mkt->addFirm(f3);
+
+    auto p = mkt->price(5);
+    EXPECT_TRUE(p.feasible);
+    EXPECT_DOUBLE_EQ(4 + 2*0.5 + 3*0.5, p.total);
+    EXPECT_DOUBLE_EQ(3, p.marginal);
+    EXPECT_DOUBLE_EQ(1, p.marginalFirst);
+    EXPECT_FALSE(mkt->price(5.6).feasible);
+
+    auto q = mkt->quantity(6);
+    EXPECT_DOUBLE_EQ(4 + 0.5 + 1./3, q.quantity);
+    EXPECT_FALSE(q.constrained);
+    EXPECT_DOUBLE_EQ(0, q.unspent);
+    q = mkt->quantity(10);
+    EXPECT_DOUBLE_EQ(5.5, q.quantity);
+    EXPECT_TRUE(q.constrained);
+    EXPECT_DOUBLE_EQ(8, q.spent);
+    EXPECT_DOUBLE_EQ(2, q.unspent);
+
+    // Price and capacity changes must be picked up by the cached schedule:
+    f2->setPrice(8*m1);
+    EXPECT_DOUBLE_EQ(2, mkt->price(1).marginalFirst);
+    EXPECT_DOUBLE_EQ(4, mkt->price(5).marginal);
+
+    // So must direct asset changes, without needing a supplyChanged() call
+    f1->assets[x] = 1;
+    EXPECT_DOUBLE_EQ(6.5, mkt->quantity(1000).quantity);
+    f1->assets -= x1;
+    EXPECT_DOUBLE_EQ(5.5, mkt->quantity(1000).quantity);
+    f1->assets[x] = 1;
+    EXPECT_DOUBLE_EQ(6.5, mkt->quantity(1000).quantity);
+
+    mkt->removeFirm(f3->id());
+    EXPECT_DOUBLE_EQ(3, mkt->price(0).marginalFirst);
+    EXPECT_DOUBLE_EQ(6, mkt->quantity(1000).quantity);
+}
+
+TEST_F(BertrandTest, Allocate) {
+    auto mkt = sim->spawn<market::Bertrand>(x1, m1);
+    auto fa = sim->spawn<firm::PriceFirm>(x1, m1, 1);
+    auto fb = sim->spawn<firm::PriceFirm>(x1, m1, 3);
+    auto fc = sim->spawn<firm::PriceFirm>(x1, 2*m1);
+    mkt->addFirm(fc);
+    mkt->addFirm(fb);
+    mkt->addFirm(fa);
+
+    auto buyer = sim->spawn<Agent>();
+    buyer->assets[money] = 100;
+
+    // Ties are split evenly, subject to firm capacities:
+    auto res = mkt->reserve(buyer, 3);
+    EXPECT_DOUBLE_EQ(3, res.price());
+    res.buy();
+    EXPECT_DOUBLE_EQ(97, buyer->assets[money]);
+    EXPECT_DOUBLE_EQ(3, buyer->assets[x]);
+    EXPECT_DOUBLE_EQ(1, fa->assets[money]);
+    EXPECT_DOUBLE_EQ(2, fb->assets[money]);
+    EXPECT_DOUBLE_EQ(0, fc->assets[money]);
+
+    // The cheap firms now have 1 unit left (from fb), after which the expensive firm supplies
+    auto p = mkt->price(2.5);
+    EXPECT_DOUBLE_EQ(1 + 2*1.5, p.total);
+    EXPECT_DOUBLE_EQ(1, p.marginalFirst);
+    EXPECT_DOUBLE_EQ(2, p.marginal);
+    auto res2 = mkt->reserve(buyer, 2.5);
+    EXPECT_DOUBLE_EQ(4, res2.price());
+    res2.buy();
+    EXPECT_DOUBLE_EQ(93, buyer->assets[money]);
+    EXPECT_DOUBLE_EQ(5.5, buyer->assets[x]);
+    EXPECT_DOUBLE_EQ(3, fb->assets[money]);
+    EXPECT_DOUBLE_EQ(3, fc->assets[money]);
+
+    EXPECT_THROW(mkt->reserve(buyer, 1, 1.5), Market::low_price);
+    EXPECT_THROW(mkt->reserve(buyer, 100), Market::insufficient_assets);
+}
+
+TEST_F(OrderBookTest, Matching) {
+    auto book = sim->spawn<market::OrderBook>(x1, m1);
+    auto f1 = sim->spawn<firm::PriceFirm>(x1, m1);
+    auto f2 = sim->spawn<firm::PriceFirm>(x1, m1);
+    auto f3 = sim->spawn<firm::PriceFirm>(x1, m1);
+    book->addFirm(f1);
+    book->addFirm(f2);
+    EXPECT_THROW(book->ask(f3, 1, 1), std::invalid_argument);
+
+    book->ask(f1, 2, 3);
+    book->ask(f2, 1, 1);
+    book->ask(f1, 1, 2);
+    EXPECT_DOUBLE_EQ(1, book->bestAsk());
+    EXPECT_TRUE(std::isnan(book->bestBid()));
+
+    auto p = book->price(4);
+    EXPECT_DOUBLE_EQ(5, p.total);
+    EXPECT_DOUBLE_EQ(1, p.marginalFirst);
+    EXPECT_DOUBLE_EQ(2, p.marginal);
+    EXPECT_FALSE(book->price(6.5).feasible);
+    EXPECT_DOUBLE_EQ(3.5, book->quantity(4).quantity);
+
+    auto buyer = sim->spawn<Agent>();
+    buyer->assets[money] = 10;
+
+    // Reserved quantities are unavailable to later reservations until released:
+    {
+        auto res = book->reserve(buyer, 1);
+        EXPECT_DOUBLE_EQ(1, res.price());
+        EXPECT_DOUBLE_EQ(9, buyer->assets[money]);
+        EXPECT_DOUBLE_EQ(2*1 + 2, book->price(3).total);
+    }
+    EXPECT_DOUBLE_EQ(3, book->price(3).total);
+
+    // Time priority: f2's ask was posted before f1's at the same price
+    auto res = book->reserve(buyer, 2);
+    EXPECT_DOUBLE_EQ(2, res.price());
+    res.buy();
+    EXPECT_DOUBLE_EQ(8, buyer->assets[money]);
+    EXPECT_DOUBLE_EQ(2, buyer->assets[x]);
+    EXPECT_DOUBLE_EQ(1, f2->assets[money]);
+    EXPECT_DOUBLE_EQ(1, f1->assets[money]);
+    EXPECT_DOUBLE_EQ(1, book->bestAsk());
+
+    // A limit bid is matched (at the ask price) when the book is next matched:
+    auto bidder = sim->spawn<Agent>();
+    bidder->assets[money] = 10;
+    auto bid = book->bid(bidder, 1.5, 2);
+    EXPECT_DOUBLE_EQ(7, bidder->assets[money]);
+    book->intraApply();
+    EXPECT_DOUBLE_EQ(1, bidder->assets[x]);
+    EXPECT_DOUBLE_EQ(2, f1->assets[money]);
+    EXPECT_DOUBLE_EQ(2, book->bestAsk());
+    EXPECT_DOUBLE_EQ(1.5, book->bestBid());
+
+    EXPECT_TRUE(book->cancel(bid));
+    EXPECT_FALSE(book->cancel(bid));
+    EXPECT_DOUBLE_EQ(9, bidder->assets[money]);
+    EXPECT_TRUE(std::isnan(book->bestBid()));
+
+    book->removeFirm(f1->id());
+    EXPECT_TRUE(std::isnan(book->bestAsk()));
+    EXPECT_FALSE(book->price(0).feasible);
+}
+
+TEST_F(OrderBookTest, ClaimedAsks) {
+    auto book = sim->spawn<market::OrderBook>(x1, m1);
+    auto f1 = sim->spawn<firm::PriceFirm>(x1, m1);
+    auto f2 = sim->spawn<firm::PriceFirm>(x1, m1);
+    book->addFirm(f1);
+    book->addFirm(f2);
+    book->ask(f1, 1, 2);
+    book->ask(f2, 2, 3);
+
+    std::vector<SharedMember<Agent>> buyers;
+    for (int i = 0; i < 3; i++) {
+        buyers.push_back(sim->spawn<Agent>());
+        buyers.back()->assets[money] = 10;
+    }
+
+    // The first reservation claims f1's ask, the second two units of f2's ask:
+    auto r1 = book->reserve(buyers[0], 2);
+    auto r2 = book->reserve(buyers[1], 2);
+    EXPECT_DOUBLE_EQ(2, r1.price());
+    EXPECT_DOUBLE_EQ(4, r2.price());
+    EXPECT_DOUBLE_EQ(2, book->price(1).total);
+    EXPECT_FALSE(book->price(2).feasible);
+
+    // A limit bid can only take the unclaimed unit:
+    auto bid = book->bid(buyers[2], 5, 2);
+    book->intraApply();
+    EXPECT_DOUBLE_EQ(1, buyers[2]->assets[x]);
+    EXPECT_DOUBLE_EQ(2, f2->assets[money]);
+
+    // Buying in the reverse order still gets each reservation the asks it was priced against:
+    r2.buy();
+    EXPECT_DOUBLE_EQ(2, buyers[1]->assets[x]);
+    EXPECT_DOUBLE_EQ(6, buyers[1]->assets[money]);
+    EXPECT_DOUBLE_EQ(6, f2->assets[money]);
+    EXPECT_DOUBLE_EQ(1, book->bestAsk());
+    r1.buy();
+    EXPECT_DOUBLE_EQ(2, buyers[0]->assets[x]);
+    EXPECT_DOUBLE_EQ(8, buyers[0]->assets[money]);
+    EXPECT_DOUBLE_EQ(2, f1->assets[money]);
+    EXPECT_TRUE(std::isnan(book->bestAsk()));
+
+    EXPECT_TRUE(book->cancel(bid));
+    EXPECT_DOUBLE_EQ(8, buyers[2]->assets[money]);
+
+    // If a claimed ask is cancelled before the reservation is matched, its payment is refunded:
+    book->ask(f1, 1, 1);
+    auto r3 = book->reserve(buyers[0], 1);
+    EXPECT_DOUBLE_EQ(7, buyers[0]->assets[money]);
+    book->removeFirm(f1->id());
+    r3.buy();
+    EXPECT_DOUBLE_EQ(2, buyers[0]->assets[x]);
+    EXPECT_DOUBLE_EQ(8, buyers[0]->assets[money]);
+}
+
+TEST_F(QMarketTest, DemandSearch) {
+    auto firm = sim->spawn<TestQFirm>(x1, 10);
+    auto mkt = sim->spawn<market::QMarket>(x1, m1, 1.0, 2, 2);
+    mkt->addFirm(firm);
+    mkt->demand_search_points = 33;
+
+    for (int i = 0; i < 2; i++) {
+        auto a = sim->spawn<IncomeSpender>(mkt, 10);
+        a->assets[money] = 10;
+    }
+
+    sim->run();
+
+    // Total demand is 20/p against a supply of 10, so the market should clear at a price near 2
+    // despite only getting two pricing tries from an initial price of 1:
+    EXPECT_NEAR(2, mkt->price(), 0.1);
+    EXPECT_NEAR(20, firm->assets[money], 1e-9);
+}
+
+TEST_F(QMarketTest, DemandSearchNeedsAllBuyers) {
+    auto firm = sim->spawn<TestQFirm>(x1, 10);
+    auto mkt = sim->spawn<market::QMarket>(x1, m1, 1.0, 2, 2);
+    mkt->addFirm(firm);
+    mkt->demand_search_points = 33;
+
+    for (int i = 0; i < 2; i++) {
+        auto a = sim->spawn<IncomeSpender>(mkt, 10);
+        a->assets[money] = 10;
+    }
+    // An optimizer that can't report its demand disables the search, leaving just the stepper:
+    sim->spawn<RedoCounter>(0);
+
+    sim->run();
+
+    EXPECT_LT(mkt->price(), 1.5);
+}
+
+TEST_F(QMarketTest, Reserve) {
+    auto mkt = sim->spawn<market::QMarket>(x1, m1, 2.0);
+    std::vector<SharedMember<TestQFirm>> firms;
+    for (double cap : {6, 1, 10}) {
+        firms.push_back(sim->spawn<TestQFirm>(x1, cap));
+        firms.back()->assets[x] = cap;
+        mkt->addFirm(firms.back());
+    }
+
+    auto buyer = sim->spawn<Agent>();
+    buyer->assets[money] = 100;
+
+    // 1 from the small firm, then the remaining 11 split evenly between the other two:
+    auto res = mkt->reserve(buyer, 12);
+    EXPECT_DOUBLE_EQ(24, res.price());
+    res.buy();
+    EXPECT_DOUBLE_EQ(12, buyer->assets[x]);
+    EXPECT_DOUBLE_EQ(0.5, firms[0]->assets[x]);
+    EXPECT_DOUBLE_EQ(0, firms[1]->assets[x]);
+    EXPECT_DOUBLE_EQ(4.5, firms[2]->assets[x]);
+    EXPECT_DOUBLE_EQ(11, firms[0]->assets[money]);
+    EXPECT_DOUBLE_EQ(2, firms[1]->assets[money]);
+    EXPECT_DOUBLE_EQ(11, firms[2]->assets[money]);
+
+    EXPECT_THROW(mkt->reserve(buyer, 6), Market::output_infeasible);
+}
+
+TEST_F(MarketTest, QuoteCache) {
+    auto mkt = sim->spawn<CountingQMarket>(x1, m1, 2.0);
+    auto firm = sim->spawn<TestQFirm>(x1, 10);
+    firm->assets[x] = 10;
+    mkt->addFirm(firm);
+
+    // The cache is off by default, so every query is live:
+    EXPECT_DOUBLE_EQ(8, mkt->cachedPrice(4).total);
+    EXPECT_DOUBLE_EQ(8, mkt->cachedPrice(4).total);
+    EXPECT_EQ(2, mkt->price_calls);
+    mkt->price_calls = 0;
+
+    mkt->cache_quotes = true;
+    EXPECT_DOUBLE_EQ(8, mkt->cachedPrice(4).total);
+    EXPECT_DOUBLE_EQ(8, mkt->cachedPrice(4).total);
+    EXPECT_DOUBLE_EQ(3, mkt->cachedQuantity(6).quantity);
+    EXPECT_DOUBLE_EQ(3, mkt->cachedQuantity(6).quantity);
+    EXPECT_EQ(1, mkt->price_calls);
+    EXPECT_EQ(1, mkt->quantity_calls);
+
+    // A price change invalidates the cache:
+    mkt->setPrice(3.0);
+    EXPECT_DOUBLE_EQ(12, mkt->cachedPrice(4).total);
+    EXPECT_EQ(2, mkt->price_calls);
+
+    // So does a reservation:
+    auto buyer = sim->spawn<Agent>();
+    buyer->assets[money] = 100;
+    auto v = mkt->quoteVersion();
+    auto res = mkt->reserve(buyer, 8);
+    EXPECT_GT(mkt->quoteVersion(), v);
+    EXPECT_FALSE(mkt->cachedPrice(4).feasible);
+    EXPECT_EQ(3, mkt->price_calls);
+    res.release();
+    EXPECT_TRUE(mkt->cachedPrice(4).feasible);
+    EXPECT_EQ(4, mkt->price_calls);
+
+    // As do supply changes reported by a firm in any market:
+    EXPECT_TRUE(mkt->cachedPrice(4).feasible);
+    EXPECT_EQ(4, mkt->price_calls);
+    firm->supplyChanged();
+    EXPECT_TRUE(mkt->cachedPrice(4).feasible);
+    EXPECT_EQ(5, mkt->price_calls);
+}
+
+TEST_F(MarketTest, BuyAll) {
+    auto y = sim->spawn<Good>("y");
+    Bundle y1(y, 1);
+
+    auto mx = sim->spawn<market::QMarket>(x1, m1, 1.0);
+    auto my = sim->spawn<market::QMarket>(y1, m1, 2.0);
+    auto fx = sim->spawn<TestQFirm>(x1, 10), fy = sim->spawn<TestQFirm>(y1, 10);
+    fx->assets[x] = 10;
+    fy->assets[y] = 10;
+    mx->addFirm(fx);
+    my->addFirm(fy);
+
+    auto buyer = sim->spawn<Agent>();
+    buyer->assets[money] = 100;
+
+    std::vector<Market::Reservation> res;
+    res.push_back(mx->reserve(buyer, 3));
+    res.push_back(my->reserve(buyer, 4));
+    res.push_back(mx->reserve(buyer, 1));
+    res[2].release();
+    EXPECT_DOUBLE_EQ(89, buyer->assets[money]);
+
+    Market::buyAll(res);
+    EXPECT_DOUBLE_EQ(3, buyer->assets[x]);
+    EXPECT_DOUBLE_EQ(4, buyer->assets[y]);
+    EXPECT_DOUBLE_EQ(3, fx->assets[money]);
+    EXPECT_DOUBLE_EQ(8, fy->assets[money]);
+    for (auto &r : res) EXPECT_NE(ReservationState::pending, r.state());
+
+    res.clear();
+    res.push_back(mx->reserve(buyer, 5));
+    res.push_back(my->reserve(buyer, 5));
+    EXPECT_DOUBLE_EQ(74, buyer->assets[money]);
+    Market::releaseAll(res);
+    EXPECT_DOUBLE_EQ(89, buyer->assets[money]);
+    EXPECT_DOUBLE_EQ(7, fx->assets[x]);
+    EXPECT_DOUBLE_EQ(6, fy->assets[y]);
+}
+
+TEST_F(MarketTest, ReservationLedger) {
+    auto mkt = sim->spawn<market::QMarket>(x1, m1, 1.0);
+    auto firm = sim->spawn<TestQFirm>(x1, 100);
+    firm->assets[x] = 100;
+    mkt->addFirm(firm);
+    auto buyer = sim->spawn<Agent>();
+    buyer->assets[money] = 100;
+
+    // Reservations are handles into the market's ledger, so they keep their details when moved
+    // (e.g. by the vector reallocating):
+    std::vector<Market::Reservation> res;
+    for (int i = 1; i <= 10; i++) res.push_back(mkt->reserve(buyer, i));
+    EXPECT_DOUBLE_EQ(45, buyer->assets[money]);
+    for (int i = 1; i <= 10; i++) {
+        auto &r = res[i-1];
+        EXPECT_EQ(ReservationState::pending, r.state());
+        EXPECT_DOUBLE_EQ(i, r.quantity());
+        EXPECT_DOUBLE_EQ(i, r.price());
+        EXPECT_EQ(buyer, r.agent());
+        EXPECT_EQ(mkt, r.market);
+    }
+
+    // Destroying pending reservations releases them; their slots are then reused by new ones,
+    // which mustn't be affected by anything left over from the old reservations.
+    res[0].buy();
+    while (res.size() > 5) res.pop_back();
+    EXPECT_DOUBLE_EQ(85, buyer->assets[money]);
+    for (int i = 0; i < 3; i++) res.push_back(mkt->reserve(buyer, 2));
+    EXPECT_DOUBLE_EQ(79, buyer->assets[money]);
+    EXPECT_EQ(ReservationState::complete, res[0].state());
+    EXPECT_DOUBLE_EQ(2, res.back().quantity());
+
+    Market::buyAll(res);
+    EXPECT_DOUBLE_EQ(21, buyer->assets[x]);
+    EXPECT_DOUBLE_EQ(21, firm->assets[money]);
+    res.clear();
+    EXPECT_DOUBLE_EQ(79, buyer->assets[money]);
+}
+
+TEST_F(MarketTest, BatchSettlement) {
+    auto f1 = sim->spawn<TestQFirm>(x1, 10), f2 = sim->spawn<TestQFirm>(x1, 10);
+    auto mkt = sim->spawn<market::QMarket>(x1, m1, 1.0, 0, 0);
+    mkt->addFirm(f1);
+    mkt->addFirm(f2);
+    EXPECT_FALSE(mkt->batchSettlement());
+    EXPECT_EQ(0u, sim->others().size());
+    mkt->batchSettlement(true);
+    EXPECT_TRUE(mkt->batchSettlement());
+    EXPECT_EQ(1u, sim->others().size());
+
+    std::vector<SharedMember<IncomeSpender>> buyers;
+    for (int i = 0; i < 3; i++) {
+        buyers.push_back(sim->spawn<IncomeSpender>(mkt, 4));
+        buyers.back()->assets[money] = 4;
+    }
+
+    sim->run();
+
+    for (auto &b : buyers) {
+        EXPECT_DOUBLE_EQ(4, b->assets[x]);
+        EXPECT_DOUBLE_EQ(0, b->assets[money]);
+    }
+    EXPECT_DOUBLE_EQ(6, f1->assets[money]);
+    EXPECT_DOUBLE_EQ(6, f2->assets[money]);
+    EXPECT_DOUBLE_EQ(4, f1->assets[x]);
+    EXPECT_DOUBLE_EQ(4, f2->assets[x]);
+
+    // Outside the apply stage, purchases are still transferred immediately:
+    buyers[0]->assets[money] = 1;
+    auto res = mkt->reserve(buyers[0], 1);
+    res.buy();
+    EXPECT_DOUBLE_EQ(5, buyers[0]->assets[x]);
+
+    mkt->batchSettlement(false);
+    EXPECT_FALSE(mkt->batchSettlement());
+    EXPECT_EQ(0u, sim->others().size());
+
+    // Removing the market also removes its settlement callback
+    mkt->batchSettlement(true);
+    EXPECT_EQ(1u, sim->others().size());
+    sim->remove(mkt);
+    EXPECT_EQ(0u, sim->others().size());
+}
+
+TEST_F(MarketTest, BatchSettlementRemoved) {
+    // Removing the market, or just its settlement callback, after purchases have been queued but
+    // before they are settled still settles them.
+    for (bool remove_market : {true, false}) {
+        reset();
+        auto f = sim->spawn<TestQFirm>(x1, 10);
+        auto mkt = sim->spawn<market::QMarket>(x1, m1, 1.0, 0, 0);
+        mkt->addFirm(f);
+        mkt->batchSettlement(true);
+        ASSERT_EQ(1u, sim->others().size());
+        eris::id_t settler = sim->others().front()->id();
+
+        std::vector<SharedMember<IncomeSpender>> buyers;
+        for (int i = 0; i < 2; i++) {
+            buyers.push_back(sim->spawn<IncomeSpender>(mkt, 4));
+            buyers.back()->assets[money] = 4;
+        }
+        // Runs after the buyers have bought, but before settlement:
+        sim->spawn<intraopt::ApplyCallback>([&] { sim->remove(remove_market ? mkt->id() : settler); }, 0.5);
+
+        sim->run();
+
+        EXPECT_EQ(remove_market, sim->markets().empty());
+        EXPECT_FALSE(mkt->batchSettlement());
+        for (auto &b : buyers) {
+            EXPECT_DOUBLE_EQ(4, b->assets[x]);
+            EXPECT_DOUBLE_EQ(0, b->assets[money]);
+        }
+        EXPECT_DOUBLE_EQ(8, f->assets[money]);
+        EXPECT_DOUBLE_EQ(2, f->assets[x]);
+    }
+}
+
+TEST_F(MarketTest, Snapshot) {
+    auto bertrand = sim->spawn<market::Bertrand>(x1, m1);
+    auto f1 = sim->spawn<firm::PriceFirm>(x1, 3*m1, 1);
+    auto f2 = sim->spawn<firm::PriceFirm>(2*x1, 2*m1, 2);
+    auto f3 = sim->spawn<firm::PriceFirm>(x1, 2*m1, 0.5);
+    bertrand->addFirm(f1);
+    bertrand->addFirm(f2);
+    bertrand->addFirm(f3);
+
+    auto qmarket = sim->spawn<market::QMarket>(x1, m1, 2.0);
+    for (double cap : {3, 1}) {
+        auto f = sim->spawn<TestQFirm>(x1, cap);
+        f->assets[x] = cap;
+        qmarket->addFirm(f);
+    }
+
+    auto book = sim->spawn<market::OrderBook>(x1, m1);
+    auto f4 = sim->spawn<firm::PriceFirm>(x1, m1);
+    book->addFirm(f4);
+    book->ask(f4, 2, 3);
+    book->ask(f4, 1, 1);
+    book->ask(f4, 1.5, 2);
+    auto buyer = sim->spawn<Agent>();
+    buyer->assets[money] = 10;
+    auto res = book->reserve(buyer, 0.5);
+
+    for (SharedMember<Market> mkt : std::vector<SharedMember<Market>>{bertrand, qmarket, book}) {
+        auto snap = mkt->snapshot();
+        ASSERT_TRUE(snap);
+        for (double q : {0.0, 0.25, 1.0, 2.5, 4.0, 5.0, 5.5, 6.0, 100.0}) {
+            auto live = mkt->price(q), snapped = snap->price(q);
+            EXPECT_EQ(live.feasible, snapped.feasible);
+            if (live.feasible) {
+                EXPECT_DOUBLE_EQ(live.total, snapped.total);
+                EXPECT_DOUBLE_EQ(live.marginal, snapped.marginal);
+                EXPECT_DOUBLE_EQ(live.marginalFirst, snapped.marginalFirst);
+            }
+        }
+        for (double p : {0.0, 0.5, 1.0, 3.0, 6.0, 8.0, 100.0}) {
+            auto live = mkt->quantity(p), snapped = snap->quantity(p);
+            EXPECT_DOUBLE_EQ(live.quantity, snapped.quantity);
+            EXPECT_EQ(live.constrained, snapped.constrained);
+            EXPECT_DOUBLE_EQ(live.spent, snapped.spent);
+            EXPECT_DOUBLE_EQ(live.unspent, snapped.unspent);
+        }
+    }
+
+    // Snapshots don't change with the market
+    auto snap = bertrand->snapshot();
+    f2->setPrice(8*m1);
+    EXPECT_DOUBLE_EQ(1, snap->price(1).marginal);
+    EXPECT_DOUBLE_EQ(3, bertrand->price(1).marginal);
+}
+
+int main(int argc, char **argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
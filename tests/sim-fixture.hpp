@@ -0,0 +1,94 @@
+// Shared setup and helper classes for the simulation, market, firm, consumer, and optimizer tests.
+#pragma once
+
+#include <eris/Bundle.hpp>
+#include <eris/Simulation.hpp>
+#include <eris/Good.hpp>
+#include <eris/Optimize.hpp>
+#include <eris/firm/QFirm.hpp>
+#include <eris/market/Bertrand.hpp>
+#include <eris/market/QMarket.hpp>
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+/* Test fixture with a new simulation containing two goods, `money` and `x`, with `m1` and `x1`
+ * single-unit bundles of each.  Tests that need a fresh simulation more than once (e.g. to compare
+ * results from different settings) can call reset().
+ */
+class SimFixture : public ::testing::Test {
+    protected:
+        SimFixture() { reset(); }
+
+        // Replaces the simulation, goods, and bundles with new ones
+        void reset() {
+            sim = eris::Simulation::create();
+            money = sim->spawn<eris::Good>("money");
+            x = sim->spawn<eris::Good>("x");
+            m1 = eris::Bundle(money, 1);
+            x1 = eris::Bundle(x, 1);
+        }
+
+        std::shared_ptr<eris::Simulation> sim;
+        eris::SharedMember<eris::Good> money, x;
+        eris::Bundle m1, x1;
+};
+
+// QFirm leaves canProduceAny to subclasses; this one can't produce anything mid-period
+class TestQFirm : public eris::firm::QFirm {
+    public:
+        using QFirm::QFirm;
+        double canProduceAny(const eris::Bundle&) const override { return 0; }
+};
+
+// A unit-elastic buyer that spends all of its income in a single QMarket
+class IncomeSpender : public eris::Agent, public virtual eris::intraopt::OptApplyReset,
+        public virtual eris::market::QMarket::PriceTaker {
+    public:
+        IncomeSpender(eris::SharedMember<eris::market::QMarket> mkt, double income) : mkt_(mkt), income_(income) {}
+
+        Eigen::VectorXd demand(const eris::market::QMarket&, const Eigen::VectorXd &prices) const override {
+            return income_ * prices.array().inverse();
+        }
+
+        void intraOptimize() override {
+            double q = std::min(income_ / mkt_->price(), mkt_->quantity(income_).quantity);
+            if (q > 0) res_.push_back(mkt_->reserve(sharedSelf(), q));
+        }
+        void intraApply() override { for (auto &r : res_) r.buy(); res_.clear(); }
+        void intraReset() override { res_.clear(); }
+
+    private:
+        eris::SharedMember<eris::market::QMarket> mkt_;
+        double income_;
+        std::vector<eris::Market::Reservation> res_;
+};
+
+// Counts calls to price() and quantity()
+class CountingQMarket : public eris::market::QMarket {
+    public:
+        using QMarket::QMarket;
+        price_info price(double q) const override { ++price_calls; return QMarket::price(q); }
+        quantity_info quantity(double p) const override { ++quantity_calls; return QMarket::quantity(p); }
+        mutable int price_calls = 0, quantity_calls = 0;
+};
+
+// Counts calls to quantity()
+class CountingBertrand : public eris::market::Bertrand {
+    public:
+        using Bertrand::Bertrand;
+        quantity_info quantity(double p) const override { ++queries; return Bertrand::quantity(p); }
+        mutable int queries = 0;
+};
+
+// Requests a fixed number of reoptimizations, and counts how many times it has been optimized
+class RedoCounter : public eris::Agent, public virtual eris::intraopt::Optimize, public virtual eris::intraopt::Reoptimize {
+    public:
+        explicit RedoCounter(int redo) : redo_(redo) {}
+        void intraOptimize() override { ++optimized; }
+        bool intraReoptimize() override { return redo_-- > 0; }
+        int optimized = 0;
+    private:
+        int redo_;
+};
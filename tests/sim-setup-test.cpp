@@ -1,5 +1,6 @@
 // Test script for assorted Simulation setup tasks.
 
+#include "sim-fixture.hpp"
 #include <eris/Bundle.hpp>
 #include <eris/Simulation.hpp>
 #include <eris/consumer/Polynomial.hpp>
@@ -210,6 +211,63 @@ TEST(Dependencies, DeleteChain) {
 
 }
 
+TEST(Reduce, Agents) {
+    auto sim = Simulation::create();
+    auto m = sim->spawn<Good>("Money");
+    auto x = sim->spawn<Good>("x");
+
+    for (int i = 1; i <= 2000; i++) {
+        auto a = sim->spawn<Agent>();
+        a->assets[m] = i;
+        if (i % 2 == 0) a->assets[x] = 1;
+    }
+    sim->spawn<Polynomial>()->assets[x] = 1000;
+
+    auto assets = [](const SharedMember<Agent> &a) -> const Bundle& { return a->assets; };
+    Bundle expect {{m->id(), 2001000}, {x->id(), 2000}};
+
+    EXPECT_EQ(expect, sim->reduceAgents(assets, Bundle()));
+
+    // Threaded versions should give exactly the same result
+    for (unsigned long threads : {1, 3, 4, 16}) {
+        sim->maxThreads(threads);
+        EXPECT_EQ(expect, sim->reduceAgents(assets, Bundle()));
+    }
+
+    // Class filtering and a custom reduction:
+    EXPECT_EQ(1000, sim->reduceAgents<Polynomial>(assets, Bundle())[x]);
+    EXPECT_EQ(2000, sim->reduceAgents([m](const SharedMember<Agent> &a) { return a->assets[m]; }, 0.0,
+                [](double &max, double v) { if (v > max) max = v; }));
+}
+
+TEST(Simulation, PartitionedClearing) {
+    for (bool partitioned : {false, true}) {
+        for (bool unlinked : {false, true}) for (unsigned long threads : {0, 2}) {
+            auto sim = Simulation::create();
+            sim->maxThreads(threads);
+            sim->partitionedClearing(partitioned);
+            auto x = sim->spawn<Good>("x");
+            auto y = sim->spawn<Good>("y");
+            auto a = sim->spawn<RedoCounter>(3);
+            auto b = sim->spawn<RedoCounter>(0);
+            a->assets[x] = 1;
+            b->assets[y] = 1;
+            // An optimizer with no goods couples everything into a single component
+            if (unlinked) sim->spawn<RedoCounter>(0);
+
+            auto comp = sim->clearingComponents();
+            EXPECT_EQ(comp.at(a->id()), comp.at(x->id()));
+            EXPECT_EQ(unlinked, comp.at(a->id()) == comp.at(b->id()));
+
+            sim->run();
+            EXPECT_EQ(4, sim->intraopt_count);
+            EXPECT_EQ(4, a->optimized);
+            // b only needs to be redone if everything is coupled
+            EXPECT_EQ(partitioned and not unlinked ? 1 : 4, b->optimized);
+        }
+    }
+}
+
 int main(int argc, char **argv) {
     testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();